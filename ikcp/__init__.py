@@ -0,0 +1,2 @@
+"""KCP sessions for Python, see PyKcp. ikcp.aio drives them from asyncio."""
+from ._ikcp import *
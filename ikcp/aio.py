@@ -0,0 +1,77 @@
+"""
+asyncio integration: AioKcp drives a PyKcp from an asyncio loop with
+loop.add_reader on the engine's eventfd, no helper threads and no polling.
+"""
+import os
+import asyncio
+import collections
+
+from ._ikcp import SEND_WOULD_BLOCK
+
+class AioKcp:
+	def __init__(self, udp_kcp, on_recv=None, loop=None):
+		self.udp_kcp = udp_kcp
+		self.on_recv = on_recv
+		self.loop = loop or asyncio.get_event_loop()
+		self.fd = udp_kcp.event_fd()
+		self.messages = collections.deque()
+		self.recv_waiters = collections.deque()
+		self.drain_waiters = {}
+		self.loop.add_reader(self.fd, self._on_event)
+
+	def _on_event(self):
+		try:
+			os.read(self.fd, 8)
+		except BlockingIOError:
+			pass
+
+		for client, data in self.udp_kcp.recv_nowait():
+			if self.on_recv:
+				self.loop.create_task(self.on_recv(self, client, data))
+				continue
+			while self.recv_waiters and self.recv_waiters[0].done():
+				self.recv_waiters.popleft()
+			if self.recv_waiters:
+				self.recv_waiters.popleft().set_result((client, data))
+			else:
+				self.messages.append((client, data))
+
+		for client in self.udp_kcp.writable_clients():
+			for fut in self.drain_waiters.pop((client.nip, client.nport), []):
+				if not fut.done():
+					fut.set_result(None)
+
+	async def recv(self):
+		if self.messages:
+			return self.messages.popleft()
+		fut = self.loop.create_future()
+		self.recv_waiters.append(fut)
+		return await fut
+
+	async def drain(self, client, low_water=-1):
+		if self.udp_kcp.want_writable(client, low_water):
+			return
+		fut = self.loop.create_future()
+		self.drain_waiters.setdefault((client.nip, client.nport), []).append(fut)
+		await fut
+
+	def send(self, client, data, flush=True):
+		if flush:
+			return self.udp_kcp.send_and_flush(client, data)
+		return self.udp_kcp.send_pkg(client, data)
+
+	async def send_wait(self, client, data, flush=True):
+		# suspends while the client is at its high watermark
+		while True:
+			ret = self.send(client, data, flush)
+			if ret != SEND_WOULD_BLOCK:
+				return ret
+			await self.drain(client)
+
+	def close(self):
+		self.loop.remove_reader(self.fd)
+		for fut in self.recv_waiters:
+			fut.cancel()
+		for futs in self.drain_waiters.values():
+			for fut in futs:
+				fut.cancel()
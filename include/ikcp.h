@@ -261,6 +261,28 @@ typedef struct IQUEUEHEAD iqueue_head;
 #endif
 
 
+//=====================================================================
+// SHARED PAYLOAD
+//=====================================================================
+// refcounted fragment payload, referenced by segments of many kcp objects
+struct IKCPBODY
+{
+	IUINT32 refcnt;
+	IUINT32 len;
+	char data[1];
+};
+
+// a message split once into fragment bodies, see ikcp_send_shared
+struct IKCPMSG
+{
+	IUINT32 mss;
+	IUINT32 count;
+	struct IKCPBODY *frags[1];
+};
+
+typedef struct IKCPMSG ikcpmsg;
+
+
 //=====================================================================
 // SEGMENT
 //=====================================================================
@@ -279,6 +301,9 @@ struct IKCPSEG
 	IUINT32 rto;
 	IUINT32 fastack;
 	IUINT32 xmit;
+	IUINT32 cap;			// bytes allocated for data
+	IUINT32 key;			// conflation key while in snd_queue, 0 for none
+	struct IKCPBODY *body;	// shared payload, NULL when it lives in data
 	char data[1];
 };
 
@@ -301,8 +326,11 @@ struct IKCPCB
 	IUINT32 dead_link, incr;
 	struct IQUEUEHEAD snd_queue;
 	struct IQUEUEHEAD rcv_queue;
-	struct IQUEUEHEAD snd_buf;
-	struct IQUEUEHEAD rcv_buf;
+	struct IKCPSEG **snd_buf;		// segments in flight by sn & snd_mask, NULL once acked
+	IUINT32 snd_mask;		// slots - 1, the slot count is a power of two
+	struct IKCPSEG **rcv_buf;		// segments past rcv_nxt by sn & rcv_mask
+	IUINT64 *rcv_bits;		// bit sn & rcv_mask is set while rcv_buf holds sn
+	IUINT32 rcv_mask;		// slots - 1, a power of two and at least 64
 	IUINT32 *acklist;
 	IUINT32 ackcount;
 	IUINT32 ackblock;
@@ -312,6 +340,7 @@ struct IKCPCB
 	int fastlimit;
 	int nocwnd, stream;
 	int logmask;
+	int outflags;
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
 };
@@ -332,6 +361,9 @@ typedef struct IKCPCB ikcpcb;
 #define IKCP_LOG_OUT_PROBE		1024
 #define IKCP_LOG_OUT_WINS		2048
 
+// kcp->outflags, valid inside the output callback
+#define IKCP_OUT_RETRANS		1	// buffer carries a retransmitted segment
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -406,6 +438,26 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 // read conv
 IUINT8 ikcp_getconv(const void *ptr);
 
+// split a message into refcounted fragments of at most 'mss' bytes,
+// returns NULL if it needs too many fragments
+ikcpmsg* ikcp_msg_create(const char *buffer, int len, int mss);
+
+// drop the creator's reference, queued segments keep their fragments
+void ikcp_msg_release(ikcpmsg *msg);
+
+// queue a shared message without copying its payload, returns below
+// zero for error (-3 if the message mss is larger than kcp->mss)
+int ikcp_send_shared(ikcpcb *kcp, const ikcpmsg *msg);
+
+// queue a message under a non-zero key, a message with the same key
+// still waiting in snd_queue with all of its fragments is replaced at
+// its position. returns 1 if one was replaced, 0 if queued at the tail,
+// below zero for error. on replacement 'behind' (may be NULL) receives
+// the number of segments queued after it, their future sn shift by the
+// change in nsnd_que
+int ikcp_send_keyed(ikcpcb *kcp, IUINT32 key, const char *buffer, int len,
+	int *behind);
+
 
 #ifdef __cplusplus
 }
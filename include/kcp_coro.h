@@ -0,0 +1,131 @@
+#ifndef __KCP_CORO_H__
+#define __KCP_CORO_H__
+
+/*
+ * C++20 coroutines on top of KcpEngine. Every coroutine runs on the
+ * dispatcher thread: spawn() starts it there, and the recv, writable,
+ * create and clean events of a session resume whoever awaits it. Awaiters
+ * live in the coroutine frame and the session events are preallocated, so
+ * an awaited recv or send allocates nothing once the session is warm.
+ *
+ *   KcpTask echo(KcpSession session)
+ *   {
+ *       while (auto msg = co_await session.recv())
+ *           if (co_await session.send(msg->data(), msg->size()) < 0)
+ *               break;
+ *   }
+ *
+ *   KcpTask serve(KcpCoroEngine &engine)
+ *   {
+ *       while (true)
+ *           engine.spawn(echo(co_await engine.accept()));
+ *   }
+ *
+ * The engine owns the create, clean, recv and writable callbacks. One
+ * coroutine at a time may await recv, send or accept on the same object.
+ * Coroutines still suspended when the engine stops are never resumed.
+ */
+
+#include "kcp_engine.h"
+
+#include <utility>
+#include <string_view>
+
+class KcpCoroEngine;
+
+/* Fire and forget coroutine, the frame is freed when its body returns. */
+class KcpTask {
+public:
+	struct promise_type {
+		KcpTask get_return_object() { return KcpTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception();
+	};
+
+	KcpTask(KcpTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	KcpTask(const KcpTask &) = delete;
+	KcpTask &operator=(const KcpTask &) = delete;
+	~KcpTask() { if (handle) handle.destroy(); }
+
+	/* hands the suspended coroutine over, KcpCoroEngine::spawn resumes it */
+	std::coroutine_handle<> release() { return std::exchange(handle, nullptr); }
+
+private:
+	explicit KcpTask(std::coroutine_handle<> h) : handle(h) {}
+	std::coroutine_handle<> handle;
+};
+
+struct KcpSession;
+
+struct KcpRecvAwaiter {
+	KcpSession *session;
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	/* the next message, valid until the next recv on the session; nullopt once it is closed */
+	std::optional<std::string_view> await_resume();
+};
+
+struct KcpSendAwaiter {
+	KcpSession *session;
+	const char *buf;
+	size_t size;
+	bool flush;
+	int ret;
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	/* what send_buffer returned, -1 if the session closed while waiting */
+	int await_resume();
+};
+
+struct KcpAcceptAwaiter {
+	KcpCoroEngine *engine;
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	KcpSession await_resume();
+};
+
+struct KcpSession {
+	KcpCoroEngine *engine = nullptr;
+	std::shared_ptr<KcpClient> client;
+
+	KcpRecvAwaiter recv() { return {this}; }
+	/* suspends while the session is over its high watermark */
+	KcpSendAwaiter send(const char *buf, size_t size, bool flush = true) { return {this, buf, size, flush, 0}; }
+	KcpSendAwaiter send(std::string_view buf, bool flush = true) { return send(buf.data(), buf.size(), flush); }
+	bool closed() const { return client->closed; }
+	int trySend(const char *buf, size_t size, bool flush);
+};
+
+class KcpCoroEngine : public KcpEngine {
+public:
+	KcpCoroEngine(std::string ip, uint16_t port, int32_t time_out = 6, bool atomicSem = false, bool reuse_port = false);
+
+	/* runs task on the dispatcher thread, callable from any thread */
+	void spawn(KcpTask task);
+	KcpAcceptAwaiter accept() { return {this}; }
+	/* opens a session to ip:port, await it from a spawned coroutine */
+	KcpSession connect(std::string ip, uint16_t port);
+	/* watermarks given to new sessions, send() never suspends with high 0 */
+	int session_watermark(int high, int low);
+
+protected:
+	void deliverRecv(std::shared_ptr<KcpClient> client) override;
+
+private:
+	friend struct KcpAcceptAwaiter;
+
+	void onCreate(std::shared_ptr<KcpClient> client);
+	void onClean(std::shared_ptr<KcpClient> client);
+	void onWritable(std::shared_ptr<KcpClient> client);
+	static void wake(std::coroutine_handle<> &waiter);
+
+	int highWater = 256;
+	int lowWater = 128;
+	/* incoming sessions nobody accepted yet, dispatcher thread only */
+	std::deque<std::shared_ptr<KcpClient>> acceptQueue;
+	std::coroutine_handle<> acceptWaiter;
+};
+
+#endif
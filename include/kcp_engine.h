@@ -0,0 +1,646 @@
+#ifndef __KCP_ENGINE_H__
+#define __KCP_ENGINE_H__
+
+/*
+ * The session engine behind the ikcp Python module: UDP sockets, the
+ * receive, update and dispatcher threads, and every per-session feature.
+ * It has no Python dependency, C++ programs link the kcp_engine library.
+ *
+ * Construct a KcpEngine, install callbacks, then call start(). Callbacks
+ * run on the dispatcher thread except an admission create callback, which
+ * runs on the receive thread before the session exists.
+ */
+
+#include "ikcp.h"
+#include "kcp_plugin.h"
+
+#include <map>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <tuple>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <coroutine>
+#include <iostream>
+#include <optional>
+#include <semaphore>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+class SpinLock {
+public:
+	SpinLock() : flag(false) {}
+
+	void lock() {
+		while (flag.exchange(true, std::memory_order_acquire)) {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+			// x86 PAUSE instruction
+			asm volatile("pause" ::: "memory");
+#elif defined(__arm__) || defined(__aarch64__) || defined(__APPLE__)
+			// ARM, ARM64, and Apple M series WFE instruction
+			asm volatile("wfe" ::: "memory");
+#else
+			// Fallback to yield
+			std::this_thread::yield();
+#endif
+		}
+	}
+
+	void unlock() {
+		flag.store(false, std::memory_order_release);
+#if defined(__arm__) || defined(__aarch64__) || defined(__APPLE__)
+		// ARM, ARM64, and Apple M series SEV instruction
+		asm volatile("sev" ::: "memory");
+#endif
+	}
+
+private:
+	std::atomic<bool> flag;
+};
+
+class AtomicSemaphore {
+public:
+	AtomicSemaphore(int count = 0) : count(count) {}
+
+	void notify() {
+		count.fetch_add(1, std::memory_order_release);
+	}
+
+	void wait() {
+		while (true) {
+			int expected = count.load(std::memory_order_relaxed);
+			if (expected > 0 && count.compare_exchange_weak(expected, expected - 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+				break;
+			}
+			std::this_thread::yield();
+		}
+	}
+
+private:
+	std::atomic<int> count;
+};
+
+class SemaphoreProxy {
+public:
+	SemaphoreProxy(int count = 0, bool _atomicSem = false) : semaphore(count), atomicSemaphore(count) {
+		atomicSem = _atomicSem;
+	}
+
+	void notify() {
+		if (atomicSem)
+			atomicSemaphore.notify();
+		else
+			semaphore.release();
+	}
+
+	void wait() {
+		if (atomicSem)
+			atomicSemaphore.wait();
+		else
+			semaphore.acquire();
+	}
+
+private:
+	bool atomicSem;
+	std::counting_semaphore<999> semaphore;
+	AtomicSemaphore atomicSemaphore;
+};
+
+class KcpEngine;
+struct KcpClient;
+struct ShmChannel;
+
+enum CallbackEventType {
+	EVENT_CREATE,
+	EVENT_CLEAN,
+	EVENT_RECV,
+	EVENT_ACKED,
+	EVENT_WRITABLE,
+	EVENT_RPC,
+	EVENT_RESUME,
+};
+
+struct CallbackEvent {
+	CallbackEventType type;
+	std::shared_ptr<KcpClient> client;
+	CallbackEvent *next;
+	/* one framed message for EVENT_RPC */
+	std::string data;
+	/* coroutine continued by EVENT_RESUME */
+	std::coroutine_handle<> handle;
+	/* embedded in its KcpClient and reused instead of being freed */
+	bool pooled = false;
+};
+
+/*
+ * Multi-producer single-consumer event queue. Producers push onto a
+ * lock-free stack; the consumer takes the whole stack at once and
+ * reverses it, which gives FIFO batches without a lock on either side.
+ */
+class EventQueue {
+public:
+	void push(CallbackEvent *event) {
+		CallbackEvent *head = top.load(std::memory_order_relaxed);
+		do {
+			event->next = head;
+		} while (!top.compare_exchange_weak(head, event, std::memory_order_release, std::memory_order_relaxed));
+		wake();
+	}
+
+	CallbackEvent *takeAll() {
+		CallbackEvent *list = top.exchange(nullptr, std::memory_order_acquire);
+		CallbackEvent *fifo = nullptr;
+		while (list) {
+			CallbackEvent *next = list->next;
+			list->next = fifo;
+			fifo = list;
+			list = next;
+		}
+		return fifo;
+	}
+
+	void wait() {
+		pending.store(false, std::memory_order_release);
+		if (top.load(std::memory_order_acquire))
+			return;
+		pending.wait(false, std::memory_order_acquire);
+	}
+
+	void wake() {
+		if (!pending.exchange(true, std::memory_order_acq_rel))
+			pending.notify_one();
+	}
+
+private:
+	std::atomic<CallbackEvent *> top{nullptr};
+	std::atomic<bool> pending{false};
+};
+
+/*
+ * RPC framing, every message of an RPC enabled engine starts with
+ *   request: RPC_REQUEST, varint call id, varint method, payload
+ *   reply:   RPC_REPLY, varint call id, status, payload
+ */
+#define RPC_REQUEST 1
+#define RPC_REPLY 2
+
+enum RpcStatus {
+	RPC_OK = 0,
+	RPC_NO_METHOD = 1,
+	RPC_HANDLER_ERROR = 2,
+	RPC_SESSION_CLOSED = 3,
+};
+
+/* handler(engine, client, call_id, payload, len), replies now or later with rpc_reply */
+typedef std::function<void(KcpEngine *, std::shared_ptr<KcpClient>, uint64_t, const char *, size_t)> RpcHandler;
+/* done(engine, call_id, status, payload, len), called once per call on the dispatcher thread */
+typedef std::function<void(KcpEngine *, uint64_t, int, const char *, size_t)> RpcDone;
+
+struct RpcCall {
+	RpcDone done;
+	std::shared_ptr<KcpClient> client;
+};
+
+/* fragments per message of a file transfer, ikcp_send allows up to IKCP_WND_RCV - 1 */
+#define FILE_CHUNK_FRAGS 64
+/* messages a file transfer queues per pumpFile call, each under its own kcp_lock hold */
+#define FILE_PUMP_CHUNKS 4
+
+/* Outgoing file region, mapped read-only and fed to ikcp_send as the window drains. */
+struct FileSend {
+	char *map = nullptr;
+	size_t mapLen = 0;
+	/* offset of the first byte inside map, the mapping starts page aligned */
+	size_t skew = 0;
+	uint64_t length = 0;
+	uint64_t sent = 0;
+	size_t released = 0;
+
+	~FileSend() {
+		if (map)
+			munmap(map, mapLen);
+	}
+};
+
+/* Incoming file, messages of the session are written to fd until length bytes arrived. */
+struct FileRecv {
+	int fd = -1;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	uint64_t written = 0;
+
+	~FileRecv() {
+		if (fd >= 0)
+			close(fd);
+	}
+};
+
+/* send result while ikcp_waitsnd is at the high watermark of the session */
+#define SEND_WOULD_BLOCK -11
+
+#define MAX_PATHS 4
+#define RECV_BUFFER_SIZE 2048
+
+enum MultipathMode {
+	MULTIPATH_DUPLICATE = 0,	/* every datagram on every path */
+	MULTIPATH_RETRANS = 1,		/* fastest path, retransmissions on every path */
+	MULTIPATH_FASTEST = 2,		/* fastest path only, periodic probe on all */
+};
+
+/* A datagram waiting in the egress scheduler together with its kcp->outflags. */
+struct Datagram {
+	std::string data;
+	int flags;
+};
+
+/* Output of a batched flush, collected by kcpOutput on the flushing thread. */
+struct OutputBatch {
+	std::vector<KcpClient *> clients;
+	std::vector<Datagram> datagrams;
+};
+
+/* Token bucket state for one peer address, refilled lazily on each datagram. */
+struct PeerLimit {
+	uint64_t key;
+	double pktTokens;
+	double byteTokens;
+	uint64_t lastUs;
+	uint64_t droppedPkts = 0;
+	uint64_t droppedBytes = 0;
+};
+
+/* peers the inbound limiter tracks, the least recently seen one is forgotten beyond it */
+#define PEER_LIMIT_MAX 65536
+/* how long a peer refused by the create callback is dropped without asking again */
+#define CREATE_REJECT_MS 1000
+/* refused peers remembered at once, the oldest mark is dropped beyond it */
+#define CREATE_REJECT_MAX 65536
+
+typedef std::function<bool(KcpEngine *, std::shared_ptr<KcpClient>)> CreateCallback;
+typedef std::function<void(KcpEngine *, std::shared_ptr<KcpClient>)> ClientCallback;
+typedef std::function<void(KcpEngine *, std::shared_ptr<KcpClient>, const char *, size_t)> RecvCallback;
+typedef std::function<void(KcpEngine *, std::shared_ptr<KcpClient>, const std::vector<uint64_t> &)> AckedCallback;
+
+class KcpEngine {
+public:
+	KcpEngine(std::string ip, uint16_t port, int32_t time_out = 6, bool atomicSem = false, bool reuse_port = false);
+	virtual ~KcpEngine();
+	void start();
+	void stop();
+	bool stopping() const { return exit; }
+	uint64_t getTimeMs();
+	uint32_t getBoottimeMs(std::shared_ptr<KcpClient> client);
+
+	void set_conv(uint32_t conv);
+	void set_create_cb(CreateCallback callback, bool admission = false);
+	void set_clean_cb(ClientCallback callback);
+	void set_recv_cb(RecvCallback callback);
+	void set_acked_cb(AckedCallback callback);
+	void set_writable_cb(ClientCallback callback);
+	std::shared_ptr<KcpClient> new_client(std::string ip, uint16_t hport);
+	int client_wndsize(std::shared_ptr<KcpClient> client, int sndwnd, int rcvsnd);
+	int client_nodelay(std::shared_ptr<KcpClient> client, int nodelay, int interval, int resend, int nc);
+
+	/* receiving without a recv callback */
+	int peek_size(std::shared_ptr<KcpClient> client);
+	/* segments queued or unacknowledged, ikcp_waitsnd */
+	int waitsnd(std::shared_ptr<KcpClient> client);
+	int recv(std::shared_ptr<KcpClient> client, char *buf, int len);
+	std::vector<std::shared_ptr<KcpClient>> ready_clients();
+	void wait_any();
+	bool wait_readable(std::shared_ptr<KcpClient> client, std::optional<std::chrono::steady_clock::time_point> deadline);
+
+	int send_buffer(std::shared_ptr<KcpClient> client, const char *buf, ssize_t size);
+	int64_t send_tracked(std::shared_ptr<KcpClient> client, const char *buf, ssize_t size);
+	int64_t send_and_flush(std::shared_ptr<KcpClient> client, const char *buf, ssize_t size, bool track = false);
+	int send_keyed(std::shared_ptr<KcpClient> client, uint32_t key, const char *buf, ssize_t size, bool flush = false);
+	void flush(std::shared_ptr<KcpClient> client);
+	void flush_batch(const std::vector<std::shared_ptr<KcpClient>> &targets);
+	std::vector<uint64_t> acked(std::shared_ptr<KcpClient> client);
+	int client_watermark(std::shared_ptr<KcpClient> client, int high, int low = 0);
+	bool want_writable(std::shared_ptr<KcpClient> client, int low_water = -1);
+	std::vector<std::shared_ptr<KcpClient>> writable_clients();
+	int event_fd();
+
+	int client_stream(std::shared_ptr<KcpClient> client, bool enable);
+	int64_t stream_write(std::shared_ptr<KcpClient> client, const char *buf, ssize_t size, bool flush = false);
+	size_t stream_fill(std::shared_ptr<KcpClient> client, size_t n);
+	void stream_consume(std::shared_ptr<KcpClient> client, size_t len);
+	ssize_t stream_read(std::shared_ptr<KcpClient> client, char *buf, size_t n, double timeout = -1);
+
+	int send_file(std::shared_ptr<KcpClient> client, int fd, uint64_t offset = 0, uint64_t length = 0);
+	int recv_file(std::shared_ptr<KcpClient> client, int fd, uint64_t length, uint64_t offset = 0);
+	std::map<std::string, int64_t> file_status(std::shared_ptr<KcpClient> client);
+
+	void rpc_enable();
+	void rpc_register(uint32_t method, RpcHandler handler);
+	int64_t rpc_call(std::shared_ptr<KcpClient> client, uint32_t method, const char *buf, ssize_t size, RpcDone done, bool flush = true);
+	int rpc_reply(std::shared_ptr<KcpClient> client, uint64_t call_id, const char *buf, ssize_t size, int status = RPC_OK, bool flush = true);
+
+	void set_plugin(const kcp_plugin *handler);
+	static const kcp_plugin *load_plugin(const std::string &path, const std::string &symbol = "kcp_plugin");
+	int join_reuseport(uint32_t worker, uint32_t workers, std::string pin_path = "");
+
+	int create_group();
+	void remove_group(int gid);
+	int group_add(int gid, std::shared_ptr<KcpClient> client);
+	int group_remove(int gid, std::shared_ptr<KcpClient> client);
+	int group_send(int gid, const char *buf, ssize_t size, bool flush = true);
+
+	int set_sockbuf(int rcvbuf, int sndbuf = 0);
+	void set_sockbuf_auto(bool enable, int max_bytes = 0);
+	std::map<std::string, uint64_t> sock_stats();
+	void set_rate_limit(uint32_t pps, uint32_t bps = 0, uint32_t burst_ms = 100);
+	std::vector<std::tuple<uint32_t, uint16_t, uint64_t, uint64_t>> rate_limit_stats();
+	void set_fair_output(bool enable, uint32_t quantum = 1500);
+	void client_weight(std::shared_ptr<KcpClient> client, uint32_t weight);
+	int add_path(std::string ip, uint16_t port, std::string ifname = "");
+	int client_add_path(std::shared_ptr<KcpClient> client, int path, std::string ip, uint16_t hport);
+	void set_multipath_mode(int mode);
+	std::vector<std::tuple<int, uint32_t, uint16_t, uint32_t, uint64_t>> multipath_stats(std::shared_ptr<KcpClient> client);
+	/* carry the datagrams of peers on this host through shared memory, both engines enable it before new_client */
+	int set_shm(bool enable);
+
+protected:
+	/* runs a batch of events on the dispatcher thread, bindings wrap it in their interpreter lock */
+	virtual void dispatchBatch(CallbackEvent *batch);
+	/* hands the complete messages of a client to the recv callback */
+	virtual void deliverRecv(std::shared_ptr<KcpClient> client);
+	void dispatchEvent(CallbackEvent *event);
+	bool hasRecvCallback() const { return (bool)mOnRecv; }
+	/* frees a dispatched event unless it belongs to its session */
+	static void releaseEvent(CallbackEvent *event) { if (!event->pooled) delete event; }
+	/* resumes handle on the dispatcher thread */
+	void post(std::coroutine_handle<> handle);
+
+private:
+	int openSocket(std::string ip, uint16_t port, std::string ifname);
+	std::shared_ptr<KcpClient> findOrNewClient(uint32_t nip, uint16_t nport, int path = 0, bool outbound = false);
+	static int kcpOutputCallback(const char *buf, int len,
+		ikcpcb *kcp, void *user);
+	int kcpOutput(const char *buf, int len,
+		ikcpcb *kcp, void *user);
+	void recvLoop(int path);
+	void input(std::shared_ptr<KcpClient> client, const char *data, ssize_t len);
+	void updateLoop();
+	void dispatchLoop();
+	bool collectAcked(std::shared_ptr<KcpClient> client);
+	bool overHighWater(std::shared_ptr<KcpClient> client);
+	void pumpFile(std::shared_ptr<KcpClient> client);
+	bool sinkFile(std::shared_ptr<KcpClient> client);
+	void pluginInput(std::shared_ptr<KcpClient> client);
+	static int pluginSend(void *engine, void *session, const char *buf, int len);
+	static void pluginFlush(void *engine, void *session);
+	static void pluginPeer(void *session, unsigned int *nip, unsigned short *nport);
+	static const kcp_plugin_api pluginApi;
+	void flushClient(std::shared_ptr<KcpClient> client);
+	void rpcInput(std::shared_ptr<KcpClient> client);
+	void rpcDispatch(std::shared_ptr<KcpClient> client, const std::string &msg);
+	void rpcFail(std::shared_ptr<KcpClient> client);
+	int rpcSend(std::shared_ptr<KcpClient> client, std::string &frame, const char *buf, ssize_t size, bool flush, bool reply);
+	void signalEvent();
+	void markWritable(std::shared_ptr<KcpClient> client);
+	void notifyOwner(std::shared_ptr<KcpClient> client);
+	void closeOwner(std::shared_ptr<KcpClient> client);
+	void pushEvent(CallbackEventType type, std::shared_ptr<KcpClient> client);
+	void dropClient(std::shared_ptr<KcpClient> client);
+	int pickPaths(KcpClient *client, int flags);
+	void transmit(KcpClient *client, const char *buf, int len, int flags);
+	void transmitBatch(OutputBatch &batch);
+	void updatePathRtt(std::shared_ptr<KcpClient> client, int slot, const char *data, ssize_t len);
+	ssize_t sendDatagram(int fd, uint32_t nip, uint16_t nport, const char *buf, int len);
+	void drainOutput();
+	bool shmTransmit(KcpClient *client, const char *buf, int len);
+	void shmAttach(std::shared_ptr<KcpClient> client);
+	void shmRegister(std::shared_ptr<ShmChannel> channel);
+	void shmAcceptAll();
+	void shmHello(ShmChannel *pending, std::vector<std::shared_ptr<ShmChannel>> &retired);
+	void shmDetach(ShmChannel *channel, std::vector<std::shared_ptr<ShmChannel>> &retired);
+	bool shmDrain(ShmChannel *channel);
+	void shmLoop();
+
+	bool rateLimited(uint32_t nip, uint16_t nport, ssize_t len);
+	PeerLimit &peerEntry(uint64_t key, uint64_t nowUs);
+	void rejectPeer(uint32_t nip, uint16_t nport);
+	bool peerRejected(uint32_t nip, uint16_t nport);
+
+	void applySockBuf(int fd, int opt, int force_opt, int bytes);
+	int setSockBuf(int opt, int force_opt, int bytes);
+	void growSockBuf(int opt, int force_opt, std::atomic<int> &cur);
+
+	int sockfd = -1;
+	std::atomic<bool> exit{false};
+	uint32_t conv = 0x55;
+
+	/* SO_REUSEPORT group shared by worker processes, see join_reuseport */
+	bool reusePort = false;
+	int reuseMapFd = -1;
+	int reuseProgFd = -1;
+
+	/* local sockets, path 0 is sockfd */
+	int pathFds[MAX_PATHS];
+	std::thread *pathThreads[MAX_PATHS] = {};
+	std::atomic<int> pathCount{0};
+	std::atomic<int> multipathMode{MULTIPATH_DUPLICATE};
+	/* peer addresses of secondary paths, mapped to the session owning them */
+	std::map<uint64_t, std::shared_ptr<KcpClient>> pathAliases;
+	std::atomic<bool> multipathInUse{false};
+
+	/* socket buffer tuning, sizes are the values reported by the kernel */
+	std::atomic<int> rcvBufSize{0};
+	std::atomic<int> sndBufSize{0};
+	std::atomic<bool> bufAutoTune{false};
+	/* last size asked for, set by the recv threads when tuning and read by add_path */
+	std::atomic<int> rcvBufWant{0};
+	std::atomic<int> sndBufWant{0};
+	std::atomic<int> bufAutoMax{16 * 1024 * 1024};
+
+	/* sum of the per-socket SO_RXQ_OVFL drop counters */
+	std::atomic<uint64_t> kernelDrops{0};
+	std::atomic<uint64_t> rxPackets{0};
+	std::atomic<uint64_t> rxBytes{0};
+	std::atomic<uint64_t> txPackets{0};
+	std::atomic<uint64_t> txBytes{0};
+	std::atomic<uint64_t> txErrors{0};
+
+	/* same host channels, see set_shm; shmThread drains them and alone drops them from shmOwned */
+	std::atomic<bool> shmEnabled{false};
+	int shmListenFd = -1;
+	int shmEpollFd = -1;
+	std::thread *shmThread = nullptr;
+	/* by peer address, what new sessions attach to */
+	std::unordered_map<uint64_t, std::shared_ptr<ShmChannel>> shmChannels;
+	/* everything registered on shmEpollFd */
+	std::unordered_map<ShmChannel *, std::shared_ptr<ShmChannel>> shmOwned;
+	/* accepted channels waiting for their hello and when they are dropped, shmThread only */
+	std::unordered_map<ShmChannel *, uint64_t> shmPending;
+	std::mutex shm_lock;
+	std::atomic<uint64_t> shmTxPackets{0};
+	std::atomic<uint64_t> shmRxPackets{0};
+
+	/* per-peer inbound limiter, 0 disables the corresponding bucket */
+	uint32_t limitPps = 0;
+	uint32_t limitBps = 0;
+	uint32_t limitBurstMs = 100;
+	/* most recently seen peer first, peerLimits finds its entry, see peerEntry */
+	std::list<PeerLimit> peerLru;
+	std::unordered_map<uint64_t, std::list<PeerLimit>::iterator> peerLimits;
+	SpinLock limit_lock;
+
+	/* peers the create callback refused, address to deadline; rejectOrder holds the marks oldest first */
+	std::unordered_map<uint64_t, uint64_t> rejectedPeers;
+	std::deque<std::pair<uint64_t, uint64_t>> rejectOrder;
+	SpinLock reject_lock;
+
+	/* deficit round robin egress, sessions with queued datagrams wait in drrActive */
+	std::atomic<bool> fairOutput{false};
+	uint32_t drrQuantum = 1500;
+	std::deque<std::shared_ptr<KcpClient>> drrActive;
+	SpinLock egress_lock;
+	std::mutex drain_lock;
+
+	/* broadcast groups, members are dropped once their session is cleaned */
+	std::map<int, std::vector<std::weak_ptr<KcpClient>>> groups;
+	int nextGroupId = 1;
+	std::mutex group_lock;
+
+	/* eventfd integration, replaces the semaphore once event_fd() was called */
+	std::atomic<int> eventFd{-1};
+	std::vector<std::shared_ptr<KcpClient>> writableClients;
+	std::mutex event_lock;
+
+	/* native handler, receives every message on the recv thread */
+	std::atomic<const kcp_plugin *> plugin{nullptr};
+
+	/* RPC layer, pending calls and handlers are guarded by rpc_lock */
+	std::atomic<bool> rpcMode{false};
+	std::atomic<uint64_t> rpcNextId{1};
+	std::unordered_map<uint64_t, RpcCall> rpcCalls;
+	std::map<uint32_t, RpcHandler> rpcHandlers;
+	std::mutex rpc_lock;
+
+	SemaphoreProxy semaphore;
+	uint64_t timeOutMs;
+	SpinLock kcp_lock;
+
+	CreateCallback mOnCreate;
+	ClientCallback mOnClean;
+	RecvCallback mOnRecv;
+	AckedCallback mOnAcked;
+	ClientCallback mOnWritable;
+	/* create callback decides admission inline on the recv thread */
+	bool createAdmission = false;
+	/* every callback runs on dispatchThread */
+	EventQueue events;
+	std::thread *dispatchThread = nullptr;
+
+	std::map<uint64_t, std::shared_ptr<KcpClient>> clients;
+	std::shared_mutex client_lock;
+	std::thread *updateThread = nullptr;
+};
+
+/* One way to reach the peer: a local socket and the peer address behind it. */
+struct PeerPath {
+	int path;
+	uint32_t nip;
+	uint16_t nport;
+	std::atomic<uint32_t> srtt{0};
+	std::atomic<uint64_t> txPackets{0};
+};
+
+struct KcpClient : std::enable_shared_from_this<KcpClient> {
+	ikcpcb *kcp;
+	KcpEngine *engine;
+	uint32_t nextUpdate;
+	uint32_t nip;
+	uint16_t nport;
+	uint64_t startTimeMs;
+	uint64_t lastTimeMs;
+	/* opened locally with new_client rather than by an incoming packet */
+	bool outbound = false;
+	/* egress scheduler state, guarded by KcpEngine::egress_lock */
+	std::deque<Datagram> outQueue;
+	uint32_t weight = 1;
+	int64_t deficit = 0;
+	bool drrQueued = false;
+	/* paths[0] is the address the session was created with */
+	PeerPath paths[MAX_PATHS];
+	/* set before the session is published, replaces the paths while the peer is attached */
+	std::shared_ptr<ShmChannel> shm;
+	std::atomic<int> npaths{0};
+	uint64_t lastProbeMs = 0;
+	/* set by want_writable, cleared when ikcp_waitsnd falls to drainLowWater */
+	std::atomic<bool> drainWanted{false};
+	int drainLowWater = 0;
+	/* send backpressure on ikcp_waitsnd, highWater 0 disables it */
+	int highWater = 0;
+	int lowWater = 0;
+	/* an EVENT_RECV for this session is waiting in the dispatcher queue */
+	std::atomic<bool> recvQueued{false};
+	std::atomic<bool> writableQueued{false};
+	/* at most one of each is queued, see the flags above */
+	CallbackEvent recvEvent{EVENT_RECV, nullptr, nullptr, {}, {}, true};
+	CallbackEvent ackedEvent{EVENT_ACKED, nullptr, nullptr, {}, {}, true};
+	CallbackEvent writableEvent{EVENT_WRITABLE, nullptr, nullptr, {}, {}, true};
+	/* (sn of the last fragment, message id), oldest first, guarded by kcp_lock */
+	std::deque<std::pair<uint32_t, uint64_t>> inflight;
+	uint64_t nextMsgId = 1;
+	/* ids delivered but not yet reported */
+	std::vector<uint64_t> ackedIds;
+	std::mutex ackMutex;
+	std::atomic<bool> ackQueued{false};
+	/* stream mode bytes taken from kcp but not yet read, only touched by the reader */
+	std::string streamRx;
+	size_t streamRxPos = 0;
+	/* bulk transfers, guarded by kcp_lock; counters readable without it */
+	std::unique_ptr<FileSend> fileSend;
+	std::unique_ptr<FileRecv> fileRecv;
+	/* one thread at a time pumps fileSend, see KcpEngine::pumpFile */
+	std::atomic<bool> filePumping{false};
+	std::atomic<bool> filePumpAgain{false};
+	std::atomic<uint64_t> fileSent{0};
+	std::atomic<uint64_t> fileSendTotal{0};
+	std::atomic<uint64_t> fileReceived{0};
+	std::atomic<uint64_t> fileRecvTotal{0};
+	std::atomic<int> fileError{0};
+	/* per-session delivery, see KcpEngine::wait_readable */
+	std::atomic<bool> owned{false};
+	bool recvReady = false;
+	/* set under recvMutex once the session timed out or the engine stopped */
+	std::atomic<bool> recvClosed{false};
+	std::mutex recvMutex;
+	std::condition_variable recvCond;
+	/* one thread at a time runs the plugin for this session, see KcpEngine::pluginInput */
+	std::atomic<bool> pluginBusy{false};
+	std::atomic<bool> pluginAgain{false};
+	std::atomic<bool> pluginWritable{false};
+	/* coroutines suspended on this session, only touched on the dispatcher thread */
+	std::coroutine_handle<> recvWaiter;
+	std::coroutine_handle<> sendWaiter;
+	std::vector<char> coroRx;
+	bool closed = false;
+public:
+	~KcpClient()
+	{
+		if (kcp)
+		{
+			if(0)
+				std::cout << "ikcp_release" << std::endl;
+			ikcp_release(kcp);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __KCP_PLUGIN_H__
+#define __KCP_PLUGIN_H__
+
+/*
+ * C ABI of native message handlers. A plugin is a shared library that
+ * exports a function returning its struct kcp_plugin; ikcp.load_plugin
+ * wraps that pointer in a PyCapsule named KCP_PLUGIN_CAPSULE, which
+ * PyKcp.set_plugin accepts.
+ *
+ * on_message runs on the engine's receive threads without the GIL and
+ * receives every message of the PyKcp. It must not block and must not
+ * call into Python. Calls for one session never overlap, even when its
+ * datagrams arrive on several paths or through shared memory; different
+ * sessions are handled concurrently.
+ *
+ * send returns SEND_WOULD_BLOCK (-11) while the session is over its
+ * client_watermark. on_writable, when set, is then called once the
+ * queue drained to the low mark, serialized with on_message, instead
+ * of the writable callback and writable_clients. Without on_writable
+ * the engine reports the session to those as usual.
+ */
+
+#define KCP_PLUGIN_ABI 2
+/* plugins built against ABI 1 have no on_writable */
+#define KCP_PLUGIN_ABI_MIN 1
+#define KCP_PLUGIN_CAPSULE "ikcp.plugin"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kcp_plugin_api {
+	unsigned int abi;
+	/* queue a message to the session, same result as ikcp_send or SEND_WOULD_BLOCK */
+	int (*send)(void *engine, void *session, const char *buf, int len);
+	void (*flush)(void *engine, void *session);
+	/* peer address in network byte order */
+	void (*peer)(void *session, unsigned int *nip, unsigned short *nport);
+};
+
+struct kcp_plugin {
+	unsigned int abi;
+	const char *name;
+	void *ctx;
+	void (*on_message)(const struct kcp_plugin_api *api, void *engine, void *session,
+		const char *data, int len, void *ctx);
+	void (*on_writable)(const struct kcp_plugin_api *api, void *engine, void *session, void *ctx);
+};
+
+typedef const struct kcp_plugin *(*kcp_plugin_entry)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
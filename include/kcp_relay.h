@@ -0,0 +1,192 @@
+#ifndef __KCP_RELAY_H__
+#define __KCP_RELAY_H__
+
+/*
+ * TCP over KCP relay. The ingress side accepts TCP connections and opens
+ * a stream per connection on one KCP session to the egress relay; the
+ * egress side accepts those sessions and connects each stream to the
+ * target over TCP. Every message carries its stream id and one thread
+ * pumps both directions of every stream with epoll:
+ *
+ *   TCP -> KCP  reads stop while the peer has no window left for the
+ *               stream, and while the session is at its high watermark
+ *               until ikcp_waitsnd falls to the low one
+ *   KCP -> TCP  messages leave KCP at once and wait in the stream until
+ *               the socket takes them; WINDOW frames reopen the stream
+ *               as they are written, so a slow connection does not hold
+ *               up the others on the session
+ *
+ * Configure with listen_tcp / forward_tcp and the session parameters
+ * before start().
+ */
+
+#include "kcp_engine.h"
+
+#include <list>
+#include <deque>
+
+#include <sys/epoll.h>
+
+/* relay framing: type byte and stream id in network order, then the payload */
+#define RELAY_DATA 0
+#define RELAY_FIN 1
+#define RELAY_RST 2
+#define RELAY_PING 3	/* keeps an idle session alive, stream 0 */
+#define RELAY_OPEN 4
+#define RELAY_WINDOW 5	/* payload: bytes written to TCP since the last one, network order */
+#define RELAY_HEADER 5
+
+/* TCP payload per message, a dozen fragments at the default mss */
+#define RELAY_CHUNK 16384
+/* bytes a stream may have unwritten at the peer before its reads stop */
+#define RELAY_STREAM_WINDOW (RELAY_CHUNK * 16)
+/* reads per readable TCP socket before the next socket gets a turn */
+#define RELAY_BURST 8
+
+struct RelayTunnel;
+struct RelayRoute;
+struct RelaySession;
+
+/* what an epoll registration points at */
+struct RelayWatch {
+	enum { LISTEN, ENGINE, TCP, WAKE } kind;
+	RelayRoute *route;
+	RelayTunnel *tunnel;
+};
+
+/* one listen_tcp or forward_tcp call */
+struct RelayRoute {
+	RelayWatch watch;
+	RelayWatch engineWatch;
+	bool ingress;
+	int listenFd = -1;
+	/* egress: shared by every incoming session; ingress: carries session, replaced when it times out */
+	std::unique_ptr<KcpEngine> engine;
+	RelaySession *session = nullptr;
+	/* remote relay for ingress, TCP target for egress */
+	std::string ip;
+	uint16_t port;
+};
+
+/* one KCP session between the relays, carrying any number of tunnels */
+struct RelaySession {
+	RelayRoute *route;
+	KcpEngine *engine;
+	std::shared_ptr<KcpClient> client;
+	std::unordered_map<uint32_t, RelayTunnel *> streams;
+	/* ingress allocates stream ids, 0 is the session itself */
+	uint32_t nextStream = 1;
+	/* frames refused at the high watermark, sent in order once the session drains */
+	std::deque<std::string> pending;
+	uint64_t lastSendMs = 0;
+};
+
+struct RelayTunnel {
+	RelayWatch tcpWatch;
+	RelaySession *session;
+	uint32_t id;
+	int tcpFd = -1;
+	bool connecting = false;
+	bool finSent = false;
+	bool finRecv = false;
+	bool closed = false;
+	/* epoll mask of tcpFd, -1 once both directions are shut down */
+	int64_t events = 0;
+	/* bytes the peer still takes on this stream */
+	uint32_t sendCredit = RELAY_STREAM_WINDOW;
+	/* DATA not yet written to the socket, at most RELAY_STREAM_WINDOW */
+	std::string toTcp;
+	size_t toTcpPos = 0;
+	/* bytes written since the last WINDOW frame */
+	uint32_t consumed = 0;
+	std::list<RelayTunnel>::iterator self;
+};
+
+class KcpRelay {
+public:
+	KcpRelay(int32_t time_out = 6);
+	~KcpRelay();
+
+	/* accept TCP on local_ip:local_port, tunnel each connection to the relay at remote_ip:remote_port */
+	int listen_tcp(std::string local_ip, uint16_t local_port, std::string remote_ip, uint16_t remote_port);
+	/* accept tunnels on kcp_ip:kcp_port, connect each one to target_ip:target_port */
+	int forward_tcp(std::string kcp_ip, uint16_t kcp_port, std::string target_ip, uint16_t target_port);
+
+	void set_conv(uint32_t value) { conv = value; }
+	void set_nodelay(int nodelay, int interval, int resend, int nc);
+	void set_wndsize(int sndwnd, int rcvwnd);
+	int set_watermark(int high, int low);
+
+	void start();
+	void stop();
+	std::map<std::string, uint64_t> stats();
+
+private:
+	void relayLoop();
+	void reapLoop();
+	void wake();
+	void handOff(bool open, RelayRoute *route, std::shared_ptr<KcpClient> client);
+	void takeHandoff();
+	void watch(int fd, uint32_t events, RelayWatch *w, int op = EPOLL_CTL_ADD);
+	void setupSession(KcpEngine *engine, std::shared_ptr<KcpClient> client);
+	RelaySession *openSession(RelayRoute *route, std::shared_ptr<KcpClient> client);
+	RelaySession *ingressSession(RelayRoute *route);
+	void closeSession(KcpClient *client);
+	RelayTunnel *newTunnel(RelaySession *s, uint32_t id, int fd);
+	void acceptTcp(RelayRoute *route);
+	void openEgress(RelaySession *s, uint32_t id);
+	void engineReady(RelayRoute *route);
+	void sessionInput(RelaySession *s);
+	void frameInput(RelaySession *s, char type, uint32_t id, const char *data, size_t len);
+	void tcpReady(RelayTunnel *t, uint32_t events);
+	bool tcpToKcp(RelayTunnel *t);
+	int sendFrame(RelaySession *s, const char *buf, size_t len);
+	int sendControl(RelaySession *s, char type, uint32_t id);
+	void flushPending(RelaySession *s);
+	int flushTcp(RelayTunnel *t);
+	bool drainTcp(RelayTunnel *t);
+	void updateEvents(RelayTunnel *t);
+	void tick();
+	void closeTunnel(RelayTunnel *t, bool reset);
+
+	int32_t timeOut;
+	uint64_t pingMs;
+	uint32_t conv = 0x55;
+	int nodelay = 1, interval = 10, resend = 2, nc = 1;
+	int sndWnd = 128, rcvWnd = 128;
+	int highWater = 256, lowWater = 128;
+
+	int epollFd = -1;
+	int wakeFd = -1;
+	RelayWatch wakeWatch{RelayWatch::WAKE, nullptr, nullptr};
+	std::atomic<bool> exit{false};
+	std::thread *relayThread = nullptr;
+
+	std::list<RelayRoute> routes;
+	std::list<RelayTunnel> tunnels;
+	/* closed during one epoll batch, freed after it so later events can see closed */
+	std::list<RelayTunnel> closedTunnels;
+	/* until the session is cleaned, egress ones only once handed over */
+	std::unordered_map<KcpClient *, RelaySession> sessions;
+	std::vector<char> rxBuffer;
+	std::vector<char> txBuffer;
+
+	/* sessions opened or cleaned on an engine thread, handled by the relay thread */
+	std::vector<std::tuple<bool, RelayRoute *, std::shared_ptr<KcpClient>>> handoff;
+	std::mutex handoff_lock;
+
+	/* an ingress engine whose session timed out takes a receive timeout to stop, reaped off the relay thread */
+	std::vector<std::unique_ptr<KcpEngine>> retired;
+	std::mutex reap_lock;
+	std::condition_variable reapCond;
+	std::thread *reapThread = nullptr;
+
+	std::atomic<uint64_t> sessionsActive{0};
+	std::atomic<uint64_t> tunnelsOpened{0};
+	std::atomic<uint64_t> tunnelsActive{0};
+	std::atomic<uint64_t> tunnelsReset{0};
+	std::atomic<uint64_t> bytesToKcp{0};
+	std::atomic<uint64_t> bytesToTcp{0};
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef __KCP_SHM_H__
+#define __KCP_SHM_H__
+
+/*
+ * Shared memory datagram channel between two engines on the same host.
+ * The accepting engine listens on the abstract unix socket named after its
+ * UDP port; the connecting one sends it a memfd holding one ring per
+ * direction and an eventfd per ring. A ring carries whole KCP datagrams,
+ * so ikcp_input sees exactly what UDP would have delivered. The accepting
+ * side only takes a channel from a process of the same user that holds
+ * the UDP address the hello names.
+ *
+ * Each ring has a single producer (senders of one side serialize on
+ * tx_lock) and a single consumer (the shm thread of the other side). The
+ * consumer sets sleeping before it blocks on the eventfd, and only a
+ * producer that finds it set pays for the write().
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "kcp_engine.h"
+
+/* bytes per direction, a power of two */
+#define SHM_RING_SIZE (1 << 21)
+/* how long the connecting side waits for the accept before falling back to UDP */
+#define SHM_ACCEPT_TIMEOUT_MS 100
+/* accepted connections whose hello has not arrived yet, further ones are closed */
+#define SHM_PENDING_MAX 64
+
+struct ShmRing {
+	/* consumer position, free running */
+	alignas(64) std::atomic<uint64_t> head;
+	/* producer position, free running */
+	alignas(64) std::atomic<uint64_t> tail;
+	alignas(64) std::atomic<uint32_t> sleeping;
+	alignas(64) char data[SHM_RING_SIZE];
+
+	/* false when the datagram does not fit, the caller drops it like a full socket buffer */
+	bool push(const char *buf, int len);
+	/* calls fn(data, len) for every queued datagram, -1 if the peer corrupted the ring */
+	template <typename Fn> int drain(Fn fn);
+};
+
+struct ShmChannel {
+	ShmChannel() = default;
+	ShmChannel(const ShmChannel &) = delete;
+	ShmChannel &operator=(const ShmChannel &) = delete;
+	~ShmChannel();
+
+	/* the unix socket, hangs up when either side goes away */
+	int sock = -1;
+	/* both rings, the connecting side produces into the first one */
+	void *map = nullptr;
+	ShmRing *tx = nullptr;
+	ShmRing *rx = nullptr;
+	int txEvent = -1;
+	int rxEvent = -1;
+	/* the address the peer's datagrams are accounted to */
+	uint32_t nip = 0;
+	uint16_t nport = 0;
+	SpinLock tx_lock;
+	/* cleared once the peer hung up, senders fall back to UDP */
+	std::atomic<bool> alive{true};
+
+	/* queues one datagram and wakes the peer if it sleeps */
+	bool send(const char *buf, int len);
+};
+
+/* the abstract socket an engine bound to UDP port accepts channels on, -errno on failure */
+int shmListen(uint16_t port);
+/*
+ * Opens a channel to the engine at peer_nip:peer_nport on this host, which
+ * accounts it to local_nip:local_nport. nullptr when nobody listens there
+ * or the accept timed out.
+ */
+std::shared_ptr<ShmChannel> shmConnect(uint32_t peer_nip, uint16_t peer_nport, uint32_t local_nip, uint16_t local_nport);
+/*
+ * Takes one pending connection of a shmListen socket without waiting for
+ * its hello, nullptr once none is left. The channel has no rings until
+ * shmHandshake succeeded.
+ */
+std::shared_ptr<ShmChannel> shmAccept(int listen_fd);
+/* reads the hello of an accepted channel once its socket is readable and answers it, false to drop it */
+bool shmHandshake(ShmChannel &channel);
+/* true if nip is an address of this host, source is what datagrams to it are sent from */
+bool shmLocalPeer(uint32_t nip, uint32_t &source);
+
+template <typename Fn> int ShmRing::drain(Fn fn)
+{
+	uint64_t pos = head.load(std::memory_order_relaxed);
+	uint64_t end = tail.load(std::memory_order_acquire);
+	int count = 0;
+
+	while (pos != end)
+	{
+		if (end - pos > SHM_RING_SIZE)
+			return -1;
+		uint32_t off = pos & (SHM_RING_SIZE - 1);
+		uint32_t len;
+		memcpy(&len, data + off, sizeof(len));
+		if (len == UINT32_MAX)
+		{
+			/* padding up to the end of the ring */
+			pos += SHM_RING_SIZE - off;
+		} else {
+			if (len > SHM_RING_SIZE - off - sizeof(len) || sizeof(len) + len > end - pos)
+				return -1;
+			fn(data + off + sizeof(len), (int)len);
+			pos += (sizeof(len) + len + 7) & ~(uint64_t)7;
+			count++;
+		}
+		head.store(pos, std::memory_order_release);
+		if (pos == end)
+			end = tail.load(std::memory_order_acquire);
+	}
+	return count;
+}
+
+#endif
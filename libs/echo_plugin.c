@@ -0,0 +1,22 @@
+#include "kcp_plugin.h"
+
+/* Send every message straight back, the native twin of echo_server.py. */
+static void echo_message(const struct kcp_plugin_api *api, void *engine, void *session,
+	const char *data, int len, void *ctx)
+{
+	if (api->send(engine, session, data, len) >= 0)
+		api->flush(engine, session);
+}
+
+static const struct kcp_plugin echo_plugin = {
+	KCP_PLUGIN_ABI,
+	"echo",
+	0,
+	echo_message,
+	0,
+};
+
+const struct kcp_plugin *kcp_plugin(void)
+{
+	return &echo_plugin;
+}
@@ -169,18 +169,49 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 	ikcp_free_hook = new_free;
 }
 
+// shared bodies are released from whichever thread frees the last segment
+#if defined(__GNUC__) || defined(__clang__)
+#define ikcp_ref_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define ikcp_ref_dec(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#else
+#define ikcp_ref_inc(p) (++(*(p)))
+#define ikcp_ref_dec(p) (--(*(p)))
+#endif
+
+static void ikcp_body_release(struct IKCPBODY *body)
+{
+	if (ikcp_ref_dec(&body->refcnt) == 0) {
+		ikcp_free(body);
+	}
+}
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
-	return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+	IKCPSEG *seg = (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+	if (seg) {
+		seg->body = NULL;
+		seg->cap = size;
+		seg->key = 0;
+	}
+	return seg;
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
+	if (seg->body) {
+		ikcp_body_release(seg->body);
+	}
 	ikcp_free(seg);
 }
 
+// payload of a segment, inline or shared
+static inline char *ikcp_segment_data(IKCPSEG *seg)
+{
+	return seg->body ? seg->body->data : seg->data;
+}
+
 // write log
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...)
 {
@@ -203,13 +234,16 @@ static int ikcp_canlog(const ikcpcb *kcp, int mask)
 // output segment
 static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 {
+	int hr;
 	assert(kcp);
 	assert(kcp->output);
 	if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
 		ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
 	}
 	if (size == 0) return 0;
-	return kcp->output((const char*)data, size, kcp, kcp->user);
+	hr = kcp->output((const char*)data, size, kcp, kcp->user);
+	kcp->outflags = 0;
+	return hr;
 }
 
 // output queue
@@ -260,10 +294,24 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 		return NULL;
 	}
 
+	kcp->snd_buf = (IKCPSEG**)ikcp_malloc(sizeof(IKCPSEG*) * IKCP_WND_SND);
+	kcp->rcv_buf = (IKCPSEG**)ikcp_malloc(sizeof(IKCPSEG*) * IKCP_WND_RCV);
+	kcp->rcv_bits = (IUINT64*)ikcp_malloc(IKCP_WND_RCV / 8);
+	if (kcp->snd_buf == NULL || kcp->rcv_buf == NULL || kcp->rcv_bits == NULL) {
+		if (kcp->snd_buf) ikcp_free(kcp->snd_buf);
+		if (kcp->rcv_buf) ikcp_free(kcp->rcv_buf);
+		if (kcp->rcv_bits) ikcp_free(kcp->rcv_bits);
+		ikcp_free(kcp->buffer);
+		ikcp_free(kcp);
+		return NULL;
+	}
+	memset(kcp->snd_buf, 0, sizeof(IKCPSEG*) * IKCP_WND_SND);
+	memset(kcp->rcv_bits, 0, IKCP_WND_RCV / 8);
+	kcp->snd_mask = IKCP_WND_SND - 1;
+	kcp->rcv_mask = IKCP_WND_RCV - 1;
+
 	iqueue_init(&kcp->snd_queue);
 	iqueue_init(&kcp->rcv_queue);
-	iqueue_init(&kcp->snd_buf);
-	iqueue_init(&kcp->rcv_buf);
 	kcp->nrcv_buf = 0;
 	kcp->nsnd_buf = 0;
 	kcp->nrcv_que = 0;
@@ -282,6 +330,7 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->nodelay = 0;
 	kcp->updated = 0;
 	kcp->logmask = 0;
+	kcp->outflags = 0;
 	kcp->ssthresh = IKCP_THRESH_INIT;
 	kcp->fastresend = 0;
 	kcp->fastlimit = IKCP_FASTACK_LIMIT;
@@ -303,15 +352,17 @@ void ikcp_release(ikcpcb *kcp)
 	assert(kcp);
 	if (kcp) {
 		IKCPSEG *seg;
-		while (!iqueue_is_empty(&kcp->snd_buf)) {
-			seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		IUINT32 sn, i;
+		for (sn = kcp->snd_una; sn != kcp->snd_nxt; sn++) {
+			seg = kcp->snd_buf[sn & kcp->snd_mask];
+			if (seg) {
+				ikcp_segment_delete(kcp, seg);
+			}
 		}
-		while (!iqueue_is_empty(&kcp->rcv_buf)) {
-			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		for (i = 0; i <= kcp->rcv_mask; i++) {
+			if (kcp->rcv_bits[i >> 6] & ((IUINT64)1 << (i & 63))) {
+				ikcp_segment_delete(kcp, kcp->rcv_buf[i]);
+			}
 		}
 		while (!iqueue_is_empty(&kcp->snd_queue)) {
 			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -329,6 +380,9 @@ void ikcp_release(ikcpcb *kcp)
 		if (kcp->acklist) {
 			ikcp_free(kcp->acklist);
 		}
+		ikcp_free(kcp->snd_buf);
+		ikcp_free(kcp->rcv_buf);
+		ikcp_free(kcp->rcv_bits);
 
 		kcp->nrcv_buf = 0;
 		kcp->nsnd_buf = 0;
@@ -337,6 +391,9 @@ void ikcp_release(ikcpcb *kcp)
 		kcp->ackcount = 0;
 		kcp->buffer = NULL;
 		kcp->acklist = NULL;
+		kcp->snd_buf = NULL;
+		kcp->rcv_buf = NULL;
+		kcp->rcv_bits = NULL;
 		ikcp_free(kcp);
 	}
 }
@@ -352,6 +409,86 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+//---------------------------------------------------------------------
+// rcv_buf: slot sn & rcv_mask holds segment sn when its rcv_bits bit is
+// set. sn - rcv_nxt stays below the slot count, so slots don't collide
+//---------------------------------------------------------------------
+static int ikcp_rcv_reserve(ikcpcb *kcp, IUINT32 count)
+{
+	IUINT32 size = kcp->rcv_mask + 1;
+	IKCPSEG **slots;
+	IUINT64 *bits;
+	IUINT32 i;
+
+	if (count <= size) return 0;
+	while (size < count) size <<= 1;
+
+	slots = (IKCPSEG**)ikcp_malloc(sizeof(IKCPSEG*) * size);
+	bits = (IUINT64*)ikcp_malloc(size / 8);
+	if (slots == NULL || bits == NULL) {
+		if (slots) ikcp_free(slots);
+		if (bits) ikcp_free(bits);
+		return -1;
+	}
+	memset(bits, 0, size / 8);
+
+	for (i = 0; i <= kcp->rcv_mask; i++) {
+		if (kcp->rcv_bits[i >> 6] & ((IUINT64)1 << (i & 63))) {
+			IKCPSEG *seg = kcp->rcv_buf[i];
+			IUINT32 slot = seg->sn & (size - 1);
+			slots[slot] = seg;
+			bits[slot >> 6] |= (IUINT64)1 << (slot & 63);
+		}
+	}
+	ikcp_free(kcp->rcv_buf);
+	ikcp_free(kcp->rcv_bits);
+	kcp->rcv_buf = slots;
+	kcp->rcv_bits = bits;
+	kcp->rcv_mask = size - 1;
+	return 0;
+}
+
+// number of consecutive set bits from bit 0
+static inline IUINT32 ikcp_ones(IUINT64 bits)
+{
+#if defined(__GNUC__)
+	return (~bits == 0)? 64 : (IUINT32)__builtin_ctzll(~bits);
+#else
+	IUINT32 count = 0;
+	for (; bits & 1; bits >>= 1) count++;
+	return count;
+#endif
+}
+
+// move the run of segments starting at rcv_nxt to rcv_queue, a word
+// of rcv_bits at a time
+static void ikcp_rcv_deliver(ikcpcb *kcp)
+{
+	while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+		IUINT32 slot = kcp->rcv_nxt & kcp->rcv_mask;
+		IUINT32 shift = slot & 63;
+		IUINT64 *word = &kcp->rcv_bits[slot >> 6];
+		IUINT32 count = ikcp_ones(*word >> shift);
+		IUINT32 i;
+
+		if (count == 0) break;
+		if (count > kcp->rcv_wnd - kcp->nrcv_que)
+			count = kcp->rcv_wnd - kcp->nrcv_que;
+
+		for (i = 0; i < count; i++) {
+			IKCPSEG *seg = kcp->rcv_buf[slot + i];
+			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+		}
+		*word &= ~(((count == 64)? ~(IUINT64)0 :
+			(((IUINT64)1 << count) - 1)) << shift);
+
+		kcp->nrcv_buf -= count;
+		kcp->nrcv_que += count;
+		kcp->rcv_nxt += count;
+	}
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -411,18 +548,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 	assert(len == peeksize);
 
 	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_rcv_deliver(kcp);
 
 	// fast recover
 	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -482,22 +608,29 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 			if (old->len < kcp->mss) {
 				int capacity = kcp->mss - old->len;
 				int extend = (len < capacity)? len : capacity;
-				seg = ikcp_segment_new(kcp, old->len + extend);
-				assert(seg);
-				if (seg == NULL) {
-					return -2;
+				if (old->body == NULL && old->cap >= old->len + extend) {
+					// tail segment has room, append in place
+					seg = old;
+				}	else {
+					// full size tail, so the next appends stay in place
+					seg = ikcp_segment_new(kcp, kcp->mss);
+					assert(seg);
+					if (seg == NULL) {
+						return -2;
+					}
+					iqueue_add_tail(&seg->node, &kcp->snd_queue);
+					memcpy(seg->data, ikcp_segment_data(old), old->len);
+					seg->len = old->len;
+					seg->frg = 0;
+					iqueue_del_init(&old->node);
+					ikcp_segment_delete(kcp, old);
 				}
-				iqueue_add_tail(&seg->node, &kcp->snd_queue);
-				memcpy(seg->data, old->data, old->len);
 				if (buffer) {
-					memcpy(seg->data + old->len, buffer, extend);
+					memcpy(seg->data + seg->len, buffer, extend);
 					buffer += extend;
 				}
-				seg->len = old->len + extend;
-				seg->frg = 0;
+				seg->len += extend;
 				len -= extend;
-				iqueue_del_init(&old->node);
-				ikcp_segment_delete(kcp, old);
 				sent = extend;
 			}
 		}
@@ -520,7 +653,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	// fragment
 	for (i = 0; i < count; i++) {
 		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-		seg = ikcp_segment_new(kcp, size);
+		// in stream mode the last fragment becomes the tail appended to
+		seg = ikcp_segment_new(kcp, (kcp->stream != 0 && i == count - 1)? (int)kcp->mss : size);
 		assert(seg);
 		if (seg == NULL) {
 			return -2;
@@ -544,6 +678,157 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// keyed send: conflate messages that have not been sent yet
+//---------------------------------------------------------------------
+int ikcp_send_keyed(ikcpcb *kcp, IUINT32 key, const char *buffer, int len,
+	int *behind)
+{
+	struct IQUEUEHEAD *p, *next, *first = NULL, *last = NULL;
+	struct IQUEUEHEAD *tail, *nfirst, *nlast;
+	IKCPSEG *seg;
+	int trailing = 0;
+	int ret;
+
+	if (key == 0 || kcp->stream != 0) return -1;
+
+	// newest message under key, ikcp_flush drops the key of a message
+	// as soon as its first fragment leaves, so whatever matches here
+	// still has all of its fragments in snd_queue
+	for (p = kcp->snd_queue.prev; p != &kcp->snd_queue; p = p->prev) {
+		seg = iqueue_entry(p, IKCPSEG, node);
+		if (seg->key == key) {
+			last = p;
+			break;
+		}
+		trailing++;
+	}
+
+	// walk back to its head, a fragment with frg 0 ends an older message
+	for (first = last; first != NULL && first->prev != &kcp->snd_queue; ) {
+		seg = iqueue_entry(first->prev, IKCPSEG, node);
+		if (seg->key != key || seg->frg == 0) break;
+		first = first->prev;
+	}
+
+	tail = kcp->snd_queue.prev;
+	ret = ikcp_send(kcp, buffer, len);
+	if (ret < 0) return ret;
+
+	nfirst = tail->next;
+	nlast = kcp->snd_queue.prev;
+	for (p = nfirst; p != &kcp->snd_queue; p = p->next) {
+		iqueue_entry(p, IKCPSEG, node)->key = key;
+	}
+
+	if (first == NULL) return 0;
+	if (behind) *behind = trailing;
+
+	// move the new fragments in front of the stale ones
+	tail->next = &kcp->snd_queue;
+	kcp->snd_queue.prev = tail;
+	nfirst->prev = first->prev;
+	first->prev->next = nfirst;
+	nlast->next = first;
+	first->prev = nlast;
+
+	for (p = first; ; p = next) {
+		next = p->next;
+		seg = iqueue_entry(p, IKCPSEG, node);
+		iqueue_del(p);
+		ikcp_segment_delete(kcp, seg);
+		kcp->nsnd_que--;
+		if (p == last) break;
+	}
+
+	return 1;
+}
+
+
+//---------------------------------------------------------------------
+// shared messages: payload split once, segments of every kcp object
+// that sends it point at the same refcounted fragment bodies
+//---------------------------------------------------------------------
+ikcpmsg* ikcp_msg_create(const char *buffer, int len, int mss)
+{
+	ikcpmsg *msg;
+	int count, i;
+
+	if (len < 0 || mss <= 0) return NULL;
+
+	if (len <= mss) count = 1;
+	else count = (len + mss - 1) / mss;
+
+	if (count >= (int)IKCP_WND_RCV) return NULL;
+
+	msg = (ikcpmsg*)ikcp_malloc(sizeof(ikcpmsg) + 
+		sizeof(struct IKCPBODY*) * (count - 1));
+	if (msg == NULL) return NULL;
+
+	msg->mss = mss;
+	msg->count = count;
+
+	for (i = 0; i < count; i++) {
+		int size = len > mss ? mss : len;
+		struct IKCPBODY *body = (struct IKCPBODY*)ikcp_malloc(
+			sizeof(struct IKCPBODY) + size);
+		if (body == NULL) {
+			msg->count = i;
+			ikcp_msg_release(msg);
+			return NULL;
+		}
+		body->refcnt = 1;
+		body->len = size;
+		if (buffer && size > 0) {
+			memcpy(body->data, buffer, size);
+			buffer += size;
+		}
+		msg->frags[i] = body;
+		len -= size;
+	}
+
+	return msg;
+}
+
+void ikcp_msg_release(ikcpmsg *msg)
+{
+	IUINT32 i;
+	for (i = 0; i < msg->count; i++) {
+		ikcp_body_release(msg->frags[i]);
+	}
+	ikcp_free(msg);
+}
+
+int ikcp_send_shared(ikcpcb *kcp, const ikcpmsg *msg)
+{
+	IKCPSEG *seg;
+	IUINT32 i;
+	int sent = 0;
+
+	assert(kcp->mss > 0);
+	if (msg->mss > kcp->mss) return -3;
+
+	for (i = 0; i < msg->count; i++) {
+		struct IKCPBODY *body = msg->frags[i];
+		seg = ikcp_segment_new(kcp, 0);
+		assert(seg);
+		if (seg == NULL) {
+			return -2;
+		}
+		ikcp_ref_inc(&body->refcnt);
+		seg->body = body;
+		seg->len = body->len;
+		seg->frg = (kcp->stream == 0)? (msg->count - i - 1) : 0;
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que++;
+		sent += body->len;
+	}
+
+	return sent;
+}
+
+
 //---------------------------------------------------------------------
 // parse ack
 //---------------------------------------------------------------------
@@ -564,76 +849,83 @@ static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
 	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
 }
 
+//---------------------------------------------------------------------
+// snd_buf: slot sn & snd_mask holds segment sn while it is in flight.
+// snd_nxt - snd_una never exceeds the slot count, so slots don't collide
+//---------------------------------------------------------------------
+static int ikcp_snd_reserve(ikcpcb *kcp, IUINT32 count)
+{
+	IUINT32 size = kcp->snd_mask + 1;
+	IKCPSEG **slots;
+	IUINT32 sn;
+
+	if (count <= size) return 0;
+	while (size < count) size <<= 1;
+
+	slots = (IKCPSEG**)ikcp_malloc(sizeof(IKCPSEG*) * size);
+	if (slots == NULL) return -1;
+	memset(slots, 0, sizeof(IKCPSEG*) * size);
+
+	for (sn = kcp->snd_una; sn != kcp->snd_nxt; sn++) {
+		slots[sn & (size - 1)] = kcp->snd_buf[sn & kcp->snd_mask];
+	}
+	ikcp_free(kcp->snd_buf);
+	kcp->snd_buf = slots;
+	kcp->snd_mask = size - 1;
+	return 0;
+}
+
+static void ikcp_snd_remove(ikcpcb *kcp, IUINT32 sn)
+{
+	IKCPSEG **slot = &kcp->snd_buf[sn & kcp->snd_mask];
+	if (*slot) {
+		ikcp_segment_delete(kcp, *slot);
+		*slot = NULL;
+		kcp->nsnd_buf--;
+	}
+}
+
 static void ikcp_shrink_buf(ikcpcb *kcp)
 {
-	struct IQUEUEHEAD *p = kcp->snd_buf.next;
-	if (p != &kcp->snd_buf) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		kcp->snd_una = seg->sn;
-	}	else {
-		kcp->snd_una = kcp->snd_nxt;
+	while (kcp->snd_una != kcp->snd_nxt &&
+		kcp->snd_buf[kcp->snd_una & kcp->snd_mask] == NULL) {
+		kcp->snd_una++;
 	}
 }
 
 static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 {
-	struct IQUEUEHEAD *p, *next;
-
 	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
-	}
+	ikcp_snd_remove(kcp, sn);
 }
 
 static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
 {
-	struct IQUEUEHEAD *p, *next;
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(una, seg->sn) > 0) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-		}	else {
-			break;
-		}
+	IUINT32 sn;
+	for (sn = kcp->snd_una; sn != kcp->snd_nxt; sn++) {
+		if (_itimediff(una, sn) <= 0) break;
+		ikcp_snd_remove(kcp, sn);
 	}
 }
 
 static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 {
-	struct IQUEUEHEAD *p, *next;
+	IUINT32 i;
 
 	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
-		else if (sn != seg->sn) {
-		#ifndef IKCP_FASTACK_CONSERVE
+	for (i = kcp->snd_una; i != sn; i++) {
+		IKCPSEG *seg = kcp->snd_buf[i & kcp->snd_mask];
+		if (seg == NULL) continue;
+	#ifndef IKCP_FASTACK_CONSERVE
+		seg->fastack++;
+	#else
+		if (_itimediff(ts, seg->ts) >= 0)
 			seg->fastack++;
-		#else
-			if (_itimediff(ts, seg->ts) >= 0)
-				seg->fastack++;
-		#endif
-		}
+	#endif
 	}
 }
 
@@ -689,9 +981,9 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-	struct IQUEUEHEAD *p, *prev;
 	IUINT32 sn = newseg->sn;
-	int repeat = 0;
+	IUINT32 slot;
+	IUINT64 bit;
 	
 	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
 		_itimediff(sn, kcp->rcv_nxt) < 0) {
@@ -699,44 +991,23 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		return;
 	}
 
-	for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		prev = p->prev;
-		if (seg->sn == sn) {
-			repeat = 1;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) > 0) {
-			break;
-		}
+	if (ikcp_rcv_reserve(kcp, sn - kcp->rcv_nxt + 1) != 0) {
+		ikcp_segment_delete(kcp, newseg);
+		return;
 	}
 
-	if (repeat == 0) {
-		iqueue_init(&newseg->node);
-		iqueue_add(&newseg->node, p);
+	slot = sn & kcp->rcv_mask;
+	bit = (IUINT64)1 << (slot & 63);
+	if ((kcp->rcv_bits[slot >> 6] & bit) == 0) {
+		kcp->rcv_buf[slot] = newseg;
+		kcp->rcv_bits[slot >> 6] |= bit;
 		kcp->nrcv_buf++;
 	}	else {
 		ikcp_segment_delete(kcp, newseg);
 	}
 
-#if 0
-	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
 	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_rcv_deliver(kcp);
 
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
@@ -944,8 +1215,7 @@ void ikcp_flush(ikcpcb *kcp)
 	char *ptr = buffer;
 	int count, size, i;
 	IUINT32 resent, cwnd;
-	IUINT32 rtomin;
-	struct IQUEUEHEAD *p;
+	IUINT32 rtomin, sn;
 	int change = 0;
 	int lost = 0;
 	IKCPSEG seg;
@@ -1034,11 +1304,22 @@ void ikcp_flush(ikcpcb *kcp)
 	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
 		IKCPSEG *newseg;
 		if (iqueue_is_empty(&kcp->snd_queue)) break;
+		if (ikcp_snd_reserve(kcp, kcp->snd_nxt - kcp->snd_una + 1) != 0) break;
 
 		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
 		iqueue_del(&newseg->node);
-		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
+		kcp->snd_buf[kcp->snd_nxt & kcp->snd_mask] = newseg;
+
+		// a message that started to leave can no longer be replaced
+		if (newseg->key != 0) {
+			struct IQUEUEHEAD *q = kcp->snd_queue.next;
+			for (i = newseg->frg; i > 0 && q != &kcp->snd_queue; i--) {
+				iqueue_entry(q, IKCPSEG, node)->key = 0;
+				q = q->next;
+			}
+			newseg->key = 0;
+		}
 		kcp->nsnd_que--;
 		kcp->nsnd_buf++;
 
@@ -1059,9 +1340,10 @@ void ikcp_flush(ikcpcb *kcp)
 	rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
 
 	// flush data segments
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
+	for (sn = kcp->snd_una; sn != kcp->snd_nxt; sn++) {
+		IKCPSEG *segment = kcp->snd_buf[sn & kcp->snd_mask];
 		int needsend = 0;
+		if (segment == NULL) continue;
 		if (segment->xmit == 0) {
 			needsend = 1;
 			segment->xmit++;
@@ -1108,9 +1390,12 @@ void ikcp_flush(ikcpcb *kcp)
 			}
 
 			ptr = ikcp_encode_seg(ptr, segment);
+			if (segment->xmit > 1) {
+				kcp->outflags |= IKCP_OUT_RETRANS;
+			}
 
 			if (segment->len > 0) {
-				memcpy(ptr, segment->data, segment->len);
+				memcpy(ptr, ikcp_segment_data(segment), segment->len);
 				ptr += segment->len;
 			}
 
@@ -1199,7 +1484,7 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 	IINT32 tm_flush = 0x7fffffff;
 	IINT32 tm_packet = 0x7fffffff;
 	IUINT32 minimal = 0;
-	struct IQUEUEHEAD *p;
+	IUINT32 sn;
 
 	if (kcp->updated == 0) {
 		return current;
@@ -1216,9 +1501,11 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
 	tm_flush = _itimediff(ts_flush, current);
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		IINT32 diff = _itimediff(seg->resendts, current);
+	for (sn = kcp->snd_una; sn != kcp->snd_nxt; sn++) {
+		const IKCPSEG *seg = kcp->snd_buf[sn & kcp->snd_mask];
+		IINT32 diff;
+		if (seg == NULL) continue;
+		diff = _itimediff(seg->resendts, current);
 		if (diff <= 0) {
 			return current;
 		}
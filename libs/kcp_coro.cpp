@@ -0,0 +1,167 @@
+#include "kcp_coro.h"
+
+using namespace std;
+
+void KcpTask::promise_type::unhandled_exception()
+{
+	try {
+		throw;
+	} catch (exception &e) {
+		cout << "coroutine fail: " << e.what() << endl;
+	} catch (...) {
+		cout << "coroutine fail." << endl;
+	}
+}
+
+/*
+ * Waiters are only set and woken on the dispatcher thread, so a readiness
+ * check in await_ready cannot race with the event that would resume it.
+ */
+bool KcpRecvAwaiter::await_ready()
+{
+	return session->closed() || session->engine->peek_size(session->client) > 0;
+}
+
+void KcpRecvAwaiter::await_suspend(coroutine_handle<> h)
+{
+	session->client->recvWaiter = h;
+}
+
+optional<string_view> KcpRecvAwaiter::await_resume()
+{
+	KcpClient *client = session->client.get();
+	int size = session->engine->peek_size(session->client);
+	if (size <= 0)
+		return nullopt;
+
+	if (client->coroRx.size() < (size_t)size)
+		client->coroRx.resize(size);
+	session->engine->recv(session->client, client->coroRx.data(), size);
+	return string_view(client->coroRx.data(), size);
+}
+
+bool KcpSendAwaiter::await_ready()
+{
+	ret = session->trySend(buf, size, flush);
+	return ret != SEND_WOULD_BLOCK;
+}
+
+void KcpSendAwaiter::await_suspend(coroutine_handle<> h)
+{
+	session->client->sendWaiter = h;
+	/* whatever is queued has to leave before the writable event can come */
+	session->engine->flush(session->client);
+}
+
+int KcpSendAwaiter::await_resume()
+{
+	if (ret == SEND_WOULD_BLOCK)
+		ret = session->trySend(buf, size, flush);
+	return ret;
+}
+
+int KcpSession::trySend(const char *buf, size_t size, bool flush)
+{
+	if (client->closed)
+		return -1;
+
+	int ret = engine->send_buffer(client, buf, size);
+	if (ret >= 0 && flush)
+		engine->flush(client);
+	return ret;
+}
+
+bool KcpAcceptAwaiter::await_ready()
+{
+	return !engine->acceptQueue.empty();
+}
+
+void KcpAcceptAwaiter::await_suspend(coroutine_handle<> h)
+{
+	engine->acceptWaiter = h;
+}
+
+KcpSession KcpAcceptAwaiter::await_resume()
+{
+	KcpSession session{engine, move(engine->acceptQueue.front())};
+	engine->acceptQueue.pop_front();
+	return session;
+}
+
+KcpCoroEngine::KcpCoroEngine(string ip, uint16_t port, int32_t time_out, bool atomicSem, bool reuse_port)
+	: KcpEngine(ip, port, time_out, atomicSem, reuse_port)
+{
+	set_create_cb([this](KcpEngine *, shared_ptr<KcpClient> client) {
+		onCreate(client);
+		return true;
+	});
+	set_clean_cb([this](KcpEngine *, shared_ptr<KcpClient> client) {
+		onClean(client);
+	});
+	/* never called, deliverRecv resumes the reader instead */
+	set_recv_cb([](KcpEngine *, shared_ptr<KcpClient>, const char *, size_t) {});
+	set_writable_cb([this](KcpEngine *, shared_ptr<KcpClient> client) {
+		onWritable(client);
+	});
+}
+
+void KcpCoroEngine::spawn(KcpTask task)
+{
+	coroutine_handle<> handle = task.release();
+	if (handle)
+		post(handle);
+}
+
+KcpSession KcpCoroEngine::connect(string ip, uint16_t port)
+{
+	shared_ptr<KcpClient> client = new_client(ip, port);
+	if (client)
+		client_watermark(client, highWater, lowWater);
+	return KcpSession{this, client};
+}
+
+int KcpCoroEngine::session_watermark(int high, int low)
+{
+	if (high < 0 || low < 0 || (high > 0 && low >= high))
+		return -1;
+	highWater = high;
+	lowWater = low;
+	return 0;
+}
+
+void KcpCoroEngine::wake(coroutine_handle<> &waiter)
+{
+	if (waiter)
+		exchange(waiter, nullptr).resume();
+}
+
+void KcpCoroEngine::onCreate(shared_ptr<KcpClient> client)
+{
+	if (client->outbound)
+		return;
+
+	client_watermark(client, highWater, lowWater);
+	acceptQueue.push_back(client);
+	wake(acceptWaiter);
+}
+
+void KcpCoroEngine::onClean(shared_ptr<KcpClient> client)
+{
+	client->closed = true;
+	wake(client->recvWaiter);
+	wake(client->sendWaiter);
+}
+
+void KcpCoroEngine::onWritable(shared_ptr<KcpClient> client)
+{
+	/* a stale event, want_writable arms the next one */
+	if (client->sendWaiter && want_writable(client))
+		wake(client->sendWaiter);
+}
+
+void KcpCoroEngine::deliverRecv(shared_ptr<KcpClient> client)
+{
+	/* the reader may have drained the messages this event was queued for */
+	if (client->recvWaiter && peek_size(client) > 0)
+		wake(client->recvWaiter);
+}
@@ -0,0 +1,2630 @@
+#include "kcp_engine.h"
+#include "kcp_shm.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <errno.h>
+#include <signal.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+static thread_local OutputBatch *outputBatch = nullptr;
+
+KcpEngine::KcpEngine(string ip, uint16_t port, int32_t time_out, bool atomicSem, bool reuse_port) : semaphore(0, atomicSem), timeOutMs(time_out * 1000), kcp_lock()
+{
+	reusePort = reuse_port;
+	sockfd = openSocket(ip, port, "");
+	pathFds[0] = sockfd;
+	pathCount = 1;
+
+	rcvBufSize = setSockBuf(SO_RCVBUF, SO_RCVBUFFORCE, 0);
+	sndBufSize = setSockBuf(SO_SNDBUF, SO_SNDBUFFORCE, 0);
+}
+
+/*
+ * Threads are started separately from the constructor, so a subclass is
+ * fully constructed before the dispatcher calls its dispatchBatch.
+ */
+void KcpEngine::start()
+{
+	if (dispatchThread)
+		return;
+
+	for (int i = 0; i < pathCount; i++)
+		pathThreads[i] = new thread(&KcpEngine::recvLoop, this, i);
+	if (shmEnabled && !shmThread)
+		shmThread = new thread(&KcpEngine::shmLoop, this);
+	updateThread = new thread(&KcpEngine::updateLoop, this);
+	dispatchThread = new thread(&KcpEngine::dispatchLoop, this);
+}
+
+/* Join every thread, a subclass calls it first thing in its destructor. */
+void KcpEngine::stop()
+{
+	exit = true;
+	events.wake();
+	client_lock.lock_shared();
+	for (auto &it : clients)
+		closeOwner(it.second);
+	client_lock.unlock_shared();
+
+	for (int i = 0; i < pathCount; i++)
+	{
+		if (pathThreads[i])
+		{
+			pathThreads[i]->join();
+			delete pathThreads[i];
+			pathThreads[i] = nullptr;
+		}
+	}
+	if (shmThread)
+	{
+		shmThread->join();
+		delete shmThread;
+		shmThread = nullptr;
+	}
+	if(updateThread)
+	{
+		updateThread->join();
+		delete updateThread;
+		updateThread = nullptr;
+	}
+	if (dispatchThread)
+	{
+		dispatchThread->join();
+		delete dispatchThread;
+		dispatchThread = nullptr;
+	}
+
+	/* nothing pushes any more, pooled events drop the session they point at */
+	CallbackEvent *batch = events.takeAll();
+	while (batch)
+	{
+		CallbackEvent *event = batch;
+		batch = batch->next;
+		event->client.reset();
+		releaseEvent(event);
+	}
+}
+
+KcpEngine::~KcpEngine()
+{
+	stop();
+
+	for (int i = 0; i < pathCount; i++)
+		close(pathFds[i]);
+	if (eventFd >= 0)
+		close(eventFd);
+	if (reuseProgFd >= 0)
+		close(reuseProgFd);
+	if (reuseMapFd >= 0)
+		close(reuseMapFd);
+	if (shmListenFd >= 0)
+		close(shmListenFd);
+	if (shmEpollFd >= 0)
+		close(shmEpollFd);
+}
+
+int KcpEngine::openSocket(string ip, uint16_t port, string ifname)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		throw runtime_error("socket create fail.");
+
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 100000;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		close(fd);
+		throw runtime_error("Failed to set socket options.");
+	}
+
+	/* Report kernel receive queue drops in a cmsg on every datagram. */
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		cout << "SO_RXQ_OVFL not supported, kernel drops will not be counted." << endl;
+
+	if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		close(fd);
+		throw runtime_error("Failed to set SO_REUSEPORT.");
+	}
+
+	if (!ifname.empty() &&
+		setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname.c_str(), ifname.size()) < 0) {
+		close(fd);
+		throw invalid_argument("bind to device fail.");
+	}
+
+	sockaddr_in bindAddr;
+	memset(&bindAddr, 0, sizeof(bindAddr));
+	bindAddr.sin_family = AF_INET;
+	bindAddr.sin_addr.s_addr = inet_addr(ip.c_str());
+	bindAddr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
+		close(fd);
+		throw invalid_argument("bind fail, invalid addr.");
+	}
+
+	return fd;
+}
+
+int KcpEngine::add_path(string ip, uint16_t port, string ifname)
+{
+	int path = pathCount;
+	if (path >= MAX_PATHS)
+		throw out_of_range("too many paths.");
+
+	pathFds[path] = openSocket(ip, port, ifname);
+	pathCount = path + 1;
+
+	/*
+	 * After publishing the path: a concurrent setSockBuf either sees it in
+	 * pathCount or stored its size before these loads, no path is missed.
+	 */
+	int rcvbuf = rcvBufWant;
+	int sndbuf = sndBufWant;
+	if (rcvbuf > 0)
+		applySockBuf(pathFds[path], SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf);
+	if (sndbuf > 0)
+		applySockBuf(pathFds[path], SO_SNDBUF, SO_SNDBUFFORCE, sndbuf);
+
+	if (dispatchThread)
+		pathThreads[path] = new thread(&KcpEngine::recvLoop, this, path);
+	return path;
+}
+
+int KcpEngine::client_add_path(shared_ptr<KcpClient> client, int path, string ip, uint16_t hport)
+{
+	if (path < 0 || path >= pathCount)
+		return -1;
+
+	int slot = client->npaths;
+	if (slot >= MAX_PATHS)
+		return -1;
+
+	PeerPath &peer = client->paths[slot];
+	peer.path = path;
+	peer.nip = inet_addr(ip.c_str());
+	peer.nport = htons(hport);
+	client->npaths = slot + 1;
+
+	client_lock.lock();
+	pathAliases[((uint64_t)peer.nip << 16) | peer.nport] = client;
+	client_lock.unlock();
+	multipathInUse = true;
+	return slot;
+}
+
+void KcpEngine::set_multipath_mode(int mode)
+{
+	if (mode < MULTIPATH_DUPLICATE || mode > MULTIPATH_FASTEST)
+		throw invalid_argument("unknown multipath mode.");
+	multipathMode = mode;
+}
+
+vector<tuple<int, uint32_t, uint16_t, uint32_t, uint64_t>> KcpEngine::multipath_stats(shared_ptr<KcpClient> client)
+{
+	vector<tuple<int, uint32_t, uint16_t, uint32_t, uint64_t>> stats;
+	for (int i = 0; i < client->npaths; i++)
+	{
+		PeerPath &peer = client->paths[i];
+		stats.emplace_back(peer.path, peer.nip, peer.nport, peer.srtt.load(), peer.txPackets.load());
+	}
+	return stats;
+}
+
+/*
+ * Sessions opened with new_client to an address of this host try a shared
+ * memory channel first and fall back to UDP when the peer does not accept
+ * it. Disabling only affects sessions created afterwards.
+ */
+int KcpEngine::set_shm(bool enable)
+{
+	lock_guard<mutex> guard(shm_lock);
+	if (enable && shmListenFd < 0)
+	{
+		sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0)
+			return -errno;
+
+		int fd = shmListen(ntohs(addr.sin_port));
+		if (fd < 0)
+			return fd;
+		shmEpollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (shmEpollFd < 0)
+		{
+			int err = errno;
+			close(fd);
+			return -err;
+		}
+		/* a null pointer marks the listening socket */
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		epoll_ctl(shmEpollFd, EPOLL_CTL_ADD, fd, &ev);
+		shmListenFd = fd;
+	}
+
+	shmEnabled = enable;
+	if (enable && dispatchThread && !shmThread)
+		shmThread = new thread(&KcpEngine::shmLoop, this);
+	return 0;
+}
+
+/* Give a new session the channel of its peer, dialing one for local outbound sessions. */
+void KcpEngine::shmAttach(shared_ptr<KcpClient> client)
+{
+	if (!shmEnabled)
+		return;
+
+	uint64_t peer_key = ((uint64_t)client->nip << 16) | client->nport;
+	{
+		lock_guard<mutex> guard(shm_lock);
+		auto it = shmChannels.find(peer_key);
+		if (it != shmChannels.end() && it->second->alive)
+		{
+			client->shm = it->second;
+			return;
+		}
+	}
+
+	uint32_t source;
+	if (!client->outbound || !shmLocalPeer(client->nip, source))
+		return;
+
+	sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0)
+		return;
+	if (addr.sin_addr.s_addr != INADDR_ANY)
+		source = addr.sin_addr.s_addr;
+
+	shared_ptr<ShmChannel> channel = shmConnect(client->nip, client->nport, source, addr.sin_port);
+	if (channel)
+	{
+		shmRegister(channel);
+		client->shm = channel;
+	}
+}
+
+void KcpEngine::shmRegister(shared_ptr<ShmChannel> channel)
+{
+	uint64_t peer_key = ((uint64_t)channel->nip << 16) | channel->nport;
+	shm_lock.lock();
+	shmChannels[peer_key] = channel;
+	shmOwned[channel.get()] = channel;
+	shm_lock.unlock();
+
+	epoll_event ev = {};
+	ev.data.ptr = channel.get();
+	ev.events = EPOLLIN;
+	epoll_ctl(shmEpollFd, EPOLL_CTL_ADD, channel->rxEvent, &ev);
+	ev.events = EPOLLRDHUP;
+	epoll_ctl(shmEpollFd, EPOLL_CTL_ADD, channel->sock, &ev);
+}
+
+/*
+ * Take every pending connection without waiting for its hello, which may
+ * never come; shmLoop finishes the handshake once the socket is readable.
+ */
+void KcpEngine::shmAcceptAll()
+{
+	while (shared_ptr<ShmChannel> accepted = shmAccept(shmListenFd))
+	{
+		if (shmPending.size() >= SHM_PENDING_MAX)
+			continue;
+
+		shmPending[accepted.get()] = getTimeMs() + SHM_ACCEPT_TIMEOUT_MS;
+		epoll_event ev = {};
+		ev.data.ptr = accepted.get();
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		epoll_ctl(shmEpollFd, EPOLL_CTL_ADD, accepted->sock, &ev);
+		lock_guard<mutex> guard(shm_lock);
+		shmOwned[accepted.get()] = accepted;
+	}
+}
+
+/* The hello of an accepted channel arrived, register it or drop it. */
+void KcpEngine::shmHello(ShmChannel *pending, vector<shared_ptr<ShmChannel>> &retired)
+{
+	shmPending.erase(pending);
+	epoll_ctl(shmEpollFd, EPOLL_CTL_DEL, pending->sock, nullptr);
+
+	shared_ptr<ShmChannel> channel;
+	{
+		lock_guard<mutex> guard(shm_lock);
+		auto it = shmOwned.find(pending);
+		channel = move(it->second);
+		shmOwned.erase(it);
+	}
+	if (shmHandshake(*channel))
+		shmRegister(channel);
+	else
+	{
+		channel->alive = false;
+		retired.push_back(move(channel));
+	}
+}
+
+/* Called on shmThread only, retired keeps the channel valid for the rest of the epoll batch. */
+void KcpEngine::shmDetach(ShmChannel *channel, vector<shared_ptr<ShmChannel>> &retired)
+{
+	channel->alive = false;
+	epoll_ctl(shmEpollFd, EPOLL_CTL_DEL, channel->rxEvent, nullptr);
+	epoll_ctl(shmEpollFd, EPOLL_CTL_DEL, channel->sock, nullptr);
+
+	uint64_t peer_key = ((uint64_t)channel->nip << 16) | channel->nport;
+	lock_guard<mutex> guard(shm_lock);
+	auto it = shmOwned.find(channel);
+	if (it != shmOwned.end())
+	{
+		retired.push_back(move(it->second));
+		shmOwned.erase(it);
+	}
+	auto cit = shmChannels.find(peer_key);
+	if (cit != shmChannels.end() && cit->second.get() == channel)
+		shmChannels.erase(cit);
+}
+
+/* Feed every queued datagram to its session, false if the peer corrupted the ring. */
+bool KcpEngine::shmDrain(ShmChannel *channel)
+{
+	ShmRing *ring = channel->rx;
+
+	while (true)
+	{
+		int count = ring->drain([&](const char *data, int len) {
+			shared_ptr<KcpClient> client = findOrNewClient(channel->nip, channel->nport);
+			if (client)
+				input(client, data, len);
+		});
+		if (count < 0)
+			return false;
+		shmRxPackets += count;
+
+		/* pairs with the fence in ShmChannel::send */
+		ring->sleeping.store(1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring->head.load(memory_order_relaxed) == ring->tail.load(memory_order_acquire))
+			return true;
+		ring->sleeping.store(0, memory_order_relaxed);
+	}
+}
+
+void KcpEngine::shmLoop()
+{
+	epoll_event events[64];
+	vector<shared_ptr<ShmChannel>> retired;
+
+	while (!exit)
+	{
+		int n = epoll_wait(shmEpollFd, events, 64, 100);
+		for (int i = 0; i < n; i++)
+		{
+			ShmChannel *channel = static_cast<ShmChannel *>(events[i].data.ptr);
+			if (channel == nullptr)
+			{
+				shmAcceptAll();
+				continue;
+			}
+			if (!channel->alive)
+				continue;
+			/* accepted, no rings until the hello is read */
+			if (channel->map == nullptr)
+			{
+				shmHello(channel, retired);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+			{
+				/* whatever the peer queued before hanging up still counts */
+				shmDrain(channel);
+				shmDetach(channel, retired);
+				continue;
+			}
+
+			uint64_t count;
+			if (read(channel->rxEvent, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				perror("shm eventfd");
+			if (!shmDrain(channel))
+				shmDetach(channel, retired);
+		}
+
+		/* the connecting side gave up on them by now */
+		if (!shmPending.empty())
+		{
+			uint64_t now = getTimeMs();
+			for (auto it = shmPending.begin(); it != shmPending.end();)
+			{
+				ShmChannel *channel = it->first;
+				if (it->second > now)
+				{
+					++it;
+					continue;
+				}
+				it = shmPending.erase(it);
+				shmDetach(channel, retired);
+			}
+		}
+		retired.clear();
+	}
+}
+
+/* A session attached to a live channel bypasses the sockets. */
+bool KcpEngine::shmTransmit(KcpClient *client, const char *buf, int len)
+{
+	ShmChannel *channel = client->shm.get();
+	if (channel == nullptr || !channel->alive)
+		return false;
+
+	/* a full ring drops the datagram like a full socket buffer, kcp resends it */
+	if (channel->send(buf, len))
+		shmTxPackets++;
+	else
+		txErrors++;
+	return true;
+}
+
+/* conv of the sessions created from now on, both ends have to agree */
+void KcpEngine::set_conv(uint32_t value)
+{
+	conv = value;
+}
+
+void KcpEngine::set_create_cb(CreateCallback callback, bool admission)
+{
+	mOnCreate = callback;
+	createAdmission = admission;
+}
+
+void KcpEngine::set_clean_cb(ClientCallback callback)
+{
+	mOnClean = callback;
+}
+
+void KcpEngine::set_recv_cb(RecvCallback callback)
+{
+	mOnRecv = callback;
+}
+
+void KcpEngine::set_writable_cb(ClientCallback callback)
+{
+	mOnWritable = callback;
+}
+
+void KcpEngine::set_acked_cb(AckedCallback callback)
+{
+	mOnAcked = callback;
+}
+
+uint64_t KcpEngine::getTimeMs()
+{
+	auto now = chrono::system_clock::now();
+	auto duration = now.time_since_epoch();
+	return chrono::duration_cast<chrono::milliseconds>(duration).count();
+}
+
+uint32_t KcpEngine::getBoottimeMs(shared_ptr<KcpClient> client)
+{
+	uint64_t time_ms = getTimeMs();
+	if(client->startTimeMs == 0)
+		client->startTimeMs = time_ms;
+
+	return time_ms - client->startTimeMs;
+}
+
+shared_ptr<KcpClient> KcpEngine::findOrNewClient(uint32_t nip, uint16_t nport, int path, bool outbound)
+{
+	shared_ptr<KcpClient> client;
+
+	uint64_t client_id = (nip << 16) + nport;
+
+	client_lock.lock_shared();
+	bool empty = clients.find(client_id) == clients.end();
+	client_lock.unlock_shared();
+	if (empty)
+	{
+		/* a refused peer that keeps sending costs no session and no callback */
+		if (!outbound && peerRejected(nip, nport))
+			return nullptr;
+
+		client = make_shared<KcpClient>();
+		client->engine = this;
+		client->nip = nip;
+		client->nport = nport;
+		client->outbound = outbound;
+		client->paths[0].path = path;
+		client->paths[0].nip = nip;
+		client->paths[0].nport = nport;
+		client->npaths = 1;
+
+		client->kcp = ikcp_create(conv, client.get());
+		ikcp_wndsize(client->kcp, 64, 64);
+		/* fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
+		*  nodelay: 0:disable(default), 1:enable
+		*  interval: internal update timer interval in millisec, default is 100ms
+		*  resend: 0:disable fast resend(default), 1:enable fast resend
+		*  nc: 0:normal congestion control(default), 1:disable congestion control
+		*/
+		ikcp_nodelay(client->kcp, 1, 20, 1, 1);
+		/* extreme settings */
+		client->kcp->rx_minrto = 10;
+
+		if (mOnCreate && createAdmission && mOnCreate(this, client) == false)
+		{
+			rejectPeer(nip, nport);
+			return nullptr;
+		}
+		shmAttach(client);
+
+		ikcp_setoutput(client->kcp, kcpOutputCallback);
+		/* Ensure that flush can be invoked successfully immediately. */
+		ikcp_update(client->kcp, getBoottimeMs(client));
+		client_lock.lock();
+		clients[client_id] = client;
+		client_lock.unlock();
+
+		if (mOnCreate && !createAdmission)
+			pushEvent(EVENT_CREATE, client);
+	} else {
+		client_lock.lock_shared();
+		client = clients[client_id];
+		client_lock.unlock_shared();
+	}
+
+	/* update time */
+	client->lastTimeMs = getTimeMs();
+
+	return client;
+}
+
+shared_ptr<KcpClient> KcpEngine::new_client(string ip, uint16_t hport)
+{
+	return findOrNewClient(inet_addr(ip.c_str()), htons(hport), 0, true);
+}
+
+int KcpEngine::client_wndsize(shared_ptr<KcpClient> client, int sndwnd, int rcvsnd)
+{
+	return ikcp_wndsize(client->kcp, sndwnd, rcvsnd);
+}
+
+int KcpEngine::client_nodelay(shared_ptr<KcpClient> client, int nodelay, int interval, int resend, int nc)
+{
+	return ikcp_nodelay(client->kcp, nodelay, interval, resend, nc);
+}
+
+int KcpEngine::kcpOutputCallback(const char *buf, int len, 
+	ikcpcb *kcp, void *user)
+{
+	KcpClient* client = static_cast<KcpClient*>(user);
+	return client->engine->kcpOutput(buf, len, kcp, user);
+}
+
+int KcpEngine::kcpOutput(const char *buf, int len,
+	ikcpcb *kcp, void *user)
+{
+	KcpClient* client = static_cast<KcpClient*>(user);
+
+	if (!fairOutput)
+	{
+		if (outputBatch)
+		{
+			outputBatch->clients.push_back(client);
+			outputBatch->datagrams.push_back(Datagram{string(buf, len), kcp->outflags});
+		} else
+			transmit(client, buf, len, kcp->outflags);
+		return len;
+	}
+
+	egress_lock.lock();
+	client->outQueue.push_back(Datagram{string(buf, len), kcp->outflags});
+	if (!client->drrQueued)
+	{
+		client->drrQueued = true;
+		client->deficit = 0;
+		drrActive.push_back(client->shared_from_this());
+	}
+	egress_lock.unlock();
+	return len;
+}
+
+/* Pick the paths of a session for one datagram according to multipathMode. */
+int KcpEngine::pickPaths(KcpClient *client, int flags)
+{
+	int npaths = client->npaths;
+	int best = 0;
+	bool all = false;
+
+	if (npaths > 1)
+	{
+		for (int i = 1; i < npaths; i++)
+		{
+			uint32_t srtt = client->paths[i].srtt;
+			if (srtt && (client->paths[best].srtt == 0 || srtt < client->paths[best].srtt))
+				best = i;
+		}
+
+		if (multipathMode == MULTIPATH_DUPLICATE)
+			all = true;
+		else if (multipathMode == MULTIPATH_RETRANS)
+			all = flags & IKCP_OUT_RETRANS;
+		else {
+			/* keep the rtt of the slower paths fresh */
+			uint64_t now_ms = getTimeMs();
+			if (now_ms - client->lastProbeMs > 1000)
+			{
+				client->lastProbeMs = now_ms;
+				all = true;
+			}
+		}
+	}
+
+	return all ? (1 << npaths) - 1 : 1 << best;
+}
+
+void KcpEngine::transmit(KcpClient *client, const char *buf, int len, int flags)
+{
+	if (shmTransmit(client, buf, len))
+		return;
+
+	int mask = pickPaths(client, flags);
+
+	for (int i = 0; i < client->npaths; i++)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+		PeerPath &peer = client->paths[i];
+		if (sendDatagram(pathFds[peer.path], peer.nip, peer.nport, buf, len) >= 0)
+			peer.txPackets++;
+	}
+}
+
+/* Send everything a batched flush produced with one sendmmsg per socket. */
+void KcpEngine::transmitBatch(OutputBatch &batch)
+{
+	vector<mmsghdr> msgs;
+	vector<iovec> iovs;
+	vector<sockaddr_in> addrs;
+	vector<PeerPath *> peers;
+
+	for (int path = 0; path < pathCount; path++)
+	{
+		msgs.clear();
+		iovs.clear();
+		addrs.clear();
+		peers.clear();
+
+		for (size_t i = 0; i < batch.datagrams.size(); i++)
+		{
+			KcpClient *client = batch.clients[i];
+			Datagram &datagram = batch.datagrams[i];
+			if (path == 0)
+			{
+				if (shmTransmit(client, datagram.data.data(), datagram.data.size()))
+				{
+					datagram.flags = 0;
+					continue;
+				}
+				datagram.flags = pickPaths(client, datagram.flags);
+			}
+
+			for (int slot = 0; slot < client->npaths; slot++)
+			{
+				PeerPath &peer = client->paths[slot];
+				if (peer.path != path || !(datagram.flags & (1 << slot)))
+					continue;
+
+				sockaddr_in addr;
+				memset(&addr, 0, sizeof(addr));
+				addr.sin_family = AF_INET;
+				addr.sin_addr.s_addr = peer.nip;
+				addr.sin_port = peer.nport;
+				addrs.push_back(addr);
+				iovs.push_back(iovec{datagram.data.data(), datagram.data.size()});
+				peers.push_back(&peer);
+			}
+		}
+
+		/* the vectors are complete now, so the pointers below stay valid */
+		msgs.resize(iovs.size());
+		for (size_t i = 0; i < iovs.size(); i++)
+		{
+			memset(&msgs[i], 0, sizeof(mmsghdr));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		size_t sent = 0;
+		while (sent < msgs.size())
+		{
+			int ret = sendmmsg(pathFds[path], &msgs[sent], msgs.size() - sent, 0);
+			if (ret <= 0)
+			{
+				/* count the failed datagram and carry on with the rest */
+				txErrors++;
+				sent++;
+				continue;
+			}
+			for (int i = 0; i < ret; i++)
+			{
+				txPackets++;
+				txBytes += msgs[sent + i].msg_len;
+				peers[sent + i]->txPackets++;
+			}
+			sent += ret;
+		}
+	}
+}
+
+ssize_t KcpEngine::sendDatagram(int fd, uint32_t nip, uint16_t nport, const char *buf, int len)
+{
+	sockaddr_in clientAddr;
+
+	memset(&clientAddr, 0, sizeof(clientAddr));
+	clientAddr.sin_family = AF_INET;
+	clientAddr.sin_addr.s_addr = nip;
+	clientAddr.sin_port = nport;
+
+	ssize_t bytes_sent = sendto(fd, buf, len, 0,
+			(struct sockaddr*)&clientAddr, sizeof(clientAddr));
+	if (bytes_sent < 0)
+	{
+		txErrors++;
+		if ((errno == ENOBUFS || errno == EAGAIN) && bufAutoTune)
+			growSockBuf(SO_SNDBUF, SO_SNDBUFFORCE, sndBufSize);
+	} else {
+		txPackets++;
+		txBytes += bytes_sent;
+	}
+	return bytes_sent;
+}
+
+/*
+ * Drain the per-session output queues with deficit round robin: every visit
+ * grants a session quantum * weight bytes, so a session flushing a full
+ * window cannot hold the socket while others wait behind it.
+ */
+void KcpEngine::drainOutput()
+{
+	Datagram datagram;
+
+	while (true)
+	{
+		if (!drain_lock.try_lock())
+			return;
+
+		egress_lock.lock();
+		while (!drrActive.empty())
+		{
+			shared_ptr<KcpClient> client = drrActive.front();
+			drrActive.pop_front();
+			client->deficit += (int64_t)drrQuantum * client->weight;
+
+			while (!client->outQueue.empty() &&
+				(int64_t)client->outQueue.front().data.size() <= client->deficit)
+			{
+				datagram = std::move(client->outQueue.front());
+				client->outQueue.pop_front();
+				client->deficit -= datagram.data.size();
+
+				egress_lock.unlock();
+				transmit(client.get(), datagram.data.data(), datagram.data.size(), datagram.flags);
+				egress_lock.lock();
+			}
+
+			if (client->outQueue.empty())
+			{
+				client->drrQueued = false;
+				client->deficit = 0;
+			} else
+				drrActive.push_back(client);
+		}
+		egress_lock.unlock();
+		drain_lock.unlock();
+
+		/* Output queued while we were releasing drain_lock is ours to send. */
+		egress_lock.lock();
+		bool pending = !drrActive.empty();
+		egress_lock.unlock();
+		if (!pending)
+			return;
+	}
+}
+
+void KcpEngine::set_fair_output(bool enable, uint32_t quantum)
+{
+	if (quantum > 0)
+		drrQuantum = quantum;
+	fairOutput = enable;
+	if (!enable)
+		drainOutput();
+}
+
+void KcpEngine::client_weight(shared_ptr<KcpClient> client, uint32_t weight)
+{
+	egress_lock.lock();
+	client->weight = weight > 0 ? weight : 1;
+	egress_lock.unlock();
+}
+
+void KcpEngine::set_rate_limit(uint32_t pps, uint32_t bps, uint32_t burst_ms)
+{
+	limit_lock.lock();
+	limitPps = pps;
+	limitBps = bps;
+	limitBurstMs = burst_ms > 0 ? burst_ms : 1;
+	peerLimits.clear();
+	peerLru.clear();
+	limit_lock.unlock();
+}
+
+vector<tuple<uint32_t, uint16_t, uint64_t, uint64_t>> KcpEngine::rate_limit_stats()
+{
+	vector<tuple<uint32_t, uint16_t, uint64_t, uint64_t>> stats;
+
+	limit_lock.lock();
+	for (const auto& peer : peerLru)
+	{
+		if (peer.droppedPkts == 0)
+			continue;
+		stats.emplace_back(peer.key >> 16, peer.key & 0xffff,
+			peer.droppedPkts, peer.droppedBytes);
+	}
+	limit_lock.unlock();
+	return stats;
+}
+
+static uint64_t steadyUs()
+{
+	return chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Bucket of a peer address, called with limit_lock held. Every address
+ * gets its own; beyond PEER_LIMIT_MAX the least recently seen peer is
+ * forgotten and its entry reused, so a spray of spoofed addresses costs
+ * a bounded table rather than the buckets of other peers.
+ */
+PeerLimit &KcpEngine::peerEntry(uint64_t key, uint64_t nowUs)
+{
+	auto it = peerLimits.find(key);
+	if (it != peerLimits.end())
+	{
+		peerLru.splice(peerLru.begin(), peerLru, it->second);
+		return peerLru.front();
+	}
+
+	/* refilled to the caps on first use */
+	PeerLimit peer{key, HUGE_VAL, HUGE_VAL, nowUs};
+	if (peerLimits.size() >= PEER_LIMIT_MAX)
+	{
+		peerLimits.erase(peerLru.back().key);
+		peerLru.splice(peerLru.begin(), peerLru, prev(peerLru.end()));
+		peerLru.front() = peer;
+	} else
+		peerLru.push_front(peer);
+	peerLimits[key] = peerLru.begin();
+	return peerLru.front();
+}
+
+/*
+ * Remember that the create callback refused a peer, its datagrams are
+ * dropped before a session is allocated for CREATE_REJECT_MS. The marks
+ * are kept apart from the limiter, set_rate_limit leaves them alone.
+ */
+void KcpEngine::rejectPeer(uint32_t nip, uint16_t nport)
+{
+	uint64_t nowUs = steadyUs();
+	uint64_t key = ((uint64_t)nip << 16) | nport;
+	uint64_t until = nowUs + CREATE_REJECT_MS * 1000;
+
+	reject_lock.lock();
+	/* every mark lasts as long, so they expire in the order they were set */
+	while (!rejectOrder.empty() && (rejectOrder.front().second <= nowUs || rejectOrder.size() >= CREATE_REJECT_MAX))
+	{
+		auto it = rejectedPeers.find(rejectOrder.front().first);
+		if (it != rejectedPeers.end() && it->second == rejectOrder.front().second)
+			rejectedPeers.erase(it);
+		rejectOrder.pop_front();
+	}
+	rejectedPeers[key] = until;
+	rejectOrder.emplace_back(key, until);
+	reject_lock.unlock();
+}
+
+bool KcpEngine::peerRejected(uint32_t nip, uint16_t nport)
+{
+	uint64_t key = ((uint64_t)nip << 16) | nport;
+	bool rejected = false;
+
+	reject_lock.lock();
+	if (!rejectedPeers.empty())
+	{
+		auto it = rejectedPeers.find(key);
+		rejected = it != rejectedPeers.end() && it->second > steadyUs();
+	}
+	reject_lock.unlock();
+	return rejected;
+}
+
+bool KcpEngine::rateLimited(uint32_t nip, uint16_t nport, ssize_t len)
+{
+	if (limitPps == 0 && limitBps == 0)
+		return false;
+
+	uint64_t nowUs = steadyUs();
+	double pktCap = (double)limitPps * limitBurstMs / 1000 + 1;
+	double byteCap = (double)limitBps * limitBurstMs / 1000 + RECV_BUFFER_SIZE;
+	uint64_t key = ((uint64_t)nip << 16) | nport;
+	bool drop = false;
+
+	limit_lock.lock();
+	PeerLimit &peer = peerEntry(key, nowUs);
+	double elapsed = (double)(nowUs - peer.lastUs) / 1000000;
+	peer.lastUs = nowUs;
+	peer.pktTokens = min(pktCap, peer.pktTokens + elapsed * limitPps);
+	peer.byteTokens = min(byteCap, peer.byteTokens + elapsed * limitBps);
+
+	if ((limitPps && peer.pktTokens < 1) || (limitBps && peer.byteTokens < len))
+	{
+		peer.droppedPkts++;
+		peer.droppedBytes += len;
+		drop = true;
+	} else {
+		peer.pktTokens -= 1;
+		peer.byteTokens -= len;
+	}
+	limit_lock.unlock();
+
+	return drop;
+}
+
+void KcpEngine::applySockBuf(int fd, int opt, int force_opt, int bytes)
+{
+	/* FORCE variants ignore rmem_max/wmem_max but need CAP_NET_ADMIN. */
+	if (setsockopt(fd, SOL_SOCKET, force_opt, &bytes, sizeof(bytes)) < 0)
+		setsockopt(fd, SOL_SOCKET, opt, &bytes, sizeof(bytes));
+}
+
+int KcpEngine::setSockBuf(int opt, int force_opt, int bytes)
+{
+	if (bytes > 0)
+	{
+		if (opt == SO_RCVBUF)
+			rcvBufWant = bytes;
+		else
+			sndBufWant = bytes;
+		for (int i = 0; i < pathCount; i++)
+			applySockBuf(pathFds[i], opt, force_opt, bytes);
+	}
+
+	int real = 0;
+	socklen_t optlen = sizeof(real);
+	if (getsockopt(pathFds[0], SOL_SOCKET, opt, &real, &optlen) < 0)
+		return -1;
+	return real;
+}
+
+void KcpEngine::growSockBuf(int opt, int force_opt, atomic<int> &cur)
+{
+	int want = cur * 2;
+	int max = bufAutoMax;
+	if (want > max)
+		want = max;
+	if (want <= cur)
+		return;
+
+	int real = setSockBuf(opt, force_opt, want);
+	if (real > 0)
+		cur = real;
+}
+
+int KcpEngine::set_sockbuf(int rcvbuf, int sndbuf)
+{
+	if (rcvbuf > 0)
+		rcvBufSize = setSockBuf(SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf);
+	if (sndbuf > 0)
+		sndBufSize = setSockBuf(SO_SNDBUF, SO_SNDBUFFORCE, sndbuf);
+	if (rcvBufSize < 0 || sndBufSize < 0)
+		return -1;
+	return 0;
+}
+
+void KcpEngine::set_sockbuf_auto(bool enable, int max_bytes)
+{
+	if (max_bytes > 0)
+		bufAutoMax = max_bytes;
+	bufAutoTune = enable;
+}
+
+map<string, uint64_t> KcpEngine::sock_stats()
+{
+	map<string, uint64_t> stats;
+	uint64_t retransmits = 0;
+
+	client_lock.lock_shared();
+	kcp_lock.lock();
+	for (const auto& pair : clients)
+		retransmits += pair.second->kcp->xmit;
+	kcp_lock.unlock();
+	client_lock.unlock_shared();
+
+	stats["rcvbuf"] = rcvBufSize;
+	stats["sndbuf"] = sndBufSize;
+	stats["kernel_drops"] = kernelDrops;
+	stats["rx_packets"] = rxPackets;
+	stats["rx_bytes"] = rxBytes;
+	stats["tx_packets"] = txPackets;
+	stats["tx_bytes"] = txBytes;
+	stats["tx_errors"] = txErrors;
+	stats["retransmits"] = retransmits;
+	stats["shm_tx_packets"] = shmTxPackets;
+	stats["shm_rx_packets"] = shmRxPackets;
+	return stats;
+}
+
+void KcpEngine::recvLoop(int path)
+{
+	ssize_t recv_len;
+	sockaddr_in client_addr;
+	char recvBuffer[RECV_BUFFER_SIZE];
+	char recvCmsg[CMSG_SPACE(sizeof(uint32_t))];
+	uint32_t lastDrops = 0;
+	iovec iov;
+	msghdr msg;
+	while(!exit)
+	{
+		iov.iov_base = recvBuffer;
+		iov.iov_len = sizeof(recvBuffer);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &client_addr;
+		msg.msg_namelen = sizeof(client_addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = recvCmsg;
+		msg.msg_controllen = sizeof(recvCmsg);
+
+		recv_len = recvmsg(pathFds[path], &msg, 0);
+		if (recv_len < 0)
+			continue;
+
+		rxPackets++;
+		rxBytes += recv_len;
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+				continue;
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			if (drops != lastDrops)
+			{
+				kernelDrops += drops - lastDrops;
+				lastDrops = drops;
+				if (bufAutoTune)
+					growSockBuf(SO_RCVBUF, SO_RCVBUFFORCE, rcvBufSize);
+			}
+		}
+
+		if (rateLimited(client_addr.sin_addr.s_addr, client_addr.sin_port, recv_len))
+			continue;
+
+		shared_ptr<KcpClient> client;
+		if (multipathInUse)
+		{
+			uint64_t peer_key = ((uint64_t)client_addr.sin_addr.s_addr << 16) | client_addr.sin_port;
+			client_lock.lock_shared();
+			auto alias = pathAliases.find(peer_key);
+			if (alias != pathAliases.end())
+				client = alias->second;
+			client_lock.unlock_shared();
+		}
+		if (client)
+			client->lastTimeMs = getTimeMs();
+		else
+			client = findOrNewClient(client_addr.sin_addr.s_addr, client_addr.sin_port, path);
+		if (client == nullptr)
+			continue;
+
+		if (client->npaths > 1)
+		{
+			for (int i = 0; i < client->npaths; i++)
+			{
+				PeerPath &peer = client->paths[i];
+				if (peer.path == path && peer.nip == client_addr.sin_addr.s_addr &&
+					peer.nport == client_addr.sin_port)
+				{
+					updatePathRtt(client, i, recvBuffer, recv_len);
+					break;
+				}
+			}
+		}
+
+		input(client, recvBuffer, recv_len);
+	}
+}
+
+/* Feed one datagram of a session to kcp and hand out what became ready. */
+void KcpEngine::input(shared_ptr<KcpClient> client, const char *data, ssize_t len)
+{
+	kcp_lock.lock();
+	ikcp_input(client->kcp, data, len);
+	ssize_t size = ikcp_peeksize(client->kcp);
+	int waitsnd = ikcp_waitsnd(client->kcp);
+	bool acked = !client->inflight.empty() && collectAcked(client);
+	bool sending = client->fileSend != nullptr;
+	bool sinking = client->fileRecv != nullptr;
+	kcp_lock.unlock();
+
+	if (sending)
+		pumpFile(client);
+	if (sinking && size > 0 && sinkFile(client))
+	{
+		kcp_lock.lock();
+		size = ikcp_peeksize(client->kcp);
+		kcp_lock.unlock();
+	}
+
+	if (acked && mOnAcked && !client->ackQueued.exchange(true))
+		pushEvent(EVENT_ACKED, client);
+
+	/* plugin and rpc sessions return early below, report them too */
+	if (client->drainWanted && waitsnd <= client->drainLowWater)
+		markWritable(client);
+
+	if (plugin)
+	{
+		if (size > 0 || client->pluginWritable)
+			pluginInput(client);
+		return;
+	}
+
+	if (rpcMode)
+	{
+		if (size > 0)
+			rpcInput(client);
+		return;
+	}
+
+	if(size > 0)
+	{
+		if (mOnRecv)
+		{
+			/* one event per client until the dispatcher drained it */
+			if (!client->recvQueued.exchange(true))
+				pushEvent(EVENT_RECV, client);
+		} else if (client->owned)
+			notifyOwner(client);
+		else if (eventFd >= 0)
+			signalEvent();
+		else
+			semaphore.notify();
+	}
+}
+
+void KcpEngine::pushEvent(CallbackEventType type, shared_ptr<KcpClient> client)
+{
+	CallbackEvent *event;
+
+	/* the per-session events keep the steady state free of allocations */
+	if (type == EVENT_RECV)
+		event = &client->recvEvent;
+	else if (type == EVENT_ACKED)
+		event = &client->ackedEvent;
+	else if (type == EVENT_WRITABLE)
+		event = &client->writableEvent;
+	else
+		event = new CallbackEvent{type, nullptr, nullptr};
+	event->client = client;
+	events.push(event);
+}
+
+void KcpEngine::post(coroutine_handle<> handle)
+{
+	CallbackEvent *event = new CallbackEvent{EVENT_RESUME, nullptr, nullptr};
+	event->handle = handle;
+	events.push(event);
+}
+
+void KcpEngine::dispatchLoop()
+{
+	while (!exit)
+	{
+		CallbackEvent *batch = events.takeAll();
+		if (batch == nullptr)
+		{
+			events.wait();
+			continue;
+		}
+
+		dispatchBatch(batch);
+	}
+}
+
+void KcpEngine::dispatchBatch(CallbackEvent *batch)
+{
+	while (batch)
+	{
+		CallbackEvent *event = batch;
+		batch = batch->next;
+		try {
+			dispatchEvent(event);
+		} catch (exception &e) {
+			cout << "callback fail: " << e.what() << endl;
+		}
+		releaseEvent(event);
+	}
+}
+
+void KcpEngine::dispatchEvent(CallbackEvent *event)
+{
+	/* a pooled event may be queued again once its flag is cleared */
+	shared_ptr<KcpClient> client = move(event->client);
+
+	switch (event->type)
+	{
+	case EVENT_CREATE:
+		if (mOnCreate && mOnCreate(this, client) == false)
+			dropClient(client);
+		break;
+	case EVENT_CLEAN:
+		if (rpcMode)
+			rpcFail(client);
+		if (mOnClean)
+			mOnClean(this, client);
+		break;
+	case EVENT_RECV:
+		client->recvQueued = false;
+		deliverRecv(client);
+		break;
+	case EVENT_ACKED:
+		client->ackQueued = false;
+		if (mOnAcked)
+		{
+			vector<uint64_t> ids = acked(client);
+			if (!ids.empty())
+				mOnAcked(this, client, ids);
+		}
+		break;
+	case EVENT_WRITABLE:
+		client->writableQueued = false;
+		if (mOnWritable)
+			mOnWritable(this, client);
+		break;
+	case EVENT_RPC:
+		rpcDispatch(client, event->data);
+		break;
+	case EVENT_RESUME:
+		event->handle.resume();
+		break;
+	}
+}
+
+void KcpEngine::deliverRecv(shared_ptr<KcpClient> client)
+{
+	static thread_local vector<char> buffer;
+
+	while (mOnRecv)
+	{
+		kcp_lock.lock();
+		int size = ikcp_peeksize(client->kcp);
+		if (size <= 0)
+		{
+			kcp_lock.unlock();
+			break;
+		}
+		if (buffer.size() < (size_t)size)
+			buffer.resize(size);
+		ikcp_recv(client->kcp, buffer.data(), size);
+		kcp_lock.unlock();
+		mOnRecv(this, client, buffer.data(), size);
+	}
+}
+
+/* Forget a session the create callback refused. */
+void KcpEngine::dropClient(shared_ptr<KcpClient> client)
+{
+	uint64_t client_id = (client->nip << 16) + client->nport;
+
+	rejectPeer(client->nip, client->nport);
+
+	client_lock.lock();
+	for (auto it = pathAliases.begin(); it != pathAliases.end(); )
+	{
+		if (it->second == client)
+			it = pathAliases.erase(it);
+		else
+			++it;
+	}
+	auto it = clients.find(client_id);
+	if (it != clients.end() && it->second == client)
+		clients.erase(it);
+	client_lock.unlock();
+}
+
+int KcpEngine::event_fd()
+{
+	lock_guard<mutex> guard(event_lock);
+	if (eventFd < 0)
+	{
+		eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (eventFd < 0)
+			throw runtime_error("eventfd create fail.");
+	}
+	return eventFd;
+}
+
+void KcpEngine::signalEvent()
+{
+	uint64_t one = 1;
+	if (write(eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		cout << "eventfd write fail." << endl;
+}
+
+void KcpEngine::markWritable(shared_ptr<KcpClient> client)
+{
+	bool wanted = true;
+	if (!client->drainWanted.compare_exchange_strong(wanted, false))
+		return;
+
+	/* input() runs the hook right after, serialized with on_message */
+	const kcp_plugin *handler = plugin;
+	if (handler && handler->abi >= 2 && handler->on_writable)
+	{
+		client->pluginWritable = true;
+		return;
+	}
+
+	if (mOnWritable && !client->writableQueued.exchange(true))
+		pushEvent(EVENT_WRITABLE, client);
+	/* nobody polls writable_clients when only the callback is used */
+	if (mOnWritable && eventFd < 0)
+		return;
+
+	event_lock.lock();
+	writableClients.push_back(client);
+	event_lock.unlock();
+	if (eventFd >= 0)
+		signalEvent();
+}
+
+bool KcpEngine::want_writable(shared_ptr<KcpClient> client, int low_water)
+{
+	if (low_water < 0)
+		low_water = client->lowWater;
+	client->drainLowWater = low_water;
+	client->drainWanted = true;
+
+	kcp_lock.lock();
+	int waitsnd = ikcp_waitsnd(client->kcp);
+	kcp_lock.unlock();
+	if (waitsnd > low_water)
+		return false;
+
+	/* already below, nobody will report it */
+	client->drainWanted = false;
+	return true;
+}
+
+vector<shared_ptr<KcpClient>> KcpEngine::writable_clients()
+{
+	vector<shared_ptr<KcpClient>> ready;
+	event_lock.lock();
+	ready.swap(writableClients);
+	event_lock.unlock();
+	return ready;
+}
+
+/* Unowned sessions with a complete message waiting. */
+vector<shared_ptr<KcpClient>> KcpEngine::ready_clients()
+{
+	vector<shared_ptr<KcpClient>> ready;
+
+	client_lock.lock_shared();
+	for (const auto& pair : clients) {
+		shared_ptr<KcpClient> client = pair.second;
+		if (client->owned)
+			continue;
+		kcp_lock.lock();
+		int size = ikcp_peeksize(client->kcp);
+		kcp_lock.unlock();
+		if (size > 0)
+			ready.push_back(client);
+	}
+	client_lock.unlock_shared();
+
+	return ready;
+}
+
+/*
+ * Every ACK echoes the ts of the segment it acknowledges, so the ACKs that
+ * come back on a path give a per-path rtt sample without touching the wire
+ * format. Samples are smoothed like rx_srtt in ikcp_update_ack.
+ */
+void KcpEngine::updatePathRtt(shared_ptr<KcpClient> client, int slot, const char *data, ssize_t len)
+{
+	uint32_t current = getBoottimeMs(client);
+	PeerPath &peer = client->paths[slot];
+
+	while (len >= 20)
+	{
+		uint8_t cmd = (uint8_t)data[1];
+		uint16_t seg_len;
+		uint32_t ts;
+		memcpy(&seg_len, data + 6, sizeof(seg_len));
+		memcpy(&ts, data + 8, sizeof(ts));
+
+		if (cmd == 82 && (int32_t)(current - ts) >= 0)
+		{
+			uint32_t rtt = current - ts;
+			uint32_t srtt = peer.srtt;
+			peer.srtt = srtt == 0 ? (rtt ? rtt : 1) : (7 * srtt + rtt) / 8;
+		}
+
+		data += 20 + seg_len;
+		len -= 20 + seg_len;
+	}
+}
+
+void KcpEngine::updateLoop()
+{
+	uint64_t now_ms;
+	uint32_t boot_ms;
+	uint32_t min_sleep;
+	vector<uint64_t> clear_clients;
+
+	while(!exit)
+	{
+		min_sleep = 50;
+		now_ms = getTimeMs();
+		client_lock.lock_shared();
+		for (auto it = clients.begin(); it != clients.end(); ++it) {
+			shared_ptr<KcpClient> client = it->second;
+			boot_ms = getBoottimeMs(client);
+
+			/* the receive thread may have stamped lastTimeMs after now_ms */
+			if (client->lastTimeMs < now_ms && now_ms - client->lastTimeMs > timeOutMs)
+			{
+				if (mOnClean || rpcMode)
+					pushEvent(EVENT_CLEAN, client);
+				/* both shm threads see the hang up and let the channel go */
+				if (client->shm)
+					shutdown(client->shm->sock, SHUT_RDWR);
+				closeOwner(client);
+
+				clear_clients.push_back(it->first);
+				if(1)
+					cout << "client timeout. key:" << it->first << " clear_clients size:" << clear_clients.size() << endl;
+				continue;
+			}
+
+			if(client->nextUpdate == 0)
+			{
+				kcp_lock.lock();
+				client->nextUpdate = ikcp_check(client->kcp, boot_ms);
+				kcp_lock.unlock();
+				if(client->nextUpdate - boot_ms < min_sleep)
+					min_sleep = client->nextUpdate - boot_ms;
+			}
+
+			if(client->nextUpdate <= boot_ms)
+			{
+				kcp_lock.lock();
+				ikcp_update(client->kcp, boot_ms);
+				bool sending = client->fileSend != nullptr;
+				kcp_lock.unlock();
+				client->nextUpdate = 0;
+				if (sending)
+					pumpFile(client);
+			}
+		}
+		client_lock.unlock_shared();
+		drainOutput();
+
+		for (uint64_t value : clear_clients) {
+			client_lock.lock();
+			auto cit = clients.find(value);
+			for (auto it = pathAliases.begin(); cit != clients.end() && it != pathAliases.end(); )
+			{
+				if (it->second == cit->second)
+					it = pathAliases.erase(it);
+				else
+					++it;
+			}
+			clients.erase(value);
+			client_lock.unlock();
+		}
+		clear_clients.clear();
+
+		this_thread::sleep_for(chrono::milliseconds(min_sleep));
+	}
+}
+
+int KcpEngine::peek_size(shared_ptr<KcpClient> client)
+{
+	kcp_lock.lock();
+	int size = ikcp_peeksize(client->kcp);
+	kcp_lock.unlock();
+	return size;
+}
+
+int KcpEngine::waitsnd(shared_ptr<KcpClient> client)
+{
+	kcp_lock.lock();
+	int count = ikcp_waitsnd(client->kcp);
+	kcp_lock.unlock();
+	return count;
+}
+
+int KcpEngine::recv(shared_ptr<KcpClient> client, char *buf, int len)
+{
+	kcp_lock.lock();
+	int ret = ikcp_recv(client->kcp, buf, len);
+	kcp_lock.unlock();
+	return ret;
+}
+
+/* Sleep until a message of an unowned session arrived, not for eventfd users. */
+void KcpEngine::wait_any()
+{
+	semaphore.wait();
+}
+
+void KcpEngine::notifyOwner(shared_ptr<KcpClient> client)
+{
+	{
+		lock_guard<mutex> guard(client->recvMutex);
+		client->recvReady = true;
+	}
+	client->recvCond.notify_all();
+}
+
+/* Wake the session's waiters for good, it timed out or the engine stops. */
+void KcpEngine::closeOwner(shared_ptr<KcpClient> client)
+{
+	{
+		lock_guard<mutex> guard(client->recvMutex);
+		client->recvClosed = true;
+	}
+	client->recvCond.notify_all();
+}
+
+/*
+ * Sleep until the session received something or was closed, without a
+ * deadline it waits forever. Returns false on timeout. The session becomes owned:
+ * ready_clients and the eventfd skip it and only its own waiters are woken.
+ */
+bool KcpEngine::wait_readable(shared_ptr<KcpClient> client, optional<chrono::steady_clock::time_point> deadline)
+{
+	bool ready = true;
+
+	client->owned = true;
+	unique_lock<mutex> guard(client->recvMutex);
+	auto pred = [&] { return client->recvReady || client->recvClosed || exit; };
+	if (!deadline)
+		client->recvCond.wait(guard, pred);
+	else
+		ready = client->recvCond.wait_until(guard, *deadline, pred);
+	client->recvReady = false;
+	return ready;
+}
+
+/*
+ * Called under kcp_lock before queueing. Over the high watermark the
+ * session is armed so markWritable reports it at the low watermark.
+ */
+bool KcpEngine::overHighWater(shared_ptr<KcpClient> client) {
+	if (client->highWater <= 0 || ikcp_waitsnd(client->kcp) < client->highWater)
+		return false;
+	client->drainLowWater = client->lowWater;
+	client->drainWanted = true;
+	return true;
+}
+
+int KcpEngine::client_watermark(shared_ptr<KcpClient> client, int high, int low) {
+	if (high < 0 || low < 0 || (high > 0 && low >= high))
+		return -1;
+	kcp_lock.lock();
+	client->highWater = high;
+	client->lowWater = low;
+	kcp_lock.unlock();
+	return 0;
+}
+
+int KcpEngine::send_buffer(shared_ptr<KcpClient> client, const char *buf, ssize_t size) {
+	if (size > INT32_MAX) return -1;
+	kcp_lock.lock();
+	if (overHighWater(client))
+	{
+		kcp_lock.unlock();
+		return SEND_WOULD_BLOCK;
+	}
+	int ret = ikcp_send(client->kcp, buf, size);
+	kcp_lock.unlock();
+	return ret;
+}
+
+/*
+ * Segments leave snd_queue in order and take sn from snd_nxt, so the last
+ * fragment of a message just queued will be sent as snd_nxt + nsnd_que - 1.
+ */
+int64_t KcpEngine::send_tracked(shared_ptr<KcpClient> client, const char *buf, ssize_t size) {
+	if (size > INT32_MAX) return -1;
+	kcp_lock.lock();
+	int ret = overHighWater(client) ? SEND_WOULD_BLOCK : ikcp_send(client->kcp, buf, size);
+	if (ret < 0)
+	{
+		kcp_lock.unlock();
+		return ret;
+	}
+	uint64_t id = client->nextMsgId++;
+	client->inflight.emplace_back(client->kcp->snd_nxt + client->kcp->nsnd_que - 1, id);
+	kcp_lock.unlock();
+	return id;
+}
+
+/*
+ * Called under kcp_lock after ikcp_input. A message counts as delivered
+ * once snd_una moves past its last fragment, i.e. every fragment of it
+ * and of all earlier messages has been acknowledged.
+ */
+bool KcpEngine::collectAcked(shared_ptr<KcpClient> client) {
+	uint32_t una = client->kcp->snd_una;
+	bool found = false;
+
+	lock_guard<mutex> lock(client->ackMutex);
+	while (!client->inflight.empty() && (int32_t)(una - client->inflight.front().first) > 0)
+	{
+		client->ackedIds.push_back(client->inflight.front().second);
+		client->inflight.pop_front();
+		found = true;
+	}
+	return found;
+}
+
+/*
+ * Conflated send: a message with the same key that is still waiting in
+ * snd_queue is replaced. The queue holds at most one message per key,
+ * so keyed sends are not subject to the high watermark.
+ *
+ * A replacement with a different fragment count moves the sn of every
+ * segment queued behind it, tracked messages among them are fixed up.
+ */
+int KcpEngine::send_keyed(shared_ptr<KcpClient> client, uint32_t key, const char *buf, ssize_t size, bool flush) {
+	if (size > INT32_MAX) return -1;
+
+	kcp_lock.lock();
+	ikcpcb *kcp = client->kcp;
+	uint32_t queued = kcp->nsnd_que;
+	int behind = 0;
+	int ret = ikcp_send_keyed(kcp, key, buf, size, &behind);
+	if (ret == 1 && behind > 0 && kcp->nsnd_que != queued)
+	{
+		uint32_t from = kcp->snd_nxt + queued - behind;
+		int32_t shift = kcp->nsnd_que - queued;
+		for (auto it = client->inflight.rbegin(); it != client->inflight.rend() && (int32_t)(it->first - from) >= 0; ++it)
+			it->first += shift;
+	}
+	kcp_lock.unlock();
+	if (ret >= 0 && flush)
+		flushClient(client);
+	return ret;
+}
+
+vector<uint64_t> KcpEngine::acked(shared_ptr<KcpClient> client) {
+	vector<uint64_t> ids;
+	lock_guard<mutex> lock(client->ackMutex);
+	ids.swap(client->ackedIds);
+	return ids;
+}
+
+static int bpfCall(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn insn;
+	memset(&insn, 0, sizeof(insn));
+	insn.code = code;
+	insn.dst_reg = dst;
+	insn.src_reg = src;
+	insn.off = off;
+	insn.imm = imm;
+	return insn;
+}
+
+/*
+ * A pinned map outlives its group. One left by a group of another size,
+ * or not made by us, would make the program's hash % workers pick slots
+ * it does not have, so it is refused instead of joined.
+ */
+static bool reuseportMapFits(int fd, uint32_t workers)
+{
+	struct bpf_map_info info;
+	union bpf_attr attr;
+
+	memset(&info, 0, sizeof(info));
+	memset(&attr, 0, sizeof(attr));
+	attr.info.bpf_fd = fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info = (uint64_t)(uintptr_t)&info;
+	if (bpfCall(BPF_OBJ_GET_INFO_BY_FD, &attr) < 0)
+		return false;
+	return info.type == BPF_MAP_TYPE_REUSEPORT_SOCKARRAY && info.key_size == sizeof(uint32_t) &&
+		info.value_size == sizeof(uint64_t) && info.max_entries == workers;
+}
+
+/*
+ * The slot map is pinned so every worker process, including restarted
+ * ones, opens the same map. The first one creates it.
+ */
+static int openReuseportMap(const string &path, uint32_t workers)
+{
+	union bpf_attr attr;
+
+	for (int retry = 0; retry < 2; retry++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.pathname = (uint64_t)(uintptr_t)path.c_str();
+		int fd = bpfCall(BPF_OBJ_GET, &attr);
+		if (fd >= 0 && !reuseportMapFits(fd, workers))
+		{
+			close(fd);
+			errno = EINVAL;
+			return -1;
+		}
+		if (fd >= 0 || errno != ENOENT)
+			return fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+		attr.key_size = sizeof(uint32_t);
+		attr.value_size = sizeof(uint64_t);
+		attr.max_entries = workers;
+		fd = bpfCall(BPF_MAP_CREATE, &attr);
+		if (fd < 0)
+			return fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.pathname = (uint64_t)(uintptr_t)path.c_str();
+		attr.bpf_fd = fd;
+		if (bpfCall(BPF_OBJ_PIN, &attr) == 0)
+			return fd;
+		int err = errno;
+		close(fd);
+		/* another worker pinned it first, open that one */
+		if (err != EEXIST)
+		{
+			errno = err;
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * SK_REUSEPORT program: slot = hash of the 4-tuple % workers, then pick
+ * the socket in that slot. The hash only depends on the peer address,
+ * so a peer keeps its worker however the group changes. While a slot is
+ * empty its datagrams are dropped and KCP retransmits them.
+ */
+static int loadReuseportProg(int map_fd, uint32_t workers)
+{
+	struct bpf_insn prog[] = {
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct sk_reuseport_md, hash), 0),
+		bpfInsn(BPF_ALU | BPF_MOD | BPF_K, BPF_REG_2, 0, 0, (int32_t)workers),
+		bpfInsn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+		/* bpf_sk_select_reuseport(ctx, map, &slot, 0) */
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		bpfInsn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		bpfInsn(0, 0, 0, 0, 0),
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4),
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+		bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 2, 0),
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_DROP),
+		bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static const char license[] = "Dual MIT/GPL";
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.expected_attach_type = BPF_SK_REUSEPORT_SELECT;
+	attr.insns = (uint64_t)(uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(uintptr_t)license;
+	return bpfCall(BPF_PROG_LOAD, &attr);
+}
+
+/*
+ * Take slot worker of a SO_REUSEPORT group of workers processes bound to
+ * the same port, every process constructs its engine with reuse_port set.
+ * Returns 0 or -errno; needs CAP_BPF and a mounted bpffs for the pin.
+ * -EINVAL also when pin_path holds the map of a group with another
+ * number of workers, remove the pin before resizing a group.
+ */
+int KcpEngine::join_reuseport(uint32_t worker, uint32_t workers, string pin_path)
+{
+	union bpf_attr attr;
+
+	if (!reusePort || workers == 0 || worker >= workers || reuseMapFd >= 0)
+		return -EINVAL;
+	if (pin_path.empty())
+	{
+		sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		getsockname(sockfd, (struct sockaddr *)&addr, &len);
+		pin_path = "/sys/fs/bpf/pykcp_" + to_string(ntohs(addr.sin_port));
+	}
+
+	int map_fd = openReuseportMap(pin_path, workers);
+	if (map_fd < 0)
+		return -errno;
+
+	/* replaces the socket of a previous process in this slot */
+	uint32_t key = worker;
+	uint64_t value = sockfd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	attr.value = (uint64_t)(uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	if (bpfCall(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+	{
+		int err = errno;
+		close(map_fd);
+		return -err;
+	}
+
+	/* the program belongs to the group, every worker attaches the same one */
+	int prog_fd = loadReuseportProg(map_fd, workers);
+	if (prog_fd < 0 ||
+		setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog_fd, sizeof(prog_fd)) < 0)
+	{
+		int err = errno;
+		if (prog_fd >= 0)
+			close(prog_fd);
+		close(map_fd);
+		return -err;
+	}
+
+	reuseMapFd = map_fd;
+	reuseProgFd = prog_fd;
+	return 0;
+}
+
+/* Turn the session into a byte stream, both ends have to agree. */
+int KcpEngine::client_stream(shared_ptr<KcpClient> client, bool enable) {
+	kcp_lock.lock();
+	client->kcp->stream = enable ? 1 : 0;
+	kcp_lock.unlock();
+	return 0;
+}
+
+int64_t KcpEngine::stream_write(shared_ptr<KcpClient> client, const char *buf, ssize_t size, bool flush) {
+	ssize_t left = size;
+	kcp_lock.lock();
+	/* ikcp_send refuses IKCP_WND_RCV fragments at once, split large writes */
+	ssize_t most = (ssize_t)client->kcp->mss * FILE_CHUNK_FRAGS;
+	int ret = 0;
+	while (left > 0)
+	{
+		ret = overHighWater(client) ? SEND_WOULD_BLOCK : ikcp_send(client->kcp, buf, min(left, most));
+		if (ret <= 0)
+			break;
+		buf += ret;
+		left -= ret;
+	}
+	kcp_lock.unlock();
+
+	if (flush)
+		flushClient(client);
+	if (left == size && left > 0)
+		return ret == SEND_WOULD_BLOCK ? SEND_WOULD_BLOCK : -1;
+	return size - left;
+}
+
+/* Move messages into the stream buffer until n bytes are unread, returns the unread size. */
+size_t KcpEngine::stream_fill(shared_ptr<KcpClient> client, size_t n) {
+	string &rx = client->streamRx;
+
+	client->owned = true;
+	while (rx.size() - client->streamRxPos < n)
+	{
+		kcp_lock.lock();
+		int size = ikcp_peeksize(client->kcp);
+		if (size <= 0)
+		{
+			kcp_lock.unlock();
+			break;
+		}
+		size_t tail = rx.size();
+		rx.resize(tail + size);
+		ikcp_recv(client->kcp, rx.data() + tail, size);
+		kcp_lock.unlock();
+	}
+	return rx.size() - client->streamRxPos;
+}
+
+/* Drop len bytes the caller copied from streamRx at streamRxPos. */
+void KcpEngine::stream_consume(shared_ptr<KcpClient> client, size_t len) {
+	string &rx = client->streamRx;
+
+	client->streamRxPos += len;
+	if (client->streamRxPos == rx.size())
+	{
+		rx.clear();
+		client->streamRxPos = 0;
+	} else if (client->streamRxPos > rx.size() / 2) {
+		rx.erase(0, client->streamRxPos);
+		client->streamRxPos = 0;
+	}
+}
+
+/*
+ * Read up to n bytes, returns whatever is available as soon as there is
+ * something, 0 on timeout. Message boundaries are not preserved.
+ */
+ssize_t KcpEngine::stream_read(shared_ptr<KcpClient> client, char *buf, size_t n, double timeout) {
+	auto deadline = chrono::steady_clock::now() +
+		chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout > 0 ? timeout : 0));
+	size_t avail;
+
+	while ((avail = stream_fill(client, n)) == 0 && timeout != 0 && !exit && !client->recvClosed)
+	{
+		if (!wait_readable(client, timeout < 0 ? nullopt : optional(deadline)))
+			break;
+	}
+
+	size_t len = min(n, avail);
+	memcpy(buf, client->streamRx.data() + client->streamRxPos, len);
+	stream_consume(client, len);
+	return len;
+}
+
+/*
+ * Stream a file region to the peer, one message per FILE_CHUNK_FRAGS
+ * segments. The region is mapped instead of read, so the payload is
+ * copied once, from the page cache into the segments, and pages are
+ * dropped from the mapping as soon as they were copied.
+ */
+int KcpEngine::send_file(shared_ptr<KcpClient> client, int fd, uint64_t offset, uint64_t length) {
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < offset)
+		return -1;
+	if (length == 0)
+		length = st.st_size - offset;
+	if (length == 0 || offset + length > (uint64_t)st.st_size)
+		return -1;
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	unique_ptr<FileSend> transfer = make_unique<FileSend>();
+	transfer->skew = offset % page;
+	transfer->mapLen = transfer->skew + length;
+	void *map = mmap(nullptr, transfer->mapLen, PROT_READ, MAP_SHARED, fd, offset - transfer->skew);
+	if (map == MAP_FAILED)
+		return -1;
+	transfer->map = (char *)map;
+	transfer->length = length;
+	madvise(map, transfer->mapLen, MADV_SEQUENTIAL);
+
+	kcp_lock.lock();
+	if (client->fileSend)
+	{
+		kcp_lock.unlock();
+		return -1;
+	}
+	client->fileSend = move(transfer);
+	kcp_lock.unlock();
+
+	client->fileSent = 0;
+	client->fileSendTotal = length;
+	client->fileError = 0;
+
+	pumpFile(client);
+	return 0;
+}
+
+/*
+ * Queue more of the file while fewer than two send windows are waiting,
+ * at most FILE_PUMP_CHUNKS messages per call. The pages of a message
+ * are faulted in before kcp_lock is taken, so the lock is only held for
+ * the copy into segments. One thread at a time pumps a transfer, and
+ * only that thread resets fileSend, so the mapping stays valid while
+ * the lock is dropped; a call that finds it busy leaves filePumpAgain.
+ */
+void KcpEngine::pumpFile(shared_ptr<KcpClient> client) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	bool queued = false;
+
+	client->filePumpAgain = true;
+	if (client->filePumping.exchange(true))
+		return;
+
+	do
+	{
+		client->filePumpAgain = false;
+		for (int i = 0; i < FILE_PUMP_CHUNKS; i++)
+		{
+			kcp_lock.lock();
+			FileSend *transfer = client->fileSend.get();
+			if (transfer == nullptr || ikcp_waitsnd(client->kcp) >= (int)client->kcp->snd_wnd * 2)
+			{
+				kcp_lock.unlock();
+				break;
+			}
+			uint64_t n = min((uint64_t)client->kcp->mss * FILE_CHUNK_FRAGS, transfer->length - transfer->sent);
+			const char *data = transfer->map + transfer->skew + transfer->sent;
+			kcp_lock.unlock();
+
+			for (uint64_t off = 0; off < n; off += page)
+				(void)*(volatile const char *)(data + off);
+			(void)*(volatile const char *)(data + n - 1);
+
+			kcp_lock.lock();
+			if (ikcp_send(client->kcp, data, n) < 0)
+				client->fileError = -2;
+			else
+			{
+				transfer->sent += n;
+				queued = true;
+			}
+
+			client->fileSent = transfer->sent;
+			bool done = transfer->sent == transfer->length || client->fileError;
+			if (done)
+				client->fileSend.reset();
+			kcp_lock.unlock();
+			if (done)
+				break;
+
+			/* the segments own a copy now, keep the resident set flat; only
+			 * this thread unmaps, so it can be done outside kcp_lock */
+			size_t copied = (transfer->skew + transfer->sent) & ~(page - 1);
+			if (copied > transfer->released)
+			{
+				madvise(transfer->map + transfer->released, copied - transfer->released, MADV_DONTNEED);
+				transfer->released = copied;
+			}
+		}
+		client->filePumping = false;
+	} while (client->filePumpAgain && !client->filePumping.exchange(true));
+
+	if (queued)
+		flushClient(client);
+}
+
+/* Write complete messages to the sink, returns true if any were consumed. */
+bool KcpEngine::sinkFile(shared_ptr<KcpClient> client) {
+	static thread_local vector<char> buffer;
+	bool consumed = false;
+
+	while (true)
+	{
+		kcp_lock.lock();
+		FileRecv *sink = client->fileRecv.get();
+		int size = sink ? ikcp_peeksize(client->kcp) : -1;
+		if (size <= 0)
+		{
+			kcp_lock.unlock();
+			break;
+		}
+		if (sink->written + size > sink->length)
+		{
+			/* a message runs past the file, it goes to the usual receive path */
+			client->fileError = -EMSGSIZE;
+			client->fileRecv.reset();
+			kcp_lock.unlock();
+			break;
+		}
+		if (buffer.size() < (size_t)size)
+			buffer.resize(size);
+		ikcp_recv(client->kcp, buffer.data(), size);
+		int fd = sink->fd;
+		uint64_t pos = sink->offset + sink->written;
+		sink->written += size;
+		bool done = sink->written == sink->length;
+		kcp_lock.unlock();
+
+		consumed = true;
+		for (ssize_t off = 0; off < size; )
+		{
+			ssize_t ret = pwrite(fd, buffer.data() + off, size - off, pos + off);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				client->fileError = -errno;
+				done = true;
+				break;
+			}
+			off += ret;
+		}
+		client->fileReceived += size;
+
+		if (done)
+		{
+			/* messages after the file go to the usual receive path again */
+			kcp_lock.lock();
+			client->fileRecv.reset();
+			kcp_lock.unlock();
+			break;
+		}
+	}
+	return consumed;
+}
+
+/*
+ * Write the next length bytes of messages from this client to fd at
+ * offset. Install it before the peer starts send_file. A message that
+ * runs past length ends it with error -EMSGSIZE and is received as usual.
+ */
+int KcpEngine::recv_file(shared_ptr<KcpClient> client, int fd, uint64_t length, uint64_t offset) {
+	if (length == 0)
+		return -1;
+	int sink_fd = dup(fd);
+	if (sink_fd < 0)
+		return -1;
+
+	unique_ptr<FileRecv> sink = make_unique<FileRecv>();
+	sink->fd = sink_fd;
+	sink->offset = offset;
+	sink->length = length;
+
+	kcp_lock.lock();
+	if (client->fileRecv)
+	{
+		kcp_lock.unlock();
+		return -1;
+	}
+	client->fileRecv = move(sink);
+	kcp_lock.unlock();
+
+	client->fileReceived = 0;
+	client->fileRecvTotal = length;
+	client->fileError = 0;
+
+	/* messages may already be waiting */
+	sinkFile(client);
+	return 0;
+}
+
+map<string, int64_t> KcpEngine::file_status(shared_ptr<KcpClient> client) {
+	kcp_lock.lock();
+	int64_t waitsnd = ikcp_waitsnd(client->kcp);
+	kcp_lock.unlock();
+
+	return {
+		{"sent", (int64_t)client->fileSent},
+		{"send_total", (int64_t)client->fileSendTotal},
+		{"unacked", waitsnd},
+		{"received", (int64_t)client->fileReceived},
+		{"recv_total", (int64_t)client->fileRecvTotal},
+		{"error", client->fileError},
+	};
+}
+
+static void putVarint(string &out, uint64_t value) {
+	while (value >= 0x80)
+	{
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+static bool getVarint(const string &in, size_t &pos, uint64_t &value) {
+	value = 0;
+	for (int shift = 0; pos < in.size() && shift < 64; shift += 7)
+	{
+		uint8_t byte = in[pos++];
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+const kcp_plugin_api KcpEngine::pluginApi = {
+	KCP_PLUGIN_ABI,
+	KcpEngine::pluginSend,
+	KcpEngine::pluginFlush,
+	KcpEngine::pluginPeer,
+};
+
+int KcpEngine::pluginSend(void *engine, void *session, const char *buf, int len) {
+	return ((KcpEngine *)engine)->send_buffer(((KcpClient *)session)->shared_from_this(), buf, len);
+}
+
+void KcpEngine::pluginFlush(void *engine, void *session) {
+	((KcpEngine *)engine)->flushClient(((KcpClient *)session)->shared_from_this());
+}
+
+void KcpEngine::pluginPeer(void *session, unsigned int *nip, unsigned short *nport) {
+	*nip = ((KcpClient *)session)->nip;
+	*nport = ((KcpClient *)session)->nport;
+}
+
+/*
+ * Hand complete messages to the plugin on the recv thread. A session's
+ * datagrams may arrive on several paths and the shm thread at once;
+ * only one of them runs the plugin, the others leave pluginAgain set
+ * and the running thread goes round once more before it lets go.
+ */
+void KcpEngine::pluginInput(shared_ptr<KcpClient> client) {
+	static thread_local vector<char> buffer;
+	const kcp_plugin *handler = plugin;
+
+	client->pluginAgain = true;
+	if (client->pluginBusy.exchange(true))
+		return;
+
+	do
+	{
+		client->pluginAgain = false;
+		if (handler && client->pluginWritable.exchange(false) && handler->abi >= 2 && handler->on_writable)
+			handler->on_writable(&pluginApi, this, client.get(), handler->ctx);
+
+		while (handler)
+		{
+			kcp_lock.lock();
+			int size = ikcp_peeksize(client->kcp);
+			if (size <= 0)
+			{
+				kcp_lock.unlock();
+				break;
+			}
+			if (buffer.size() < (size_t)size)
+				buffer.resize(size);
+			ikcp_recv(client->kcp, buffer.data(), size);
+			kcp_lock.unlock();
+			handler->on_message(&pluginApi, this, client.get(), buffer.data(), size, handler->ctx);
+		}
+		client->pluginBusy = false;
+	} while (client->pluginAgain && !client->pluginBusy.exchange(true));
+}
+
+/* Install a native handler, nullptr hands messages to the callbacks again. */
+void KcpEngine::set_plugin(const kcp_plugin *handler) {
+	if (handler && (handler->abi < KCP_PLUGIN_ABI_MIN || handler->abi > KCP_PLUGIN_ABI || handler->on_message == nullptr))
+		throw invalid_argument("plugin ABI mismatch.");
+	plugin = handler;
+}
+
+/* dlopen a plugin library and return its kcp_plugin, the library stays loaded. */
+const kcp_plugin *KcpEngine::load_plugin(const string &path, const string &symbol)
+{
+	void *lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (lib == nullptr)
+		throw runtime_error(string("dlopen fail: ") + dlerror());
+	kcp_plugin_entry entry = (kcp_plugin_entry)dlsym(lib, symbol.c_str());
+	if (entry == nullptr)
+		throw runtime_error(string("dlsym fail: ") + dlerror());
+	const kcp_plugin *handler = entry();
+	if (handler == nullptr || handler->abi < KCP_PLUGIN_ABI_MIN || handler->abi > KCP_PLUGIN_ABI)
+		throw runtime_error("plugin ABI mismatch.");
+	return handler;
+}
+
+/* Switch the engine to RPC framing, recv_pkg and the recv callback stop receiving. */
+void KcpEngine::rpc_enable() {
+	rpcMode = true;
+}
+
+void KcpEngine::rpc_register(uint32_t method, RpcHandler handler) {
+	rpc_enable();
+	lock_guard<mutex> guard(rpc_lock);
+	rpcHandlers[method] = handler;
+}
+
+/* Move complete messages off the recv thread, they are decoded by the dispatcher. */
+void KcpEngine::rpcInput(shared_ptr<KcpClient> client) {
+	while (true)
+	{
+		kcp_lock.lock();
+		int size = ikcp_peeksize(client->kcp);
+		if (size <= 0)
+		{
+			kcp_lock.unlock();
+			break;
+		}
+		CallbackEvent *event = new CallbackEvent{EVENT_RPC, client, nullptr};
+		event->data.resize(size);
+		ikcp_recv(client->kcp, event->data.data(), size);
+		kcp_lock.unlock();
+		events.push(event);
+	}
+}
+
+/*
+ * Queue a request or reply frame. A reply answers a call the peer is
+ * already waiting on, dropping it at the watermark would only leave the
+ * caller to time out, so replies are queued past it.
+ */
+int KcpEngine::rpcSend(shared_ptr<KcpClient> client, string &frame, const char *buf, ssize_t size, bool flush, bool reply) {
+	frame.append(buf, size);
+	if (frame.size() > INT32_MAX) return -1;
+	int ret;
+	if (reply)
+	{
+		kcp_lock.lock();
+		ret = ikcp_send(client->kcp, frame.data(), frame.size());
+		kcp_lock.unlock();
+	} else
+		ret = send_buffer(client, frame.data(), frame.size());
+	if (ret >= 0 && flush)
+		flushClient(client);
+	return ret;
+}
+
+void KcpEngine::rpcDispatch(shared_ptr<KcpClient> client, const string &msg) {
+	uint64_t call_id, method;
+	size_t pos = 1;
+
+	if (msg.empty() || !getVarint(msg, pos, call_id))
+		return;
+
+	if (msg[0] == RPC_REPLY)
+	{
+		if (pos >= msg.size())
+			return;
+		int status = (uint8_t)msg[pos++];
+		RpcDone done;
+		{
+			lock_guard<mutex> guard(rpc_lock);
+			auto it = rpcCalls.find(call_id);
+			if (it == rpcCalls.end() || it->second.client != client)
+				return;
+			done = move(it->second.done);
+			rpcCalls.erase(it);
+		}
+		done(this, call_id, status, msg.data() + pos, msg.size() - pos);
+		return;
+	}
+
+	if (msg[0] != RPC_REQUEST || !getVarint(msg, pos, method))
+		return;
+
+	RpcHandler handler;
+	{
+		lock_guard<mutex> guard(rpc_lock);
+		auto it = rpcHandlers.find(method);
+		if (it != rpcHandlers.end())
+			handler = it->second;
+	}
+	if (!handler)
+	{
+		rpc_reply(client, call_id, nullptr, 0, RPC_NO_METHOD, true);
+		return;
+	}
+
+	try {
+		handler(this, client, call_id, msg.data() + pos, msg.size() - pos);
+	} catch (exception &e) {
+		rpc_reply(client, call_id, e.what(), strlen(e.what()), RPC_HANDLER_ERROR, true);
+	}
+}
+
+/* Fail the calls still waiting on a session that timed out. */
+void KcpEngine::rpcFail(shared_ptr<KcpClient> client) {
+	vector<pair<uint64_t, RpcDone>> failed;
+
+	rpc_lock.lock();
+	for (auto it = rpcCalls.begin(); it != rpcCalls.end(); )
+	{
+		if (it->second.client != client)
+		{
+			++it;
+			continue;
+		}
+		failed.emplace_back(it->first, move(it->second.done));
+		it = rpcCalls.erase(it);
+	}
+	rpc_lock.unlock();
+
+	for (auto &call : failed)
+		call.second(this, call.first, RPC_SESSION_CLOSED, nullptr, 0);
+}
+
+/*
+ * Send a request, done runs on the dispatcher thread with the reply or
+ * RPC_SESSION_CLOSED. Returns the call id, or < 0 if the request could
+ * not be queued, in which case done is never called.
+ */
+int64_t KcpEngine::rpc_call(shared_ptr<KcpClient> client, uint32_t method, const char *buf, ssize_t size, RpcDone done, bool flush) {
+	rpc_enable();
+
+	uint64_t call_id = rpcNextId++;
+	string frame;
+	frame.reserve(size + 12);
+	frame.push_back(RPC_REQUEST);
+	putVarint(frame, call_id);
+	putVarint(frame, method);
+
+	rpc_lock.lock();
+	rpcCalls[call_id] = RpcCall{move(done), client};
+	rpc_lock.unlock();
+
+	int ret = rpcSend(client, frame, buf, size, flush, false);
+	if (ret < 0)
+	{
+		lock_guard<mutex> guard(rpc_lock);
+		rpcCalls.erase(call_id);
+		return ret;
+	}
+	return call_id;
+}
+
+int KcpEngine::rpc_reply(shared_ptr<KcpClient> client, uint64_t call_id, const char *buf, ssize_t size, int status, bool flush) {
+	string frame;
+	frame.reserve(size + 12);
+	frame.push_back(RPC_REPLY);
+	putVarint(frame, call_id);
+	frame.push_back((char)status);
+
+	return rpcSend(client, frame, buf, size, flush, true);
+}
+
+void KcpEngine::flushClient(shared_ptr<KcpClient> client) {
+	kcp_lock.lock();
+	ikcp_flush(client->kcp);
+	kcp_lock.unlock();
+	drainOutput();
+}
+
+void KcpEngine::flush(shared_ptr<KcpClient> client) {
+	flushClient(client);
+}
+
+int64_t KcpEngine::send_and_flush(shared_ptr<KcpClient> client, const char *buf, ssize_t size, bool track) {
+	int64_t ret = track ? send_tracked(client, buf, size) : send_buffer(client, buf, size);
+	if(ret < 0) return ret == SEND_WOULD_BLOCK ? ret : -1;
+	flushClient(client);
+	return ret;
+}
+
+void KcpEngine::flush_batch(const vector<shared_ptr<KcpClient>> &targets) {
+	if (targets.empty())
+		return;
+
+	OutputBatch batch;
+	outputBatch = &batch;
+	kcp_lock.lock();
+	for (auto &client : targets)
+		ikcp_flush(client->kcp);
+	kcp_lock.unlock();
+	outputBatch = nullptr;
+
+	transmitBatch(batch);
+	drainOutput();
+}
+
+int KcpEngine::create_group() {
+	lock_guard<mutex> guard(group_lock);
+	int gid = nextGroupId++;
+	groups[gid];
+	return gid;
+}
+
+void KcpEngine::remove_group(int gid) {
+	lock_guard<mutex> guard(group_lock);
+	groups.erase(gid);
+}
+
+int KcpEngine::group_add(int gid, shared_ptr<KcpClient> client) {
+	lock_guard<mutex> guard(group_lock);
+	auto it = groups.find(gid);
+	if (it == groups.end())
+		return -1;
+	for (auto &member : it->second)
+		if (member.lock() == client)
+			return 0;
+	it->second.push_back(client);
+	return 0;
+}
+
+int KcpEngine::group_remove(int gid, shared_ptr<KcpClient> client) {
+	lock_guard<mutex> guard(group_lock);
+	auto it = groups.find(gid);
+	if (it == groups.end())
+		return -1;
+	auto &members = it->second;
+	members.erase(remove_if(members.begin(), members.end(),
+		[&](const weak_ptr<KcpClient> &member) { return member.lock() == client; }), members.end());
+	return 0;
+}
+
+/*
+ * Fragment the payload once per distinct mss among the members and queue
+ * the same refcounted fragment bodies on each of them, so a broadcast
+ * costs one payload copy per mss plus a segment header per member. Stream
+ * mode members take the same fragments. Returns the number of members it
+ * was queued on. Members over their client_watermark are skipped like
+ * send_buffer would refuse them and reported writable once they drain.
+ */
+int KcpEngine::group_send(int gid, const char *buf, ssize_t size, bool flush) {
+	if (size > INT32_MAX) return -1;
+	vector<shared_ptr<KcpClient>> members;
+	{
+		lock_guard<mutex> guard(group_lock);
+		auto it = groups.find(gid);
+		if (it == groups.end())
+			return -1;
+		auto &list = it->second;
+		/* sessions cleaned up by updateLoop leave expired entries behind */
+		list.erase(remove_if(list.begin(), list.end(),
+			[](const weak_ptr<KcpClient> &member) { return member.expired(); }), list.end());
+		for (auto &member : list)
+			if (auto client = member.lock())
+				members.push_back(client);
+	}
+	if (members.empty())
+		return 0;
+
+	/* members almost always share one mss, a short list beats a map */
+	vector<IUINT32> mss;
+	kcp_lock.lock();
+	for (auto &client : members)
+		if (find(mss.begin(), mss.end(), client->kcp->mss) == mss.end())
+			mss.push_back(client->kcp->mss);
+	kcp_lock.unlock();
+
+	vector<ikcpmsg *> msgs;
+	for (IUINT32 m : mss)
+	{
+		ikcpmsg *msg = ikcp_msg_create(buf, size, m);
+		if (msg == NULL)
+		{
+			for (ikcpmsg *created : msgs)
+				ikcp_msg_release(created);
+			return -2;
+		}
+		msgs.push_back(msg);
+	}
+
+	vector<shared_ptr<KcpClient>> sent;
+	kcp_lock.lock();
+	for (auto &client : members)
+	{
+		if (overHighWater(client))
+			continue;
+		/* the largest fragments that fit, in case the mss changed meanwhile */
+		ikcpmsg *msg = nullptr;
+		for (ikcpmsg *m : msgs)
+			if (m->mss <= client->kcp->mss && (msg == nullptr || m->mss > msg->mss))
+				msg = m;
+		if (msg && ikcp_send_shared(client->kcp, msg) >= 0)
+			sent.push_back(client);
+	}
+	kcp_lock.unlock();
+	for (ikcpmsg *msg : msgs)
+		ikcp_msg_release(msg);
+
+	if (flush)
+		flush_batch(sent);
+	return sent.size();
+}
+
@@ -0,0 +1,804 @@
+#include "kcp_relay.h"
+
+#include <cstring>
+
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+static uint64_t nowMs()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool wouldBlock()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static void frameHeader(char *buf, char type, uint32_t id)
+{
+	buf[0] = type;
+	id = htonl(id);
+	memcpy(buf + 1, &id, sizeof(id));
+}
+
+KcpRelay::KcpRelay(int32_t time_out) : timeOut(time_out), pingMs(time_out * 1000 / 3)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0)
+		throw runtime_error("epoll create fail.");
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0)
+	{
+		close(epollFd);
+		throw runtime_error("eventfd create fail.");
+	}
+	watch(wakeFd, EPOLLIN, &wakeWatch);
+
+	rxBuffer.resize(RELAY_HEADER + RELAY_CHUNK);
+	txBuffer.resize(RELAY_HEADER + RELAY_CHUNK);
+}
+
+KcpRelay::~KcpRelay()
+{
+	stop();
+
+	for (RelayRoute &route : routes)
+		if (route.listenFd >= 0)
+			close(route.listenFd);
+	routes.clear();
+	close(wakeFd);
+	close(epollFd);
+}
+
+void KcpRelay::set_nodelay(int nodelay, int interval, int resend, int nc)
+{
+	this->nodelay = nodelay;
+	this->interval = interval;
+	this->resend = resend;
+	this->nc = nc;
+}
+
+void KcpRelay::set_wndsize(int sndwnd, int rcvwnd)
+{
+	sndWnd = sndwnd;
+	rcvWnd = rcvwnd;
+}
+
+int KcpRelay::set_watermark(int high, int low)
+{
+	if (high < 0 || low < 0 || (high > 0 && low >= high))
+		return -1;
+	highWater = high;
+	lowWater = low;
+	return 0;
+}
+
+int KcpRelay::listen_tcp(string local_ip, uint16_t local_port, string remote_ip, uint16_t remote_port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	int opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(local_ip.c_str());
+	addr.sin_port = htons(local_port);
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+
+	RelayRoute &route = routes.emplace_back();
+	route.watch = {RelayWatch::LISTEN, &route, nullptr};
+	route.engineWatch = {RelayWatch::ENGINE, &route, nullptr};
+	route.ingress = true;
+	route.listenFd = fd;
+	route.ip = remote_ip;
+	route.port = remote_port;
+	watch(fd, EPOLLIN, &route.watch);
+	return 0;
+}
+
+int KcpRelay::forward_tcp(string kcp_ip, uint16_t kcp_port, string target_ip, uint16_t target_port)
+{
+	unique_ptr<KcpEngine> engine;
+	try {
+		engine = make_unique<KcpEngine>(kcp_ip, kcp_port, timeOut);
+	} catch (exception &e) {
+		cout << "relay listen fail: " << e.what() << endl;
+		return -1;
+	}
+
+	RelayRoute &route = routes.emplace_back();
+	route.engineWatch = {RelayWatch::ENGINE, &route, nullptr};
+	route.ingress = false;
+	route.engine = move(engine);
+	route.ip = target_ip;
+	route.port = target_port;
+
+	/* admission runs on the recv thread before the first packet is input */
+	RelayRoute *r = &route;
+	route.engine->set_create_cb([this, r](KcpEngine *engine, shared_ptr<KcpClient> client) {
+		setupSession(engine, client);
+		handOff(true, r, client);
+		return true;
+	}, true);
+	route.engine->set_clean_cb([this, r](KcpEngine *, shared_ptr<KcpClient> client) {
+		handOff(false, r, client);
+	});
+	watch(route.engine->event_fd(), EPOLLIN, &route.engineWatch);
+	return 0;
+}
+
+void KcpRelay::start()
+{
+	if (relayThread)
+		return;
+
+	for (RelayRoute &route : routes)
+	{
+		if (!route.engine)
+			continue;
+		route.engine->set_conv(conv);
+		route.engine->start();
+	}
+	reapThread = new thread(&KcpRelay::reapLoop, this);
+	relayThread = new thread(&KcpRelay::relayLoop, this);
+}
+
+/* Join the threads and reset every tunnel still open. */
+void KcpRelay::stop()
+{
+	exit = true;
+	wake();
+	if (relayThread)
+	{
+		relayThread->join();
+		delete relayThread;
+		relayThread = nullptr;
+	}
+
+	while (!tunnels.empty())
+		closeTunnel(&tunnels.front(), true);
+	closedTunnels.clear();
+	sessions.clear();
+	sessionsActive = 0;
+	for (RelayRoute &route : routes)
+		route.session = nullptr;
+
+	reapCond.notify_all();
+	if (reapThread)
+	{
+		reapThread->join();
+		delete reapThread;
+		reapThread = nullptr;
+	}
+	retired.clear();
+
+	for (RelayRoute &route : routes)
+		if (route.engine)
+			route.engine->stop();
+}
+
+map<string, uint64_t> KcpRelay::stats()
+{
+	return {
+		{"sessions_active", sessionsActive},
+		{"tunnels_opened", tunnelsOpened},
+		{"tunnels_active", tunnelsActive},
+		{"tunnels_reset", tunnelsReset},
+		{"bytes_to_kcp", bytesToKcp},
+		{"bytes_to_tcp", bytesToTcp},
+	};
+}
+
+void KcpRelay::wake()
+{
+	uint64_t one = 1;
+	if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		cout << "eventfd write fail." << endl;
+}
+
+void KcpRelay::watch(int fd, uint32_t events, RelayWatch *w, int op)
+{
+	epoll_event ev = {};
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epollFd, op, fd, &ev) < 0)
+		cout << "relay epoll_ctl fail: " << strerror(errno) << endl;
+}
+
+void KcpRelay::handOff(bool open, RelayRoute *route, shared_ptr<KcpClient> client)
+{
+	handoff_lock.lock();
+	handoff.emplace_back(open, route, client);
+	handoff_lock.unlock();
+	wake();
+}
+
+void KcpRelay::takeHandoff()
+{
+	uint64_t count;
+	if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		cout << "eventfd read fail." << endl;
+
+	vector<tuple<bool, RelayRoute *, shared_ptr<KcpClient>>> items;
+	handoff_lock.lock();
+	items.swap(handoff);
+	handoff_lock.unlock();
+
+	for (auto &[open, route, client] : items)
+	{
+		if (open)
+			sessionInput(openSession(route, client));
+		else
+			closeSession(client.get());	/* the peer went silent for time_out */
+	}
+}
+
+void KcpRelay::setupSession(KcpEngine *engine, shared_ptr<KcpClient> client)
+{
+	engine->client_nodelay(client, nodelay, interval, resend, nc);
+	engine->client_wndsize(client, sndWnd, rcvWnd);
+	engine->client_watermark(client, highWater, lowWater);
+}
+
+RelaySession *KcpRelay::openSession(RelayRoute *route, shared_ptr<KcpClient> client)
+{
+	RelaySession &s = sessions[client.get()];
+	s.route = route;
+	s.engine = route->engine.get();
+	s.client = client;
+	s.lastSendMs = nowMs();
+	sessionsActive++;
+	return &s;
+}
+
+/*
+ * The session every accepted connection of an ingress route is opened on.
+ * A timed out one is replaced on a fresh engine, and so a fresh UDP port:
+ * the egress side keys sessions by peer address and may not have let the
+ * old one go yet.
+ */
+RelaySession *KcpRelay::ingressSession(RelayRoute *route)
+{
+	if (route->session)
+		return route->session;
+
+	unique_ptr<KcpEngine> engine;
+	try {
+		engine = make_unique<KcpEngine>("0.0.0.0", 0, timeOut);
+	} catch (exception &e) {
+		cout << "relay engine fail: " << e.what() << endl;
+		return nullptr;
+	}
+	engine->set_conv(conv);
+	engine->set_clean_cb([this, route](KcpEngine *, shared_ptr<KcpClient> client) {
+		handOff(false, route, client);
+	});
+	shared_ptr<KcpClient> client = engine->new_client(route->ip, route->port);
+	setupSession(engine.get(), client);
+	engine->start();
+	watch(engine->event_fd(), EPOLLIN, &route->engineWatch);
+	route->engine = move(engine);
+
+	route->session = openSession(route, client);
+	return route->session;
+}
+
+/* The session timed out, its tunnels go without a RST nobody would receive. */
+void KcpRelay::closeSession(KcpClient *client)
+{
+	auto it = sessions.find(client);
+	if (it == sessions.end())
+		return;
+	RelaySession *s = &it->second;
+
+	vector<RelayTunnel *> streams;
+	for (auto &[id, t] : s->streams)
+		streams.push_back(t);
+	for (RelayTunnel *t : streams)
+		closeTunnel(t, false);
+
+	RelayRoute *route = s->route;
+	if (route->ingress && route->session == s)
+	{
+		watch(route->engine->event_fd(), 0, &route->engineWatch, EPOLL_CTL_DEL);
+		reap_lock.lock();
+		retired.push_back(move(route->engine));
+		reap_lock.unlock();
+		reapCond.notify_one();
+		route->session = nullptr;
+	}
+	sessions.erase(it);
+	sessionsActive--;
+}
+
+RelayTunnel *KcpRelay::newTunnel(RelaySession *s, uint32_t id, int fd)
+{
+	RelayTunnel &t = tunnels.emplace_back();
+	t.self = prev(tunnels.end());
+	t.tcpWatch = {RelayWatch::TCP, s->route, &t};
+	t.session = s;
+	t.id = id;
+	t.tcpFd = fd;
+	s->streams[id] = &t;
+
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	watch(fd, 0, &t.tcpWatch);
+
+	tunnelsOpened++;
+	tunnelsActive++;
+	return &t;
+}
+
+void KcpRelay::acceptTcp(RelayRoute *route)
+{
+	while (true)
+	{
+		int fd = accept4(route->listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			break;
+
+		RelaySession *s = ingressSession(route);
+		if (s == nullptr)
+		{
+			close(fd);
+			continue;
+		}
+		uint32_t id = s->nextStream++;
+		if (s->nextStream == 0)
+			s->nextStream = 1;
+
+		/* the egress side connects to the target on OPEN */
+		RelayTunnel *t = newTunnel(s, id, fd);
+		if (sendControl(s, RELAY_OPEN, id) < 0)
+		{
+			closeTunnel(t, true);
+			continue;
+		}
+		s->engine->flush(s->client);
+		updateEvents(t);
+	}
+}
+
+void KcpRelay::openEgress(RelaySession *s, uint32_t id)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		cout << "relay socket fail: " << strerror(errno) << endl;
+		sendControl(s, RELAY_RST, id);
+		return;
+	}
+
+	RelayTunnel *t = newTunnel(s, id, fd);
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(s->route->ip.c_str());
+	addr.sin_port = htons(s->route->port);
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		if (errno != EINPROGRESS)
+		{
+			closeTunnel(t, true);
+			return;
+		}
+		t->connecting = true;
+	}
+	updateEvents(t);
+}
+
+void KcpRelay::engineReady(RelayRoute *route)
+{
+	uint64_t count;
+	KcpEngine *engine = route->engine.get();
+	if (engine == nullptr)
+		return;
+	if (read(engine->event_fd(), &count, sizeof(count)) < 0 && errno != EAGAIN)
+		cout << "eventfd read fail." << endl;
+
+	for (shared_ptr<KcpClient> &client : engine->writable_clients())
+	{
+		auto it = sessions.find(client.get());
+		if (it != sessions.end())
+			flushPending(&it->second);
+	}
+	for (shared_ptr<KcpClient> &client : engine->ready_clients())
+	{
+		/* not handed over yet, takeHandoff will pick the messages up */
+		auto it = sessions.find(client.get());
+		if (it != sessions.end())
+			sessionInput(&it->second);
+	}
+}
+
+/* Take every message out of KCP, a stream buffers what its socket does not take yet. */
+void KcpRelay::sessionInput(RelaySession *s)
+{
+	while (true)
+	{
+		int size = s->engine->peek_size(s->client);
+		if (size <= 0)
+			break;
+		if (rxBuffer.size() < (size_t)size)
+			rxBuffer.resize(size);
+		char *buf = rxBuffer.data();
+		if (s->engine->recv(s->client, buf, size) < 0)
+			break;
+		if (size < RELAY_HEADER)
+			continue;
+
+		uint32_t id;
+		memcpy(&id, buf + 1, sizeof(id));
+		frameInput(s, buf[0], ntohl(id), buf + RELAY_HEADER, size - RELAY_HEADER);
+	}
+	/* WINDOW and RST frames queued on the way */
+	s->engine->flush(s->client);
+}
+
+void KcpRelay::frameInput(RelaySession *s, char type, uint32_t id, const char *data, size_t len)
+{
+	auto it = s->streams.find(id);
+	RelayTunnel *t = it == s->streams.end() ? nullptr : it->second;
+
+	if (type == RELAY_PING)
+		return;
+	if (type == RELAY_OPEN)
+	{
+		if (!s->route->ingress && t == nullptr && id != 0)
+			openEgress(s, id);
+		return;
+	}
+	if (t == nullptr)
+	{
+		/* a stream closed or reset here, make the peer let it go too */
+		if (type == RELAY_DATA || type == RELAY_FIN)
+			sendControl(s, RELAY_RST, id);
+		return;
+	}
+
+	switch (type)
+	{
+	case RELAY_RST:
+		closeTunnel(t, false);
+		break;
+	case RELAY_FIN:
+		t->finRecv = true;
+		drainTcp(t);
+		break;
+	case RELAY_WINDOW:
+		if (len == sizeof(uint32_t))
+		{
+			uint32_t n;
+			memcpy(&n, data, sizeof(n));
+			t->sendCredit += ntohl(n);
+			updateEvents(t);
+		}
+		break;
+	case RELAY_DATA:
+		/* the peer wrote past the window it was given */
+		if (t->finRecv || t->toTcp.size() - t->toTcpPos + len > RELAY_STREAM_WINDOW)
+		{
+			closeTunnel(t, true);
+			break;
+		}
+		if (t->toTcpPos > t->toTcp.size() / 2)
+		{
+			t->toTcp.erase(0, t->toTcpPos);
+			t->toTcpPos = 0;
+		}
+		t->toTcp.append(data, len);
+		drainTcp(t);
+		break;
+	}
+}
+
+void KcpRelay::tcpReady(RelayTunnel *t, uint32_t events)
+{
+	if (events & EPOLLERR)
+	{
+		closeTunnel(t, true);
+		return;
+	}
+
+	if (t->connecting)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(t->tcpFd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err)
+		{
+			closeTunnel(t, true);
+			return;
+		}
+		t->connecting = false;
+		drainTcp(t);
+		return;
+	}
+
+	if ((events & EPOLLOUT) && !drainTcp(t))
+		return;
+	if ((events & (EPOLLIN | EPOLLHUP)) && !t->finSent && !tcpToKcp(t))
+		return;
+
+	/* both directions are shut down, only the FIN in flight is left */
+	if ((events & EPOLLHUP) && t->finSent)
+	{
+		if (!t->finRecv || t->toTcpPos < t->toTcp.size())
+		{
+			closeTunnel(t, true);
+			return;
+		}
+		watch(t->tcpFd, 0, &t->tcpWatch, EPOLL_CTL_DEL);
+		t->events = -1;
+	}
+}
+
+/*
+ * Queue one frame: 1 sent, 0 held back, -1 refused by kcp. While frames
+ * wait for the session to drain, new ones queue behind them to keep the
+ * order.
+ */
+int KcpRelay::sendFrame(RelaySession *s, const char *buf, size_t len)
+{
+	if (s->pending.empty())
+	{
+		int ret = s->engine->send_buffer(s->client, buf, len);
+		if (ret >= 0)
+		{
+			s->lastSendMs = nowMs();
+			return 1;
+		}
+		if (ret != SEND_WOULD_BLOCK)
+			return -1;
+	}
+	s->pending.emplace_back(buf, len);
+	return 0;
+}
+
+int KcpRelay::sendControl(RelaySession *s, char type, uint32_t id)
+{
+	char frame[RELAY_HEADER];
+	frameHeader(frame, type, id);
+	return sendFrame(s, frame, sizeof(frame));
+}
+
+/* The session fell to its low watermark, send what was held back and resume the reads. */
+void KcpRelay::flushPending(RelaySession *s)
+{
+	vector<uint32_t> refused;
+	while (!s->pending.empty())
+	{
+		string &frame = s->pending.front();
+		int ret = s->engine->send_buffer(s->client, frame.data(), frame.size());
+		if (ret == SEND_WOULD_BLOCK)
+			break;
+		if (ret < 0)
+		{
+			uint32_t id;
+			memcpy(&id, frame.data() + 1, sizeof(id));
+			refused.push_back(ntohl(id));
+		}
+		s->pending.pop_front();
+		s->lastSendMs = nowMs();
+	}
+
+	for (uint32_t id : refused)
+	{
+		auto it = s->streams.find(id);
+		if (it != s->streams.end())
+			closeTunnel(it->second, true);
+	}
+	vector<RelayTunnel *> streams;
+	for (auto &[id, t] : s->streams)
+		streams.push_back(t);
+	for (RelayTunnel *t : streams)
+		updateEvents(t);
+	s->engine->flush(s->client);
+}
+
+bool KcpRelay::tcpToKcp(RelayTunnel *t)
+{
+	RelaySession *s = t->session;
+	char *buf = txBuffer.data();
+
+	for (int i = 0; i < RELAY_BURST && !t->finSent && t->sendCredit > 0 && s->pending.empty(); i++)
+	{
+		ssize_t n = read(t->tcpFd, buf + RELAY_HEADER, min<size_t>(RELAY_CHUNK, t->sendCredit));
+		if (n < 0)
+		{
+			if (wouldBlock())
+				break;
+			closeTunnel(t, true);
+			return false;
+		}
+		frameHeader(buf, n ? RELAY_DATA : RELAY_FIN, t->id);
+		t->finSent = n == 0;
+		t->sendCredit -= n;
+		bytesToKcp += n;
+		if (sendFrame(s, buf, RELAY_HEADER + n) < 0)
+		{
+			closeTunnel(t, true);
+			return false;
+		}
+	}
+	s->engine->flush(s->client);
+	updateEvents(t);
+	return true;
+}
+
+/* Write what the socket takes: 1 all written, 0 socket full, -1 error. */
+int KcpRelay::flushTcp(RelayTunnel *t)
+{
+	while (t->toTcpPos < t->toTcp.size())
+	{
+		ssize_t n = send(t->tcpFd, t->toTcp.data() + t->toTcpPos, t->toTcp.size() - t->toTcpPos, MSG_NOSIGNAL);
+		if (n < 0)
+			return wouldBlock() ? 0 : -1;
+		t->toTcpPos += n;
+		t->consumed += n;
+		bytesToTcp += n;
+	}
+	t->toTcp.clear();
+	t->toTcpPos = 0;
+	if (t->finRecv)
+		shutdown(t->tcpFd, SHUT_WR);
+	return 1;
+}
+
+/* Write buffered DATA and reopen the stream's window, false once the tunnel is closed. */
+bool KcpRelay::drainTcp(RelayTunnel *t)
+{
+	if (t->connecting)
+		return true;
+
+	if (flushTcp(t) < 0)
+	{
+		closeTunnel(t, true);
+		return false;
+	}
+	if (t->consumed >= RELAY_STREAM_WINDOW / 2)
+	{
+		char frame[RELAY_HEADER + sizeof(uint32_t)];
+		uint32_t n = htonl(t->consumed);
+		frameHeader(frame, RELAY_WINDOW, t->id);
+		memcpy(frame + RELAY_HEADER, &n, sizeof(n));
+		if (sendFrame(t->session, frame, sizeof(frame)) < 0)
+		{
+			closeTunnel(t, true);
+			return false;
+		}
+		t->consumed = 0;
+		t->session->engine->flush(t->session->client);
+	}
+	updateEvents(t);
+	return true;
+}
+
+void KcpRelay::updateEvents(RelayTunnel *t)
+{
+	if (t->events < 0)
+		return;
+
+	uint32_t events = 0;
+	if (t->connecting || t->toTcpPos < t->toTcp.size())
+		events |= EPOLLOUT;
+	if (!t->connecting && !t->finSent && t->sendCredit > 0 && t->session->pending.empty())
+		events |= EPOLLIN;
+	if (events == t->events)
+		return;
+	t->events = events;
+	watch(t->tcpFd, events, &t->tcpWatch, EPOLL_CTL_MOD);
+}
+
+/* Keep sessions from timing out and retire tunnels whose FINs were both delivered. */
+void KcpRelay::tick()
+{
+	uint64_t now = nowMs();
+
+	for (auto it = tunnels.begin(); it != tunnels.end(); )
+	{
+		RelayTunnel *t = &*it++;
+		if (!t->connecting && t->finSent && t->finRecv && t->toTcpPos >= t->toTcp.size())
+			closeTunnel(t, false);
+	}
+	for (auto &[client, s] : sessions)
+	{
+		if (s.pending.empty() && now - s.lastSendMs >= pingMs && sendControl(&s, RELAY_PING, 0) > 0)
+			s.engine->flush(s.client);
+	}
+}
+
+void KcpRelay::closeTunnel(RelayTunnel *t, bool reset)
+{
+	if (t->closed)
+		return;
+	t->closed = true;
+
+	RelaySession *s = t->session;
+	if (reset)
+	{
+		if (sendControl(s, RELAY_RST, t->id) > 0)
+			s->engine->flush(s->client);
+		tunnelsReset++;
+	}
+
+	if (t->events >= 0)
+		watch(t->tcpFd, 0, &t->tcpWatch, EPOLL_CTL_DEL);
+	close(t->tcpFd);
+	s->streams.erase(t->id);
+
+	tunnelsActive--;
+	closedTunnels.splice(closedTunnels.end(), tunnels, t->self);
+}
+
+void KcpRelay::reapLoop()
+{
+	unique_lock<mutex> lock(reap_lock);
+	while (true)
+	{
+		reapCond.wait(lock, [this] { return exit || !retired.empty(); });
+		if (retired.empty())
+			break;
+		vector<unique_ptr<KcpEngine>> batch;
+		batch.swap(retired);
+		lock.unlock();
+		batch.clear();
+		lock.lock();
+	}
+}
+
+void KcpRelay::relayLoop()
+{
+	epoll_event events[64];
+	uint64_t lastTick = 0;
+
+	while (!exit)
+	{
+		int n = epoll_wait(epollFd, events, 64, 100);
+		for (int i = 0; i < n; i++)
+		{
+			RelayWatch *w = (RelayWatch *)events[i].data.ptr;
+			if (w->tunnel && w->tunnel->closed)
+				continue;
+
+			switch (w->kind)
+			{
+			case RelayWatch::LISTEN:
+				acceptTcp(w->route);
+				break;
+			case RelayWatch::ENGINE:
+				engineReady(w->route);
+				break;
+			case RelayWatch::TCP:
+				tcpReady(w->tunnel, events[i].events);
+				break;
+			case RelayWatch::WAKE:
+				takeHandoff();
+				break;
+			}
+		}
+
+		uint64_t now = nowMs();
+		if (now - lastTick >= 100)
+		{
+			tick();
+			lastTick = now;
+		}
+		closedTunnels.clear();
+	}
+}
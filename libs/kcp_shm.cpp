@@ -0,0 +1,309 @@
+#include "kcp_shm.h"
+
+#include <cstddef>
+#include <unordered_set>
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+#define SHM_MAGIC 0x6b637073
+
+/* first message of the connecting side, memfd and both eventfds ride along */
+struct ShmHello {
+	uint32_t magic;
+	uint32_t ringSize;
+	uint32_t nip;
+	uint16_t nport;
+};
+
+bool ShmRing::push(const char *buf, int len)
+{
+	uint64_t need = (sizeof(uint32_t) + len + 7) & ~(uint64_t)7;
+	uint64_t pos = tail.load(memory_order_relaxed);
+	uint32_t off = pos & (SHM_RING_SIZE - 1);
+	/* a datagram never wraps, the rest of the ring is skipped instead */
+	uint64_t pad = SHM_RING_SIZE - off < need ? SHM_RING_SIZE - off : 0;
+
+	if (pos + pad + need - head.load(memory_order_acquire) > SHM_RING_SIZE)
+		return false;
+
+	if (pad)
+	{
+		uint32_t marker = UINT32_MAX;
+		memcpy(data + off, &marker, sizeof(marker));
+		pos += pad;
+		off = 0;
+	}
+	uint32_t size = len;
+	memcpy(data + off, &size, sizeof(size));
+	memcpy(data + off + sizeof(size), buf, len);
+	tail.store(pos + need, memory_order_release);
+	return true;
+}
+
+ShmChannel::~ShmChannel()
+{
+	if (map)
+		munmap(map, 2 * sizeof(ShmRing));
+	if (sock >= 0)
+		close(sock);
+	if (txEvent >= 0)
+		close(txEvent);
+	if (rxEvent >= 0)
+		close(rxEvent);
+}
+
+bool ShmChannel::send(const char *buf, int len)
+{
+	tx_lock.lock();
+	bool ok = tx->push(buf, len);
+	tx_lock.unlock();
+
+	/* pairs with the fence between the consumer setting sleeping and its last look at tail */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (ok && tx->sleeping.load(memory_order_relaxed) && tx->sleeping.exchange(0))
+	{
+		uint64_t one = 1;
+		if (write(txEvent, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("shm wake");
+	}
+	return ok;
+}
+
+static socklen_t shmAddress(uint16_t port, sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* abstract, scoped to the network namespace like the UDP port it is named after */
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "pykcp.shm.%u", port);
+	return offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+int shmListen(uint16_t port)
+{
+	sockaddr_un addr;
+	socklen_t len = shmAddress(port, addr);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (bind(fd, (sockaddr *)&addr, len) < 0 || listen(fd, 64) < 0)
+	{
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+	return fd;
+}
+
+shared_ptr<ShmChannel> shmConnect(uint32_t peer_nip, uint16_t peer_nport, uint32_t local_nip, uint16_t local_nport)
+{
+	sockaddr_un addr;
+	socklen_t addr_len = shmAddress(ntohs(peer_nport), addr);
+
+	auto channel = make_shared<ShmChannel>();
+	channel->nip = peer_nip;
+	channel->nport = peer_nport;
+	channel->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (channel->sock < 0 || connect(channel->sock, (sockaddr *)&addr, addr_len) < 0)
+		return nullptr;
+
+	int memfd = memfd_create("pykcp.shm", MFD_CLOEXEC);
+	if (memfd < 0)
+		return nullptr;
+	if (ftruncate(memfd, 2 * sizeof(ShmRing)) < 0)
+	{
+		close(memfd);
+		return nullptr;
+	}
+	void *map = mmap(nullptr, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(memfd);
+		return nullptr;
+	}
+	channel->map = map;
+	ShmRing *rings = static_cast<ShmRing *>(map);
+	/* nobody waits yet, so the first datagram of each side rings the eventfd */
+	rings[0].sleeping = 1;
+	rings[1].sleeping = 1;
+	channel->tx = &rings[0];
+	channel->rx = &rings[1];
+	channel->txEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	channel->rxEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (channel->txEvent < 0 || channel->rxEvent < 0)
+	{
+		close(memfd);
+		return nullptr;
+	}
+
+	ShmHello hello = {SHM_MAGIC, SHM_RING_SIZE, local_nip, local_nport};
+	int fds[3] = {memfd, channel->txEvent, channel->rxEvent};
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	iovec iov = {&hello, sizeof(hello)};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent = sendmsg(channel->sock, &msg, MSG_NOSIGNAL);
+	close(memfd);
+	if (sent != sizeof(hello))
+		return nullptr;
+
+	/* the peer answers once the channel is registered, without it datagrams would go nowhere */
+	pollfd pfd = {channel->sock, POLLIN, 0};
+	char ack;
+	if (poll(&pfd, 1, SHM_ACCEPT_TIMEOUT_MS) <= 0 || recv(channel->sock, &ack, 1, 0) != 1)
+		return nullptr;
+	return channel;
+}
+
+/* true if process pid holds a UDP socket bound to nport on nip or on any address */
+static bool shmPeerBound(pid_t pid, uint32_t nip, uint16_t nport)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	DIR *dir = opendir(path);
+	if (dir == nullptr)
+		return false;
+
+	unordered_set<unsigned long> inodes;
+	while (dirent *entry = readdir(dir))
+	{
+		char link[320], target[64];
+		snprintf(link, sizeof(link), "%s/%s", path, entry->d_name);
+		ssize_t n = readlink(link, target, sizeof(target) - 1);
+		if (n <= 0)
+			continue;
+		target[n] = 0;
+		unsigned long inode;
+		if (sscanf(target, "socket:[%lu]", &inode) == 1)
+			inodes.insert(inode);
+	}
+	closedir(dir);
+
+	FILE *f = fopen("/proc/net/udp", "r");
+	if (f == nullptr)
+		return false;
+	char line[256];
+	bool bound = false;
+	/* the address is printed as the raw network order word, the port in host order */
+	while (!bound && fgets(line, sizeof(line), f))
+	{
+		unsigned int addr, port;
+		unsigned long inode;
+		if (sscanf(line, " %*d: %x:%x %*x:%*x %*x %*x:%*x %*x:%*x %*x %*u %*d %lu", &addr, &port, &inode) != 3)
+			continue;
+		bound = port == ntohs(nport) && (addr == nip || addr == INADDR_ANY) && inodes.count(inode);
+	}
+	fclose(f);
+	return bound;
+}
+
+shared_ptr<ShmChannel> shmAccept(int listen_fd)
+{
+	int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+
+	auto channel = make_shared<ShmChannel>();
+	channel->sock = fd;
+	return channel;
+}
+
+/*
+ * The hello names the UDP address the peer's datagrams are accounted to,
+ * so it is only taken from a process of our own user that really holds
+ * that port; anyone else could otherwise speak for a session of another
+ * local peer.
+ */
+bool shmHandshake(ShmChannel &channel)
+{
+	int fd = channel.sock;
+	ShmHello hello;
+	int fds[3] = {-1, -1, -1};
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	iovec iov = {&hello, sizeof(hello)};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fds, CMSG_DATA(cmsg), min(sizeof(fds), (size_t)(cmsg->cmsg_len - CMSG_LEN(0))));
+	/* ownership first, so every early return closes what arrived */
+	channel.txEvent = fds[2];
+	channel.rxEvent = fds[1];
+
+	struct stat st;
+	bool valid = len == sizeof(hello) && hello.magic == SHM_MAGIC && hello.ringSize == SHM_RING_SIZE &&
+		fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+		fstat(fds[0], &st) == 0 && (size_t)st.st_size == 2 * sizeof(ShmRing);
+	if (valid)
+	{
+		void *map = mmap(nullptr, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+		if (map != MAP_FAILED)
+			channel.map = map;
+	}
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (!channel.map)
+		return false;
+
+	ShmRing *rings = static_cast<ShmRing *>(channel.map);
+	channel.tx = &rings[1];
+	channel.rx = &rings[0];
+	channel.nip = hello.nip;
+	channel.nport = hello.nport;
+
+	ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != geteuid() ||
+		!shmPeerBound(cred.pid, hello.nip, hello.nport))
+		return false;
+
+	char ack = 1;
+	if (::send(fd, &ack, 1, MSG_NOSIGNAL) != 1)
+		return false;
+	return true;
+}
+
+bool shmLocalPeer(uint32_t nip, uint32_t &source)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	/* a connected UDP socket only asks the routing table, nothing is sent */
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = nip;
+	addr.sin_port = htons(9);
+	socklen_t len = sizeof(addr);
+	bool local = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+		getsockname(fd, (sockaddr *)&addr, &len) == 0 &&
+		((ntohl(nip) >> 24) == 127 || addr.sin_addr.s_addr == nip);
+	source = addr.sin_addr.s_addr;
+	close(fd);
+	return local;
+}
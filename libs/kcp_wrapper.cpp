@@ -1,28 +1,20 @@
-#include "ikcp.h"
+#include "kcp_engine.h"
 
-#include <map>
-#include <mutex>
-#include <atomic>
+#include <deque>
 #include <vector>
 #include <string>
-#include <thread>
-#include <chrono>
-#include <cstdint>
 #include <iostream>
-#include <semaphore>
+#include <algorithm>
 #include <functional>
-#include <shared_mutex>
-#include <condition_variable>
 
-#include <unistd.h>
 #include <signal.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
 
 #include <pybind11/stl.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/functional.h>
 
+#include "kcp_relay.h"
+
 namespace py = pybind11;
 using namespace std;
 
@@ -38,498 +30,563 @@ void module_init() {
 	signal(SIGINT, signal_handler);
 }
 
-class SpinLock {
+/*
+ * A contiguous read-only view of any buffer-protocol object (bytes,
+ * bytearray, memoryview, numpy arrays). Create and destroy it with the
+ * GIL held; the memory may be read without the GIL in between.
+ */
+class BufferView {
 public:
-	SpinLock() : flag(false) {}
-
-	void lock() {
-		while (flag.exchange(true, std::memory_order_acquire)) {
-#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
-			// x86 PAUSE instruction
-			asm volatile("pause" ::: "memory");
-#elif defined(__arm__) || defined(__aarch64__) || defined(__APPLE__)
-			// ARM, ARM64, and Apple M series WFE instruction
-			asm volatile("wfe" ::: "memory");
-#else
-			// Fallback to yield
-			std::this_thread::yield();
-#endif
-		}
-	}
-
-	void unlock() {
-		flag.store(false, std::memory_order_release);
-#if defined(__arm__) || defined(__aarch64__) || defined(__APPLE__)
-		// ARM, ARM64, and Apple M series SEV instruction
-		asm volatile("sev" ::: "memory");
-#endif
-	}
-
-private:
-	std::atomic<bool> flag;
-};
-
-class AtomicSemaphore {
-public:
-	AtomicSemaphore(int count = 0) : count(count) {}
-
-	void notify() {
-		count.fetch_add(1, memory_order_release);
-	}
-
-	void wait() {
-		while (true) {
-			int expected = count.load(memory_order_relaxed);
-			if (expected > 0 && count.compare_exchange_weak(expected, expected - 1, memory_order_acquire, memory_order_relaxed)) {
-				break;
-			}
-			this_thread::yield();
-		}
+	BufferView(py::handle obj) {
+		valid = PyObject_GetBuffer(obj.ptr(), &view, PyBUF_SIMPLE) == 0;
+		if (!valid)
+			PyErr_Clear();
 	}
 
-private:
-	atomic<int> count;
-};
-
-class SemaphoreProxy {
-public:
-	SemaphoreProxy(int count = 0, bool _atomicSem = false) : semaphore(count), atomicSemaphore(count) {
-		atomicSem = _atomicSem;
-	}
+	BufferView(const BufferView &) = delete;
+	BufferView &operator=(const BufferView &) = delete;
 
-	void notify() {
-		if (atomicSem)
-			atomicSemaphore.notify();
-		else
-			semaphore.release();
+	~BufferView() {
+		if (valid)
+			PyBuffer_Release(&view);
 	}
 
-	void wait() {
-		if (atomicSem)
-			atomicSemaphore.wait();
-		else
-			semaphore.acquire();
-	}
+	bool ok() const { return valid; }
+	const char *data() const { return (const char *)view.buf; }
+	ssize_t size() const { return view.len; }
 
 private:
-	bool atomicSem;
-	counting_semaphore<999> semaphore;
-	AtomicSemaphore atomicSemaphore;
+	Py_buffer view;
+	bool valid;
 };
 
-struct KcpClient;
-
-class PyKcp {
+/*
+ * Python binding of KcpEngine. Buffers are passed as views and the GIL is
+ * released around the engine calls; callbacks run on the dispatcher thread
+ * with the GIL taken once per batch.
+ */
+class PyKcp : public KcpEngine {
 public:
-	PyKcp(string ip, uint16_t port, int32_t time_out, bool atomicSem);
+	PyKcp(string ip, uint16_t port, int32_t time_out, bool atomicSem, bool reuse_port);
 	~PyKcp();
-	uint64_t getTimeMs();
-	uint32_t getBoottimeMs(shared_ptr<KcpClient> client);
-	shared_ptr<KcpClient> findOrNewClient(uint32_t nip, uint16_t nport);
-	static int kcpOutputCallback(const char *buf, int len, 
-		ikcpcb *kcp, void *user);
-	int kcpOutput(const char *buf, int len,
-		ikcpcb *kcp, void *user);
-	void updateLoop();
-
-	void set_create_cb(const function<bool(PyKcp *, shared_ptr<KcpClient> client)> callback);
+
+	void set_create_cb(const function<bool(PyKcp *, shared_ptr<KcpClient> client)> callback, bool admission);
 	void set_clean_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client)> callback);
 	void set_recv_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client, py::bytes)> callback);
-	void recvLoop();
-	shared_ptr<KcpClient> new_client(string ip, uint16_t hport);
-	int client_wndsize(shared_ptr<KcpClient> client, int sndwnd, int rcvsnd);
-	int client_nodelay(shared_ptr<KcpClient> client, int nodelay, int interval, int resend, int nc);
+	void set_acked_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client, vector<uint64_t>)> callback);
+	void set_writable_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client)> callback);
 	py::list recv_pkg();
-	int send_pkg(shared_ptr<KcpClient>  client, py::bytes bytes);
-	void flush(shared_ptr<KcpClient>  client);
-	int send_and_flush(shared_ptr<KcpClient>  client, py::bytes bytes);
+	py::list recv_nowait();
+	py::list recv_from(shared_ptr<KcpClient> client, int max_items, double timeout);
+	py::object recv_one(shared_ptr<KcpClient> client, double timeout);
+	int64_t send_pkg(shared_ptr<KcpClient> client, py::object data, bool track);
+	int64_t send_and_flush(shared_ptr<KcpClient> client, py::object data, bool track);
+	int send_keyed(shared_ptr<KcpClient> client, uint32_t key, py::object data, bool flush);
+	vector<int> send_many(py::iterable items, bool flush);
+	int group_send(int gid, py::object data, bool flush);
+	int64_t stream_write(shared_ptr<KcpClient> client, py::object data, bool flush);
+	py::bytes stream_read(shared_ptr<KcpClient> client, size_t n, double timeout);
+	void set_plugin(py::object capsule);
+	void rpc_enable();
+	void rpc_register(uint32_t method, py::function handler);
+	py::object call(shared_ptr<KcpClient> client, py::object data, uint32_t method, bool flush);
+	int rpc_reply(shared_ptr<KcpClient> client, uint64_t call_id, py::object data, int status, bool flush);
+
+protected:
+	void dispatchBatch(CallbackEvent *batch) override;
+	void deliverRecv(shared_ptr<KcpClient> client) override;
 
 private:
-	int sockfd = -1;
-	bool exit = false;
-	char recvBuffer[2048];
-	SemaphoreProxy semaphore;
-	uint64_t timeOutMs;
-	SpinLock kcp_lock;
-	
-	function<bool(PyKcp *, shared_ptr<KcpClient> client)> mOnCreate;
-	function<void(PyKcp *, shared_ptr<KcpClient> client)> mOnClean;
-	function<void(PyKcp *, shared_ptr<KcpClient> client, py::bytes)> mOnRecv;
-
-	map<uint64_t, shared_ptr<KcpClient>> clients;
-	shared_mutex client_lock;
-	thread *recvThread;
-	thread *updateThread;
-};
-
-struct KcpClient{
-	ikcpcb *kcp;
-	PyKcp *pyKcp;
-	uint32_t nextUpdate;
-	uint32_t nip;
-	uint16_t nport;
-	uint64_t startTimeMs;
-	uint64_t lastTimeMs;
-public:
-	~KcpClient()
-	{
-		if (kcp)
-		{
-			if(0)
-				cout << "ikcp_release" << endl;
-			ikcp_release(kcp);
-		}
-	}
+	py::bytes recvBytes(shared_ptr<KcpClient> client, ssize_t size);
+	void rpcComplete(uint64_t call_id, int status, const char *payload, size_t len);
+
+	function<void(PyKcp *, shared_ptr<KcpClient> client, py::bytes)> mOnRecvBytes;
+	py::object pluginCapsule;
+	/* futures of pending calls, only touched with the GIL held */
+	unordered_map<uint64_t, py::object> rpcFutures;
+	py::object futureType;
 };
 
-PyKcp::PyKcp(string ip, uint16_t port, int32_t time_out = 6, bool atomicSem = false) : semaphore(0, atomicSem), timeOutMs(time_out * 1000), kcp_lock()
+PyKcp::PyKcp(string ip, uint16_t port, int32_t time_out = 6, bool atomicSem = false, bool reuse_port = false) : KcpEngine(ip, port, time_out, atomicSem, reuse_port)
 {
-	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sockfd < 0)
-		throw runtime_error("socket create fail.");
-
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 100000;
-
-	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
-		throw runtime_error("Failed to set socket options.");
-
-	sockaddr_in bindAddr;
-	memset(&bindAddr, 0, sizeof(bindAddr));
-	bindAddr.sin_family = AF_INET;
-	bindAddr.sin_addr.s_addr = inet_addr(ip.c_str());
-	bindAddr.sin_port = htons(port);
-
-	if (bind(sockfd, (struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
-		close(sockfd);
-		throw invalid_argument("bind fail, invalid addr.");
-	}
-
-	recvThread = new thread(&PyKcp::recvLoop, this);
-	updateThread = new thread(&PyKcp::updateLoop, this);
+	start();
 }
 
 PyKcp::~PyKcp()
 {
-	exit = true;
-	if(recvThread)
-	{
-		recvThread->join();
-		delete recvThread;
-	}
-	if(updateThread)
-	{
-		updateThread->join();
-		delete updateThread;
-	}
-
-	if(sockfd != -1)
-		close(sockfd);
+	/* the dispatcher may be waiting for the GIL we hold */
+	unique_ptr<py::gil_scoped_release> release;
+	if (PyGILState_Check())
+		release = make_unique<py::gil_scoped_release>();
+	stop();
 }
 
-void PyKcp::set_create_cb(const function<bool(PyKcp *, shared_ptr<KcpClient> client)> callback)
+void PyKcp::set_create_cb(const function<bool(PyKcp *, shared_ptr<KcpClient> client)> callback, bool admission = false)
 {
-	mOnCreate = callback;
+	CreateCallback wrapped;
+	if (callback)
+		wrapped = [this, callback](KcpEngine *, shared_ptr<KcpClient> client) {
+			return callback(this, client);
+		};
+	KcpEngine::set_create_cb(wrapped, admission);
 }
 
 void PyKcp::set_clean_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client)> callback)
 {
-	mOnClean = callback;
+	ClientCallback wrapped;
+	if (callback)
+		wrapped = [this, callback](KcpEngine *, shared_ptr<KcpClient> client) {
+			callback(this, client);
+		};
+	KcpEngine::set_clean_cb(wrapped);
 }
 
 void PyKcp::set_recv_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client, py::bytes)> callback)
 {
-	mOnRecv = callback;
+	RecvCallback wrapped;
+	mOnRecvBytes = callback;
+	/* deliverRecv builds the bytes objects directly, this one only copies */
+	if (callback)
+		wrapped = [this](KcpEngine *, shared_ptr<KcpClient> client, const char *data, size_t len) {
+			mOnRecvBytes(this, client, py::bytes(data, len));
+		};
+	KcpEngine::set_recv_cb(wrapped);
 }
 
-uint64_t PyKcp::getTimeMs()
+void PyKcp::set_writable_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client)> callback)
 {
-	auto now = chrono::system_clock::now();
-	auto duration = now.time_since_epoch();
-	return chrono::duration_cast<chrono::milliseconds>(duration).count();
+	ClientCallback wrapped;
+	if (callback)
+		wrapped = [this, callback](KcpEngine *, shared_ptr<KcpClient> client) {
+			callback(this, client);
+		};
+	KcpEngine::set_writable_cb(wrapped);
 }
 
-uint32_t PyKcp::getBoottimeMs(shared_ptr<KcpClient> client)
+void PyKcp::set_acked_cb(const function<void(PyKcp *, shared_ptr<KcpClient> client, vector<uint64_t>)> callback)
 {
-	uint64_t time_ms = getTimeMs();
-	if(client->startTimeMs == 0)
-		client->startTimeMs = time_ms;
-
-	return time_ms - client->startTimeMs;
+	AckedCallback wrapped;
+	if (callback)
+		wrapped = [this, callback](KcpEngine *, shared_ptr<KcpClient> client, const vector<uint64_t> &ids) {
+			callback(this, client, ids);
+		};
+	KcpEngine::set_acked_cb(wrapped);
 }
 
-shared_ptr<KcpClient> PyKcp::findOrNewClient(uint32_t nip, uint16_t nport)
+/* Run Python callbacks in batches, one GIL acquisition per batch. */
+void PyKcp::dispatchBatch(CallbackEvent *batch)
 {
-	shared_ptr<KcpClient> client;
-
-	uint64_t client_id = (nip << 16) + nport;
-
-	client_lock.lock_shared();
-	bool empty = clients.find(client_id) == clients.end();
-	client_lock.unlock_shared();
-	if (empty)
+	py::gil_scoped_acquire acquire;
+	while (batch)
 	{
-		client = make_shared<KcpClient>();
-		client->pyKcp = this;
-		client->nip = nip;
-		client->nport = nport;
-
-		client->kcp = ikcp_create(0x55, client.get());
-		ikcp_wndsize(client->kcp, 64, 64);
-		/* fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
-		*  nodelay: 0:disable(default), 1:enable
-		*  interval: internal update timer interval in millisec, default is 100ms
-		*  resend: 0:disable fast resend(default), 1:enable fast resend
-		*  nc: 0:normal congestion control(default), 1:disable congestion control
-		*/
-		ikcp_nodelay(client->kcp, 1, 20, 1, 1);
-		/* extreme settings */
-		client->kcp->rx_minrto = 10;
-
-		if (mOnCreate)
-		{
-			py::gil_scoped_acquire acquire;
-			if(mOnCreate(this, client) == false)
-				return nullptr;
+		CallbackEvent *event = batch;
+		batch = batch->next;
+		try {
+			dispatchEvent(event);
+		} catch (py::error_already_set &e) {
+			e.restore();
+			PyErr_Print();
+		} catch (exception &e) {
+			/* a cast_error from a callback result or a failed recvBytes must not end the dispatcher */
+			cout << "callback fail: " << e.what() << endl;
 		}
-
-		ikcp_setoutput(client->kcp, kcpOutputCallback);
-		/* Ensure that flush can be invoked successfully immediately. */
-		ikcp_update(client->kcp, getBoottimeMs(client));
-		client_lock.lock();
-		clients[client_id] = client;
-		client_lock.unlock();
-	} else {
-		client_lock.lock_shared();
-		client = clients[client_id];
-		client_lock.unlock_shared();
+		releaseEvent(event);
 	}
-
-	/* update time */
-	client->lastTimeMs = getTimeMs();
-
-	return client;
-}
-
-shared_ptr<KcpClient> PyKcp::new_client(string ip, uint16_t hport)
-{
-	return findOrNewClient(inet_addr(ip.c_str()), htons(hport));
-}
-
-int PyKcp::client_wndsize(shared_ptr<KcpClient> client, int sndwnd, int rcvsnd)
-{
-	return ikcp_wndsize(client->kcp, sndwnd, rcvsnd);
 }
 
-int PyKcp::client_nodelay(shared_ptr<KcpClient> client, int nodelay, int interval, int resend, int nc)
+void PyKcp::deliverRecv(shared_ptr<KcpClient> client)
 {
-	return ikcp_nodelay(client->kcp, nodelay, interval, resend, nc);
-}
+	ssize_t size;
 
-int PyKcp::kcpOutputCallback(const char *buf, int len, 
-	ikcpcb *kcp, void *user)
-{
-	KcpClient* client = static_cast<KcpClient*>(user);
-	return client->pyKcp->kcpOutput(buf, len, kcp, user);
+	while (mOnRecvBytes && (size = peek_size(client)) > 0)
+		mOnRecvBytes(this, client, recvBytes(client, size));
 }
 
-int PyKcp::kcpOutput(const char *buf, int len,
-	ikcpcb *kcp, void *user)
+/*
+ * Merge the fragments of the next message straight into a new bytes
+ * object, so the segments are copied once and nothing else is allocated.
+ * The caller holds the GIL and has seen peek_size() return size.
+ */
+py::bytes PyKcp::recvBytes(shared_ptr<KcpClient> client, ssize_t size)
 {
-	sockaddr_in clientAddr;
-	KcpClient* client = static_cast<KcpClient*>(user);
+	PyObject *obj = PyBytes_FromStringAndSize(NULL, size);
+	if (obj == NULL)
+		throw py::error_already_set();
 
-	memset(&clientAddr, 0, sizeof(clientAddr));
-	clientAddr.sin_family = AF_INET;
-	clientAddr.sin_addr.s_addr = client->nip;
-	clientAddr.sin_port = client->nport;
+	ssize_t size_r = recv(client, PyBytes_AS_STRING(obj), size);
+	if(size != size_r)
+	{
+		Py_DECREF(obj);
+		throw runtime_error("ikcp_peeksize != ikcp_recv.");
+	}
 
-	ssize_t bytes_sent = sendto(sockfd, buf, len, 0,
-			(struct sockaddr*)&clientAddr, sizeof(clientAddr));
-	return bytes_sent;
+	return py::reinterpret_steal<py::bytes>(obj);
 }
 
-void PyKcp::recvLoop()
+/* Non-blocking recv_pkg: every complete message of every session. */
+py::list PyKcp::recv_nowait()
 {
-	ssize_t recv_len;
-	sockaddr_in client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	while(!exit)
+	py::list bytes_list;
+	ssize_t size;
+
+	for (auto &client : ready_clients())
 	{
-		recv_len = recvfrom(sockfd, recvBuffer, sizeof(recvBuffer), 0, (struct sockaddr*)&client_addr, &client_addr_len);
-		if (recv_len < 0)
-			continue;
-
-		shared_ptr<KcpClient> client = findOrNewClient(client_addr.sin_addr.s_addr, client_addr.sin_port);
-		if (client == nullptr)
-			continue;
-
-		kcp_lock.lock();
-		ikcp_input(client->kcp, recvBuffer, recv_len);
-		ssize_t size = ikcp_peeksize(client->kcp);
-		kcp_lock.unlock();
-		if(size > 0)
-		{
-			if (mOnRecv)
-			{
-				char *buf = new char[size];
-				kcp_lock.lock();
-				ssize_t size_r = ikcp_recv(client->kcp, buf, size);
-				kcp_lock.unlock();
-				if(size != size_r)
-					throw runtime_error("ikcp_peeksize != ikcp_recv.");
-
-				py::gil_scoped_acquire acquire;
-				mOnRecv(this, client, py::bytes(buf, size));
-			} else
-				semaphore.notify();
-		}
+		while ((size = peek_size(client)) > 0)
+			bytes_list.append(py::make_tuple(client, recvBytes(client, size)));
 	}
+
+	return bytes_list;
 }
 
-void PyKcp::updateLoop()
+/*
+ * Receive up to max_items messages (0 for all ready) of one session,
+ * waiting at most timeout seconds (negative waits forever). The first
+ * call makes the session owned: recv_pkg, recv_nowait and the eventfd
+ * skip it and only its own waiters are woken. A closed session returns
+ * what was left, then an empty list.
+ */
+py::list PyKcp::recv_from(shared_ptr<KcpClient> client, int max_items, double timeout)
 {
-	uint64_t now_ms;
-	uint32_t boot_ms;
-	uint32_t min_sleep;
-	vector<int> clear_clients;
+	py::list bytes_list;
+	ssize_t size;
+	auto deadline = chrono::steady_clock::now() +
+		chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout > 0 ? timeout : 0));
 
-	while(!exit)
+	client->owned = true;
+	while (true)
 	{
-		min_sleep = 50;
-		now_ms = getTimeMs();
-		client_lock.lock_shared();
-		for (auto it = clients.begin(); it != clients.end(); ++it) {
-			shared_ptr<KcpClient> client = it->second;
-			boot_ms = getBoottimeMs(client);
-
-			if (now_ms - client->lastTimeMs > timeOutMs)
-			{
-				if (mOnClean)
-				{
-					py::gil_scoped_acquire acquire;
-					mOnClean(this, client);
-				}
-
-				clear_clients.push_back(it->first);
-				if(1)
-					cout << "client timeout. key:" << it->first << " clear_clients size:" << clear_clients.size() << endl;
-				continue;
-			}
-
-			if(client->nextUpdate == 0)
-			{
-				kcp_lock.lock();
-				client->nextUpdate = ikcp_check(client->kcp, boot_ms);
-				kcp_lock.unlock();
-				if(client->nextUpdate - boot_ms < min_sleep)
-					min_sleep = client->nextUpdate - boot_ms;
-			}
-
-			if(client->nextUpdate <= boot_ms)
-			{
-				kcp_lock.lock();
-				ikcp_update(client->kcp, boot_ms);
-				kcp_lock.unlock();
-				client->nextUpdate = 0;
-			}
+		while (max_items <= 0 || (int)bytes_list.size() < max_items)
+		{
+			size = peek_size(client);
+			if (size <= 0)
+				break;
+			bytes_list.append(recvBytes(client, size));
 		}
-		client_lock.unlock_shared();
+		if (bytes_list.size() > 0 || timeout == 0 || stopping() || client->recvClosed)
+			break;
 
-		for (int value : clear_clients) {
-			client_lock.lock();
-			clients.erase(value);
-			client_lock.unlock();
+		bool ready;
+		{
+			/* release GIL lock to sleep */
+			py::gil_scoped_release release;
+			ready = wait_readable(client, timeout < 0 ? nullopt : optional(deadline));
 		}
-		clear_clients.clear();
-
-		this_thread::sleep_for(chrono::milliseconds(min_sleep));
+		if (!ready)
+			break;
 	}
+
+	return bytes_list;
+}
+
+py::object PyKcp::recv_one(shared_ptr<KcpClient> client, double timeout)
+{
+	py::list bytes_list = recv_from(client, 1, timeout);
+	if (bytes_list.size() == 0)
+		return py::none();
+	return bytes_list[0];
 }
 
 py::list PyKcp::recv_pkg() {
 	py::list bytes_list;
 	ssize_t size;
 
-	while(bytes_list.size() == 0 && !mOnRecv)
+	while(bytes_list.size() == 0 && !hasRecvCallback())
 	{
-		client_lock.lock_shared();
-		for (const auto& pair : clients) {
-			shared_ptr<KcpClient> client = pair.second;
-			kcp_lock.lock();
-			size = ikcp_peeksize(client->kcp);
-			kcp_lock.unlock();
+		for (auto &client : ready_clients())
+		{
+			size = peek_size(client);
 			if(size <= 0)
 				continue;
 
-			char *buf = new char[size];
-			kcp_lock.lock();
-			ssize_t size_r = ikcp_recv(client->kcp, buf, size);
-			kcp_lock.unlock();
-			if(size != size_r)
-				throw runtime_error("ikcp_peeksize != ikcp_recv.");
-
-			bytes_list.append(py::make_tuple(client, py::bytes(buf, size)));
+			bytes_list.append(py::make_tuple(client, recvBytes(client, size)));
 		}
-		client_lock.unlock_shared();
 
 		if(bytes_list.size() == 0)
 		{
 			/* release GIL lock to sleep */
 			py::gil_scoped_release release;
-			semaphore.wait();
-			py::gil_scoped_acquire acquire;
+			wait_any();
 		}
 	}
 
 	return bytes_list;
 }
 
-int PyKcp::send_pkg(shared_ptr<KcpClient> client, py::bytes bytes) {
-	char *buf;
-	Py_ssize_t size;
-	if (!PyBytes_Check(bytes.ptr())) return -1;
-	if (PyBytes_AsStringAndSize(bytes.ptr(), &buf, &size) == -1) return -1;
-	kcp_lock.lock();
-	int ret = ikcp_send(client->kcp, buf, size);
-	kcp_lock.unlock();
-	return ret;
+int64_t PyKcp::send_pkg(shared_ptr<KcpClient> client, py::object data, bool track = false) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	/* ikcp_send copies the payload into segments, no need for the GIL */
+	py::gil_scoped_release release;
+	if (track)
+		return send_tracked(client, view.data(), view.size());
+	return send_buffer(client, view.data(), view.size());
+}
+
+int64_t PyKcp::send_and_flush(shared_ptr<KcpClient> client, py::object data, bool track = false) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	py::gil_scoped_release release;
+	return KcpEngine::send_and_flush(client, view.data(), view.size(), track);
+}
+
+int PyKcp::send_keyed(shared_ptr<KcpClient> client, uint32_t key, py::object data, bool flush = false) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	py::gil_scoped_release release;
+	return KcpEngine::send_keyed(client, key, view.data(), view.size(), flush);
+}
+
+vector<int> PyKcp::send_many(py::iterable items, bool flush) {
+	vector<shared_ptr<KcpClient>> targets;
+	deque<BufferView> views;
+	vector<int> results;
+
+	for (py::handle item : items) {
+		py::tuple pair = py::cast<py::tuple>(item);
+		if (pair.size() != 2)
+			throw invalid_argument("send_many expects (client, buffer) pairs.");
+		targets.push_back(pair[0].cast<shared_ptr<KcpClient>>());
+		views.emplace_back(pair[1]);
+	}
+
+	py::gil_scoped_release release;
+	vector<shared_ptr<KcpClient>> touched;
+	results.reserve(targets.size());
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		int ret = views[i].ok() ? send_buffer(targets[i], views[i].data(), views[i].size()) : -1;
+		results.push_back(ret);
+		if (ret >= 0 && find(touched.begin(), touched.end(), targets[i]) == touched.end())
+			touched.push_back(targets[i]);
+	}
+
+	if (flush)
+		flush_batch(touched);
+
+	return results;
+}
+
+int PyKcp::group_send(int gid, py::object data, bool flush) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	py::gil_scoped_release release;
+	return KcpEngine::group_send(gid, view.data(), view.size(), flush);
+}
+
+int64_t PyKcp::stream_write(shared_ptr<KcpClient> client, py::object data, bool flush = false) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	py::gil_scoped_release release;
+	return KcpEngine::stream_write(client, view.data(), view.size(), flush);
+}
+
+/*
+ * Read up to n bytes, returns whatever is available as soon as there is
+ * something, b"" on timeout. Message boundaries are not preserved.
+ */
+py::bytes PyKcp::stream_read(shared_ptr<KcpClient> client, size_t n, double timeout = -1) {
+	auto deadline = chrono::steady_clock::now() +
+		chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout > 0 ? timeout : 0));
+	size_t avail;
+
+	while ((avail = stream_fill(client, n)) == 0 && timeout != 0 && !stopping() && !client->recvClosed)
+	{
+		py::gil_scoped_release release;
+		if (!wait_readable(client, timeout < 0 ? nullopt : optional(deadline)))
+			break;
+	}
+
+	size_t len = min(n, avail);
+	py::bytes out(client->streamRx.data() + client->streamRxPos, len);
+	stream_consume(client, len);
+	return out;
+}
+
+/* Install a plugin capsule, None removes it and messages go to Python again. */
+void PyKcp::set_plugin(py::object capsule) {
+	if (capsule.is_none())
+	{
+		KcpEngine::set_plugin(nullptr);
+		pluginCapsule = py::none();
+		return;
+	}
+
+	PyObject *obj = capsule.ptr();
+	if (!PyCapsule_IsValid(obj, KCP_PLUGIN_CAPSULE))
+		throw invalid_argument("set_plugin expects an " KCP_PLUGIN_CAPSULE " capsule.");
+	const kcp_plugin *handler = (const kcp_plugin *)PyCapsule_GetPointer(obj, KCP_PLUGIN_CAPSULE);
+	KcpEngine::set_plugin(handler);
+	pluginCapsule = capsule;
+}
+
+/* Wrap the kcp_plugin of a library in a capsule, the library stays loaded. */
+static py::capsule load_plugin(string path, string symbol)
+{
+	return py::capsule((void *)KcpEngine::load_plugin(path, symbol), KCP_PLUGIN_CAPSULE);
 }
 
-void PyKcp::flush(shared_ptr<KcpClient> client) {
-	kcp_lock.lock();
-	ikcp_flush(client->kcp);
-	kcp_lock.unlock();
+void PyKcp::rpc_enable() {
+	if (!futureType)
+		futureType = py::module_::import("concurrent.futures").attr("Future");
+	KcpEngine::rpc_enable();
 }
 
-int PyKcp::send_and_flush(shared_ptr<KcpClient> client, py::bytes bytes) {
-	int ret = send_pkg(client, bytes);
-	if(ret < 0) return -1;
-	flush(client);
-	return ret;
+void PyKcp::rpc_register(uint32_t method, py::function handler) {
+	rpc_enable();
+	/* a handler returning None replies later through rpc_reply */
+	KcpEngine::rpc_register(method, [this, handler](KcpEngine *, shared_ptr<KcpClient> client,
+		uint64_t call_id, const char *payload, size_t len) {
+		py::object result = handler(this, client, call_id, py::bytes(payload, len));
+		if (!result.is_none())
+			rpc_reply(client, call_id, result, RPC_OK, true);
+	});
+}
+
+/* Resolve the future of a call, runs on the dispatcher thread with the GIL. */
+void PyKcp::rpcComplete(uint64_t call_id, int status, const char *payload, size_t len) {
+	auto it = rpcFutures.find(call_id);
+	if (it == rpcFutures.end())
+		return;
+	py::object future = it->second;
+	rpcFutures.erase(it);
+	if (future.attr("done")().cast<bool>())
+		return;
+
+	py::module_ builtins = py::module_::import("builtins");
+	if (status == RPC_OK)
+		future.attr("set_result")(py::bytes(payload, len));
+	else if (status == RPC_SESSION_CLOSED)
+		future.attr("set_exception")(builtins.attr("ConnectionError")("rpc session closed"));
+	else
+		future.attr("set_exception")(builtins.attr("RuntimeError")(
+			"rpc failed with status " + to_string(status), py::bytes(payload, len)));
+}
+
+py::object PyKcp::call(shared_ptr<KcpClient> client, py::object data, uint32_t method = 0, bool flush = true) {
+	BufferView view(data);
+	if (!view.ok())
+		throw invalid_argument("call expects a contiguous buffer.");
+	rpc_enable();
+
+	/*
+	 * The GIL is kept until the future is recorded, the dispatcher needs
+	 * it to complete the call, so a fast reply cannot miss its future.
+	 */
+	py::object future = futureType();
+	int64_t call_id = KcpEngine::rpc_call(client, method, view.data(), view.size(),
+		[this](KcpEngine *, uint64_t id, int status, const char *payload, size_t len) {
+			rpcComplete(id, status, payload, len);
+		}, flush);
+	if (call_id < 0)
+		future.attr("set_exception")(py::module_::import("builtins").attr("ConnectionError")(
+			"rpc send failed"));
+	else
+		rpcFutures[call_id] = future;
+	return future;
+}
+
+int PyKcp::rpc_reply(shared_ptr<KcpClient> client, uint64_t call_id, py::object data, int status = RPC_OK, bool flush = true) {
+	BufferView view(data);
+	if (!view.ok()) return -1;
+
+	py::gil_scoped_release release;
+	return KcpEngine::rpc_reply(client, call_id, view.data(), view.size(), status, flush);
 }
 
-PYBIND11_MODULE(ikcp, m) {
+PYBIND11_MODULE(_ikcp, m) {
 	module_init();
 
 	py::class_<KcpClient, shared_ptr<KcpClient>>(m, "KcpClient")
 		.def_readwrite("kcp", &KcpClient::kcp)
-		.def_readwrite("pyKcp", &KcpClient::pyKcp)
+		/* read-write as before the engine split, assigning moves the session's output to another PyKcp */
+		.def_property("pyKcp", [](KcpClient &client) {
+			return static_cast<PyKcp *>(client.engine);
+		}, [](KcpClient &client, PyKcp *pykcp) {
+			if (pykcp == nullptr)
+				throw invalid_argument("pyKcp can not be None.");
+			client.engine = pykcp;
+		}, py::return_value_policy::reference)
 		.def_readwrite("nextUpdate", &KcpClient::nextUpdate)
 		.def_readwrite("nip", &KcpClient::nip)
-		.def_readwrite("nport", &KcpClient::nport);
+		.def_readwrite("nport", &KcpClient::nport)
+		.def("recv", [](shared_ptr<KcpClient> client, double timeout) {
+			return static_cast<PyKcp *>(client->engine)->recv_one(client, timeout);
+		}, "Receive one message of this client, None on timeout or once the session is closed.", py::arg("timeout") = -1);
 
 	py::class_<PyKcp>(m, "PyKcp")
-		.def(py::init<string, uint16_t, uint32_t, bool>(), py::arg("ip"), py::arg("port"), py::arg("timeout") = 6, py::arg("atomicSem") = false)
+		.def(py::init<string, uint16_t, uint32_t, bool, bool>(), py::arg("ip"), py::arg("port"), py::arg("timeout") = 6, py::arg("atomicSem") = false, py::arg("reuseport") = false)
+		.def("set_plugin", &PyKcp::set_plugin, "Handle every message with a native plugin capsule on the receive thread, None removes it.")
+		.def("join_reuseport", &PyKcp::join_reuseport, "Own slot worker of a reuseport group of workers processes, peers are steered by an SK_REUSEPORT program. Returns 0 or -errno, -EINVAL if the map pinned at pin_path was made for another number of workers.", py::arg("worker"), py::arg("workers"), py::arg("pin_path") = "")
 		.def("new_client", &PyKcp::new_client, "Create a client.")
 		.def("client_wndsize", &PyKcp::client_wndsize, "Change kcp window size.")
 		.def("client_nodelay", &PyKcp::client_nodelay, "Change kcp nodelay params.")
-		.def("set_create_cb", &PyKcp::set_create_cb, "Set a callback function that is called when the client is created.")
+		.def("set_create_cb", &PyKcp::set_create_cb, "Set a callback function that is called when the client is created. With admission=True it runs inline and returning False rejects the client, otherwise it runs on the dispatcher thread and returning False drops the client. Datagrams of a refused peer are dropped for a second without asking again.", py::arg("callback"), py::arg("admission") = false)
 		.def("set_clean_cb", &PyKcp::set_clean_cb, "Set a callback function that is called when the client is cleaned up.")
 		.def("set_recv_cb", &PyKcp::set_recv_cb, "Set a callback function for data reception. The recv_pkg will become invalid.")
+		.def("set_acked_cb", &PyKcp::set_acked_cb, "Set a callback(pykcp, client, ids) for tracked messages the peer has acknowledged.")
 		.def("recv_pkg", &PyKcp::recv_pkg, "Receive data.")
-		.def("send_pkg", &PyKcp::send_pkg, "Send data.")
-		.def("flush", &PyKcp::flush, "The same as kcp flush.")
-		.def("send_and_flush", &PyKcp::send_and_flush, "Send and flush.");
+		.def("send_pkg", &PyKcp::send_pkg, "Send data from bytes or any contiguous buffer. With track=True returns a message id reported by acked() once delivered.", py::arg("client"), py::arg("data"), py::arg("track") = false)
+		.def("flush", &PyKcp::flush, "The same as kcp flush.", py::call_guard<py::gil_scoped_release>())
+		.def("send_and_flush", &PyKcp::send_and_flush, "Send and flush.", py::arg("client"), py::arg("data"), py::arg("track") = false)
+		.def("client_stream", &PyKcp::client_stream, "Switch a client to byte stream mode, use write and read on both ends.")
+		.def("write", &PyKcp::stream_write, "Append bytes to a stream client, returns the number of bytes queued.", py::arg("client"), py::arg("data"), py::arg("flush") = false)
+		.def("read", &PyKcp::stream_read, "Read up to n bytes of a stream client, returns partial data as soon as some is available and b'' on timeout.", py::arg("client"), py::arg("n"), py::arg("timeout") = -1)
+		.def("send_file", &PyKcp::send_file, "Stream length bytes of fd from offset, 0 sends up to the end of the file. Wait for file_status sent == send_total before sending other messages.", py::arg("client"), py::arg("fd"), py::arg("offset") = 0, py::arg("length") = 0, py::call_guard<py::gil_scoped_release>())
+		.def("recv_file", &PyKcp::recv_file, "Write the next length bytes of messages from client to fd at offset, install it before the peer calls send_file.", py::arg("client"), py::arg("fd"), py::arg("length"), py::arg("offset") = 0, py::call_guard<py::gil_scoped_release>())
+		.def("file_status", &PyKcp::file_status, "Progress of the bulk transfers of a client.")
+		.def("rpc_register", &PyKcp::rpc_register, "Handle RPC method with handler(pykcp, client, call_id, payload). A non-None result is the reply, None defers it to rpc_reply. Enables RPC framing.")
+		.def("call", &PyKcp::call, "Send an RPC request, returns a concurrent.futures.Future resolved with the reply. Enables RPC framing.", py::arg("client"), py::arg("data"), py::arg("method") = 0, py::arg("flush") = true)
+		.def("rpc_reply", &PyKcp::rpc_reply, "Reply to an RPC call, in any order. Replies are queued even over the client watermark.", py::arg("client"), py::arg("call_id"), py::arg("data"), py::arg("status") = (int)RPC_OK, py::arg("flush") = true)
+		.def("rpc_enable", &PyKcp::rpc_enable, "Frame every message as RPC request or reply, recv_pkg and the recv callback stop receiving.")
+		.def("send_keyed", &PyKcp::send_keyed, "Send under a non-zero key, replacing the unsent message with the same key. Returns 1 if one was replaced, 0 if queued.", py::arg("client"), py::arg("key"), py::arg("data"), py::arg("flush") = false)
+		.def("acked", &PyKcp::acked, "Ids of tracked messages of a client acknowledged since the last call, in send order.")
+		.def("create_group", &PyKcp::create_group, "Create a broadcast group, returns its id.")
+		.def("remove_group", &PyKcp::remove_group, "Remove a broadcast group.")
+		.def("group_add", &PyKcp::group_add, "Add a client to a broadcast group.")
+		.def("group_remove", &PyKcp::group_remove, "Remove a client from a broadcast group.")
+		.def("group_send", &PyKcp::group_send, "Send one payload to every member, fragmented once per mss and shared. Members over their client_watermark are skipped. Returns the number of members it was queued on.", py::arg("gid"), py::arg("data"), py::arg("flush") = true)
+		.def("event_fd", &PyKcp::event_fd, "An eventfd that becomes readable when messages or writable clients are ready. recv_pkg must not be used afterwards.")
+		.def("recv_nowait", &PyKcp::recv_nowait, "Receive all complete messages without blocking.")
+		.def("recv_from", &PyKcp::recv_from, "Receive messages of one client, waiting up to timeout seconds.", py::arg("client"), py::arg("max_items") = 0, py::arg("timeout") = -1)
+		.def("want_writable", &PyKcp::want_writable, "Report the client in writable_clients once ikcp_waitsnd <= low_water, returns True if it already is. -1 uses the low watermark of the client.", py::arg("client"), py::arg("low_water") = -1)
+		.def("client_watermark", &PyKcp::client_watermark, "Sends return SEND_WOULD_BLOCK while ikcp_waitsnd >= high, the client becomes writable again at low. high 0 disables it.", py::arg("client"), py::arg("high"), py::arg("low") = 0)
+		.def("set_writable_cb", &PyKcp::set_writable_cb, "Set a callback(pykcp, client) for clients that fell to their low watermark after a send would block.")
+		.def("writable_clients", &PyKcp::writable_clients, "Clients that became writable since the last call.")
+		.def("send_many", &PyKcp::send_many, "Send a list of (client, buffer) and flush them together, returns the send result of each item.", py::arg("items"), py::arg("flush") = true)
+		.def("set_sockbuf", &PyKcp::set_sockbuf, "Set SO_RCVBUF/SO_SNDBUF in bytes, 0 keeps the current size.", py::arg("rcvbuf"), py::arg("sndbuf") = 0)
+		.def("set_sockbuf_auto", &PyKcp::set_sockbuf_auto, "Double the socket buffers on kernel drops, up to max_bytes.", py::arg("enable"), py::arg("max_bytes") = 0)
+		.def("sock_stats", &PyKcp::sock_stats, "Socket counters, kernel_drops is the SO_RXQ_OVFL drop count.")
+		.def("set_rate_limit", &PyKcp::set_rate_limit, "Limit inbound datagrams per peer address, 0 disables a limit.", py::arg("pps"), py::arg("bps") = 0, py::arg("burst_ms") = 100)
+		.def("rate_limit_stats", &PyKcp::rate_limit_stats, "List of (nip, nport, dropped_pkts, dropped_bytes) for limited peers.")
+		.def("set_fair_output", &PyKcp::set_fair_output, "Schedule output of all sessions with deficit round robin.", py::arg("enable"), py::arg("quantum") = 1500)
+		.def("client_weight", &PyKcp::client_weight, "Set the deficit round robin weight of a client.")
+		.def("add_path", &PyKcp::add_path, "Bind another local socket, returns the path index.", py::arg("ip"), py::arg("port"), py::arg("ifname") = "")
+		.def("client_add_path", &PyKcp::client_add_path, "Reach a client through a peer address on another path.")
+		.def("set_multipath_mode", &PyKcp::set_multipath_mode, "MULTIPATH_DUPLICATE, MULTIPATH_RETRANS or MULTIPATH_FASTEST.")
+		.def("set_shm", &PyKcp::set_shm, "Carry datagrams of peers on this host through shared memory instead of UDP. Both ends enable it, the dialing side before new_client. Returns 0 or -errno.", py::arg("enable") = true)
+		.def("multipath_stats", &PyKcp::multipath_stats, "List of (path, nip, nport, srtt_ms, tx_packets) of a client.");
+
+	py::class_<KcpRelay>(m, "KcpRelay")
+		.def(py::init<int32_t>(), py::arg("timeout") = 6)
+		.def("listen_tcp", &KcpRelay::listen_tcp, "Accept TCP connections and tunnel each one as a stream of one KCP session to the relay at remote_ip:remote_port. Returns 0 or -errno.", py::arg("local_ip"), py::arg("local_port"), py::arg("remote_ip"), py::arg("remote_port"))
+		.def("forward_tcp", &KcpRelay::forward_tcp, "Accept tunnel sessions on kcp_ip:kcp_port and connect each of their streams to target_ip:target_port. Returns 0 or -errno.", py::arg("kcp_ip"), py::arg("kcp_port"), py::arg("target_ip"), py::arg("target_port"))
+		.def("set_conv", &KcpRelay::set_conv, "Conversation id of the tunnel sessions, both relays must agree.")
+		.def("set_nodelay", &KcpRelay::set_nodelay, "kcp nodelay params of the tunnel sessions.")
+		.def("set_wndsize", &KcpRelay::set_wndsize, "kcp window size of the tunnel sessions.")
+		.def("set_watermark", &KcpRelay::set_watermark, "Stop reading TCP at high segments in flight, resume at low.", py::arg("high"), py::arg("low"))
+		.def("start", &KcpRelay::start, "Start relaying, configure routes and session params first.")
+		.def("stop", &KcpRelay::stop, "Reset every open tunnel and stop.", py::call_guard<py::gil_scoped_release>())
+		.def("stats", &KcpRelay::stats, "Counters: sessions_active, tunnels_opened, tunnels_active, tunnels_reset, bytes_to_kcp, bytes_to_tcp.");
+
+	m.attr("MULTIPATH_DUPLICATE") = (int)MULTIPATH_DUPLICATE;
+	m.attr("MULTIPATH_RETRANS") = (int)MULTIPATH_RETRANS;
+	m.attr("MULTIPATH_FASTEST") = (int)MULTIPATH_FASTEST;
+	m.attr("SEND_WOULD_BLOCK") = SEND_WOULD_BLOCK;
+
+	m.def("load_plugin", &load_plugin, "Load a native handler library, returns a capsule for PyKcp.set_plugin.", py::arg("path"), py::arg("symbol") = "kcp_plugin");
 }
\ No newline at end of file
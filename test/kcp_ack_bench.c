@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "ikcp.h"
+
+#define CONV 1
+#define MTU 1400
+#define ACKS_PER_PACKET ((MTU) / 20) // 与 ikcp_flush 一样，一个包塞满 ACK
+#define ACKS_PER_WINDOW_SIZE 262144  // 每个窗口大小至少处理这么多 ACK
+#define REPEAT 5                     // 每项重复几次取最小值，单次结果受调度和频率影响，能差出一倍
+
+static const int window_sizes[] = {32, 128, 1024, 8192, 40960};
+
+// 数据段只计数，不真正发出去
+static int null_output(const char *buf, int len, ikcpcb *kcp, void *user) {
+    (void)buf;
+    (void)kcp;
+    (*(long *)user) += len;
+    return len;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 按 ikcp_encode_seg 的格式写一个 ACK 段，小端
+static char *encode_ack(char *p, uint16_t wnd, uint32_t ts, uint32_t sn, uint32_t una) {
+    uint16_t zero = 0;
+    *p++ = CONV;
+    *p++ = 82; // IKCP_CMD_ACK
+    memcpy(p, &zero, 2); p += 2; // frg
+    memcpy(p, &wnd, 2); p += 2;
+    memcpy(p, &zero, 2); p += 2; // len
+    memcpy(p, &ts, 4); p += 4;
+    memcpy(p, &sn, 4); p += 4;
+    memcpy(p, &una, 4); p += 4;
+    return p;
+}
+
+// 把 count 个 ACK 打成 MTU 大小的包喂给 kcp，返回耗时
+static uint64_t feed_acks(ikcpcb *kcp, const uint32_t *sns, int count, uint32_t una, uint32_t ts, uint16_t wnd) {
+    char packet[MTU];
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i += ACKS_PER_PACKET) {
+        char *p = packet;
+        for (int j = i; j < count && j < i + ACKS_PER_PACKET; j++) {
+            p = encode_ack(p, wnd, ts, sns[j], una);
+        }
+        ikcp_input(kcp, packet, p - packet);
+    }
+    return now_ns() - start;
+}
+
+// 发满一个窗口，再按 half_lost 决定 ACK 的顺序：
+// 0 按序确认；1 偶数号的段丢了，先确认奇数号的，重传后再确认偶数号的
+static uint64_t run_window(ikcpcb *kcp, int wnd, int half_lost, uint32_t *sns) {
+    char msg[16] = {0};
+    uint32_t first = kcp->snd_nxt;
+    uint32_t current = kcp->current;
+    uint64_t elapsed;
+
+    for (int i = 0; i < wnd; i++) {
+        ikcp_send(kcp, msg, sizeof(msg));
+    }
+    ikcp_flush(kcp);
+    if ((int)(kcp->snd_nxt - first) != wnd) {
+        fprintf(stderr, "window not filled: %u of %d\n", kcp->snd_nxt - first, wnd);
+        exit(1);
+    }
+
+    if (half_lost) {
+        int count = 0;
+        for (int i = 1; i < wnd; i += 2) {
+            sns[count++] = first + i;
+        }
+        elapsed = feed_acks(kcp, sns, count, first, current, wnd);
+        count = 0;
+        for (int i = 0; i < wnd; i += 2) {
+            sns[count++] = first + i;
+        }
+        elapsed += feed_acks(kcp, sns, count, first, current, wnd);
+    } else {
+        for (int i = 0; i < wnd; i++) {
+            sns[i] = first + i;
+        }
+        elapsed = feed_acks(kcp, sns, wnd, first, current, wnd);
+    }
+    if (ikcp_waitsnd(kcp) != 0) {
+        fprintf(stderr, "%d segments left unacknowledged\n", ikcp_waitsnd(kcp));
+        exit(1);
+    }
+    return elapsed;
+}
+
+static double bench_once(int wnd, int half_lost) {
+    long sent = 0;
+    uint32_t *sns = malloc(sizeof(uint32_t) * wnd);
+    ikcpcb *kcp = ikcp_create(CONV, &sent);
+    int rounds = ACKS_PER_WINDOW_SIZE / wnd > 0 ? ACKS_PER_WINDOW_SIZE / wnd : 1;
+    uint64_t elapsed = 0;
+
+    ikcp_setoutput(kcp, null_output);
+    ikcp_setmtu(kcp, MTU);
+    ikcp_wndsize(kcp, wnd, wnd);
+    ikcp_nodelay(kcp, 1, 10, 2, 1);
+    ikcp_update(kcp, 1000);
+    // 对端窗口由 ACK 里的 wnd 带过来，第一轮之前先给够
+    kcp->rmt_wnd = wnd;
+
+    for (int r = 0; r < rounds; r++) {
+        elapsed += run_window(kcp, wnd, half_lost, sns);
+    }
+
+    ikcp_release(kcp);
+    free(sns);
+    return (double)elapsed / ((double)rounds * wnd);
+}
+
+static double bench(int wnd, int half_lost) {
+    double best = bench_once(wnd, half_lost);
+    for (int i = 1; i < REPEAT; i++) {
+        double ns = bench_once(wnd, half_lost);
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main() {
+    printf("%8s %16s %16s\n", "wnd", "in order ns/ack", "half lost ns/ack");
+    for (size_t i = 0; i < sizeof(window_sizes) / sizeof(window_sizes[0]); i++) {
+        int wnd = window_sizes[i];
+        printf("%8d %16.1f %16.1f\n", wnd, bench(wnd, 0), bench(wnd, 1));
+    }
+    return 0;
+}
\ No newline at end of file
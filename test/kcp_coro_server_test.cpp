@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+
+#include "kcp_coro.h"
+
+#define DEFAULT_PORT 9999
+#define TIMEOUT_SEC 3 // 超时时间（秒）
+#define DEFAULT_CONV 1 // 默认通道号，与 kcp_client_test 一致
+
+using namespace std;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signal) {
+    running = 0;
+}
+
+void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-p <port>]\r\n", prog_name);
+    exit(EXIT_FAILURE);
+}
+
+// 每个会话一个协程，收到什么就发回什么，发送积压超过水位时挂起
+KcpTask echo(KcpSession session) {
+    while (auto msg = co_await session.recv()) {
+        if (co_await session.send(msg->data(), msg->size()) < 0)
+            break;
+    }
+
+    struct in_addr addr = {session.client->nip};
+    printf("Client %s:%d disconnected\r\n", inet_ntoa(addr), ntohs(session.client->nport));
+}
+
+KcpTask serve(KcpCoroEngine &engine) {
+    while (true) {
+        KcpSession session = co_await engine.accept();
+        // 参数与客户端保持一致
+        engine.client_nodelay(session.client, 1, 10, 2, 1);
+        engine.client_wndsize(session.client, 128, 128);
+        engine.spawn(echo(session));
+    }
+}
+
+// 与 kcp_server_test 相同的回显服务，用协程写成，由 kcp_engine 的分发线程驱动
+int main(int argc, char *argv[]) {
+    int port = DEFAULT_PORT;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                if (port <= 0 || port > 65535) {
+                    fprintf(stderr, "Invalid port number.\r\n");
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    KcpCoroEngine engine("0.0.0.0", port, TIMEOUT_SEC);
+    engine.set_conv(DEFAULT_CONV);
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    engine.start();
+    engine.spawn(serve(engine));
+    printf("Server listening on port %d\r\n", port);
+
+    while (running)
+        pause();
+
+    engine.stop();
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+
+#include "kcp_engine.h"
+
+#define DEFAULT_PORT 9999
+#define TIMEOUT_SEC 3 // 超时时间（秒）
+#define DEFAULT_CONV 1 // 默认通道号，与 kcp_client_test 一致
+
+using namespace std;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signal) {
+    running = 0;
+}
+
+void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-p <port>]\r\n", prog_name);
+    exit(EXIT_FAILURE);
+}
+
+// 与 kcp_server_test 相同的回显服务，会话、线程和收发都交给 kcp_engine
+int main(int argc, char *argv[]) {
+    int port = DEFAULT_PORT;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                if (port <= 0 || port > 65535) {
+                    fprintf(stderr, "Invalid port number.\r\n");
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    KcpEngine engine("0.0.0.0", port, TIMEOUT_SEC);
+    engine.set_conv(DEFAULT_CONV);
+
+    // 准入回调在接收线程上运行，会话还未开始收发，参数与客户端保持一致
+    engine.set_create_cb([](KcpEngine *engine, shared_ptr<KcpClient> client) {
+        engine->client_nodelay(client, 1, 10, 2, 1);
+        engine->client_wndsize(client, 128, 128);
+        return true;
+    }, true);
+
+    engine.set_recv_cb([](KcpEngine *engine, shared_ptr<KcpClient> client, const char *data, size_t len) {
+        engine->send_and_flush(client, data, len);
+    });
+
+    engine.set_clean_cb([](KcpEngine *engine, shared_ptr<KcpClient> client) {
+        struct in_addr addr = {client->nip};
+        printf("Client %s:%d disconnected\r\n", inet_ntoa(addr), ntohs(client->nport));
+    });
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    engine.start();
+    printf("Server listening on port %d\r\n", port);
+
+    while (running)
+        pause();
+
+    engine.stop();
+    return 0;
+}
\ No newline at end of file
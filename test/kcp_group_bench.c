@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "ikcp.h"
+
+#define CONV 1
+#define ROUND_BYTES (64 * 1024 * 1024) // 每种组合至少广播这么多负载字节
+
+static const int member_counts[] = {1, 16, 256};
+static const int payload_sizes[] = {1024, 65536};
+
+// 只统计发送期间的分配
+static int counting = 0;
+static uint64_t allocated = 0;
+
+static void *counting_malloc(size_t size) {
+    if (counting)
+        allocated += size;
+    return malloc(size);
+}
+
+static void counting_free(void *ptr) {
+    free(ptr);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// shared 为 0 时每个成员各自 ikcp_send 一份，否则拆一次分片，各成员 ikcp_send_shared
+static uint64_t broadcast(ikcpcb **kcps, int members, const char *payload, int size, int shared) {
+    uint64_t start = now_ns();
+    counting = 1;
+    if (shared) {
+        ikcpmsg *msg = ikcp_msg_create(payload, size, kcps[0]->mss);
+        for (int i = 0; i < members; i++) {
+            ikcp_send_shared(kcps[i], msg);
+        }
+        ikcp_msg_release(msg);
+    } else {
+        for (int i = 0; i < members; i++) {
+            ikcp_send(kcps[i], payload, size);
+        }
+    }
+    counting = 0;
+    return now_ns() - start;
+}
+
+// 每轮用新的成员，snd_queue 不会越积越多
+static void bench(int members, int size, int shared, double *ns, double *bytes) {
+    ikcpcb **kcps = malloc(sizeof(ikcpcb *) * members);
+    char *payload = malloc(size);
+    int rounds = ROUND_BYTES / ((long)size * members);
+    uint64_t elapsed = 0;
+
+    if (rounds < 4)
+        rounds = 4;
+    memset(payload, 'x', size);
+    allocated = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < members; i++) {
+            kcps[i] = ikcp_create(CONV, NULL);
+        }
+        elapsed += broadcast(kcps, members, payload, size, shared);
+        for (int i = 0; i < members; i++) {
+            ikcp_release(kcps[i]);
+        }
+    }
+    *ns = (double)elapsed / rounds;
+    *bytes = (double)allocated / rounds / members;
+    free(payload);
+    free(kcps);
+}
+
+int main() {
+    ikcp_allocator(counting_malloc, counting_free);
+    printf("%8s %8s %14s %14s %14s %14s\n", "members", "payload",
+        "copy us/bcast", "copy B/member", "shared us/bcast", "shared B/member");
+    for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(member_counts) / sizeof(member_counts[0]); j++) {
+            double copy_ns, copy_bytes, shared_ns, shared_bytes;
+            bench(member_counts[j], payload_sizes[i], 0, &copy_ns, &copy_bytes);
+            bench(member_counts[j], payload_sizes[i], 1, &shared_ns, &shared_bytes);
+            printf("%8d %8d %14.1f %14.0f %14.1f %14.0f\n", member_counts[j], payload_sizes[i],
+                copy_ns / 1000, copy_bytes, shared_ns / 1000, shared_bytes);
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <set>
+#include <deque>
+#include <string>
+
+#include "kcp_engine.h"
+
+#define SENDER_PORT 9301
+#define PEER_PORT 9302
+#define ENGINE_CONV 0x55 // KcpEngine 的默认通道号
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// 两个 ikcp 对象之间的内存链路，不丢包
+static int queue_output(const char *buf, int len, ikcpcb *kcp, void *user) {
+    ((deque<string> *)user)->emplace_back(buf, len);
+    return len;
+}
+
+static void deliver(deque<string> &link, ikcpcb *dst) {
+    while (!link.empty()) {
+        ikcp_input(dst, link.front().data(), link.front().size());
+        link.pop_front();
+    }
+}
+
+// 第一个分片已经进入 snd_buf 的多分片消息不能再被替换，
+// 否则接收端会把旧消息的头分片和新消息拼在一起
+static void test_partially_sent() {
+    deque<string> a_to_b, b_to_a;
+    ikcpcb *a = ikcp_create(1, &a_to_b);
+    ikcpcb *b = ikcp_create(1, &b_to_a);
+    ikcp_setoutput(a, queue_output);
+    ikcp_setoutput(b, queue_output);
+    // 发送窗口只有一个分片
+    ikcp_wndsize(a, 1, 128);
+    ikcp_nodelay(a, 1, 10, 2, 1);
+    ikcp_nodelay(b, 1, 10, 2, 1);
+
+    string first(a->mss + 100, 'A');
+    string update(3000, 'B');
+    string stale(10, 'C');
+    string latest(20, 'D');
+
+    CHECK(ikcp_send_keyed(a, 1, first.data(), first.size(), NULL) == 0, "first keyed send");
+    ikcp_update(a, 0);
+    CHECK(a->nsnd_buf == 1 && a->nsnd_que == 1, "one fragment in flight, one queued: %u %u", a->nsnd_buf, a->nsnd_que);
+
+    // 头分片已发出，只能排在后面
+    CHECK(ikcp_send_keyed(a, 1, update.data(), update.size(), NULL) == 0, "update of a partially sent message must be queued");
+    // 完整留在 snd_queue 里的消息照常被替换
+    CHECK(ikcp_send_keyed(a, 2, stale.data(), stale.size(), NULL) == 0, "stale keyed send");
+    int behind = -1;
+    CHECK(ikcp_send_keyed(a, 2, latest.data(), latest.size(), &behind) == 1, "update of a queued message must replace it");
+    CHECK(behind == 0, "nothing queued behind the replaced message: %d", behind);
+
+    vector<string> expect = {first, update, latest};
+    vector<string> got;
+    char buffer[8192];
+    for (IUINT32 now = 10; now < 5000 && got.size() < expect.size(); now += 10) {
+        ikcp_update(a, now);
+        deliver(a_to_b, b);
+        ikcp_update(b, now);
+        deliver(b_to_a, a);
+        int n;
+        while ((n = ikcp_recv(b, buffer, sizeof(buffer))) > 0) {
+            got.emplace_back(buffer, n);
+        }
+    }
+
+    CHECK(got.size() == expect.size(), "received %zu messages, expected %zu", got.size(), expect.size());
+    for (size_t i = 0; i < got.size() && i < expect.size(); i++) {
+        CHECK(got[i] == expect[i], "message %zu: len=%zu first byte %c, expected len=%zu %c",
+            i, got[i].size(), got[i].empty() ? '-' : got[i][0], expect[i].size(), expect[i][0]);
+    }
+
+    ikcp_release(a);
+    ikcp_release(b);
+}
+
+// 手工应答的对端：只确认 sn 小于 limit 的数据段，返回已连续确认到的 sn
+static uint32_t ack_until(int sock, uint32_t una, uint32_t limit, int timeout_ms) {
+    char buf[2048];
+    sockaddr_in from;
+    socklen_t fromlen;
+    pollfd pfd = {sock, POLLIN, 0};
+
+    while (una < limit && poll(&pfd, 1, timeout_ms) > 0) {
+        fromlen = sizeof(from);
+        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr *)&from, &fromlen);
+        for (ssize_t pos = 0; pos + 20 <= n; ) {
+            uint8_t cmd = buf[pos + 1];
+            uint16_t len;
+            uint32_t ts, sn;
+            memcpy(&len, buf + pos + 6, 2);
+            memcpy(&ts, buf + pos + 8, 4);
+            memcpy(&sn, buf + pos + 12, 4);
+            pos += 20 + len;
+            if (cmd != 81 || sn >= limit) // 只处理 IKCP_CMD_PUSH
+                continue;
+            if (sn == una)
+                una++;
+            // 窗口只有一个分片，按序到达，逐个确认
+            char ack[20];
+            uint16_t zero = 0, wnd = 128;
+            ack[0] = ENGINE_CONV;
+            ack[1] = 82; // IKCP_CMD_ACK
+            memcpy(ack + 2, &zero, 2);
+            memcpy(ack + 4, &wnd, 2);
+            memcpy(ack + 6, &zero, 2);
+            memcpy(ack + 8, &ts, 4);
+            memcpy(ack + 12, &sn, 4);
+            memcpy(ack + 16, &una, 4);
+            sendto(sock, ack, sizeof(ack), 0, (sockaddr *)&from, fromlen);
+        }
+    }
+    return una;
+}
+
+static set<uint64_t> wait_acked(KcpEngine &engine, shared_ptr<KcpClient> client, set<uint64_t> ids, size_t want, int timeout_ms) {
+    for (int waited = 0; ; waited += 10) {
+        for (uint64_t id : engine.acked(client))
+            ids.insert(id);
+        if (ids.size() >= want || waited >= timeout_ms)
+            return ids;
+        usleep(10000);
+    }
+}
+
+// 替换 tracked 消息前面的 keyed 消息会改变它们的 sn，
+// 确认 id 不能在最后一个分片被确认之前上报
+static void test_tracked_behind_keyed() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(PEER_PORT);
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        failures++;
+        return;
+    }
+
+    KcpEngine sender("127.0.0.1", SENDER_PORT, 3);
+    sender.start();
+    shared_ptr<KcpClient> client = sender.new_client("127.0.0.1", PEER_PORT);
+    sender.client_wndsize(client, 1, 128);
+
+    // 最终 sn：t1=0，keyed 消息 1..3，t2=4，t3=5
+    string small(10, 'x');
+    string big(3000, 'k');
+    int64_t t1 = sender.send_tracked(client, small.data(), small.size());
+    CHECK(sender.send_keyed(client, 7, small.data(), small.size()) == 0, "first keyed send");
+    int64_t t2 = sender.send_tracked(client, small.data(), small.size());
+    CHECK(sender.send_keyed(client, 7, big.data(), big.size()) == 1, "keyed update must replace the queued one");
+    int64_t t3 = sender.send_tracked(client, small.data(), small.size());
+    CHECK(t1 > 0 && t2 > 0 && t3 > 0, "tracked sends: %ld %ld %ld", (long)t1, (long)t2, (long)t3);
+
+    // 确认到 sn 2，keyed 消息还差最后一个分片，t2 还没发出
+    uint32_t una = ack_until(sock, 0, 3, 1000);
+    CHECK(una == 3, "acknowledged up to %u", una);
+    set<uint64_t> ids = wait_acked(sender, client, {}, 2, 200);
+    CHECK(ids == set<uint64_t>({(uint64_t)t1}), "only t1 may be acked, got %zu ids", ids.size());
+
+    una = ack_until(sock, una, 6, 1000);
+    CHECK(una == 6, "acknowledged up to %u", una);
+    ids = wait_acked(sender, client, ids, 3, 1000);
+    CHECK(ids == set<uint64_t>({(uint64_t)t1, (uint64_t)t2, (uint64_t)t3}), "all tracked messages acked, got %zu ids", ids.size());
+
+    sender.stop();
+    close(sock);
+}
+
+int main() {
+    test_partially_sent();
+    test_tracked_behind_keyed();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("keyed send tests passed\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "kcp_engine.h"
+
+#define DEPTH 32
+#define PAYLOAD 64
+
+using namespace std;
+
+static uint64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool on_client_create(KcpEngine *engine, shared_ptr<KcpClient> client) {
+    engine->client_wndsize(client, 1024, 1024);
+    engine->client_nodelay(client, 1, 10, 2, 1);
+    return true;
+}
+
+struct BenchState {
+    vector<uint64_t> rtts;
+    atomic<int> received{0};
+    atomic<int> sent{0};
+    int count = 0;
+};
+
+static BenchState state;
+
+static void fill_stamp(char *buf) {
+    uint64_t now = now_us();
+    memset(buf, 0, PAYLOAD);
+    memcpy(buf, &now, sizeof(now));
+}
+
+// 客户端也用插件收包并发出下一条，两边都不经过分发线程，变化的只有服务端的回显路径
+static void on_reply(const kcp_plugin_api *api, void *engine, void *session, const char *data, int len, void *ctx) {
+    uint64_t stamp;
+    memcpy(&stamp, data, sizeof(stamp));
+    state.rtts.push_back(now_us() - stamp);
+    if (state.sent++ < state.count) {
+        char buf[PAYLOAD];
+        fill_stamp(buf);
+        if (api->send(engine, session, buf, sizeof(buf)) >= 0)
+            api->flush(engine, session);
+    }
+    state.received++;
+}
+
+static const kcp_plugin bench_client = {
+    KCP_PLUGIN_ABI,
+    "bench_client",
+    nullptr,
+    on_reply,
+    nullptr,
+};
+
+// plugin_bench.py 的 C++ 版本，不含 Python 和 GIL 的开销：
+// 回显服务要么在收包线程上调用 echo 插件，要么在分发线程的 recv 回调里 send_and_flush，
+// depth 为 1 时测 RTT，depth 为 DEPTH 时测吞吐
+static void bench(const kcp_plugin *plugin, int depth, int count, uint16_t port) {
+    KcpEngine server("127.0.0.1", port, 6);
+    server.set_create_cb(on_client_create, true);
+    if (plugin)
+        server.set_plugin(plugin);
+    else
+        server.set_recv_cb([](KcpEngine *engine, shared_ptr<KcpClient> client, const char *data, size_t len) {
+            engine->send_and_flush(client, data, len);
+        });
+    server.start();
+
+    state.rtts.clear();
+    state.rtts.reserve(count);
+    state.received = 0;
+    state.count = count;
+    state.sent = depth;
+
+    KcpEngine engine("127.0.0.1", 0, 6);
+    engine.set_plugin(&bench_client);
+    engine.start();
+
+    shared_ptr<KcpClient> client = engine.new_client("127.0.0.1", port);
+    on_client_create(&engine, client);
+
+    uint64_t start = now_us();
+    for (int i = 0; i < depth; i++) {
+        char buf[PAYLOAD];
+        fill_stamp(buf);
+        engine.send_buffer(client, buf, sizeof(buf));
+    }
+    engine.flush(client);
+    for (int waited = 0; state.received < count && waited < 60000; waited++)
+        usleep(1000);
+    uint64_t elapsed = now_us() - start;
+
+    engine.stop();
+    server.stop();
+
+    vector<uint64_t> &rtts = state.rtts;
+    sort(rtts.begin(), rtts.end());
+    if (rtts.empty()) {
+        printf("echo %-6s depth:%-2d no replies\n", plugin ? "plugin" : "recv", depth);
+        return;
+    }
+    printf("echo %-6s depth:%-2d count:%zu %lumsg/s p50:%luus p99:%luus\n",
+        plugin ? "plugin" : "recv", depth, rtts.size(), rtts.size() * 1000000 / elapsed,
+        rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100]);
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    const char *path = argc > 2 ? argv[2] : getenv("KCP_ECHO_PLUGIN");
+    if (!path) {
+        printf("usage: %s count echo_plugin.so\n", argv[0]);
+        return 1;
+    }
+    const kcp_plugin *plugin = KcpEngine::load_plugin(path);
+    if (!plugin) {
+        printf("load %s fail\n", path);
+        return 1;
+    }
+    for (int depth : {1, DEPTH}) {
+        bench(nullptr, depth, count, 19300);
+        bench(plugin, depth, count, 19301);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <string>
+
+#include "ikcp.h"
+
+#define CONV 1
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long max_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// 两个 kcp 首尾相连，输出直接喂给对端，不经过 socket
+static int peer_output(const char *buf, int len, ikcpcb *kcp, void *user) {
+    (void)kcp;
+    ikcp_input((ikcpcb *)user, buf, len);
+    return len;
+}
+
+// 改动前 recv_pkg 的做法：先收进 new char[]，再拷进 bytes；原代码还漏了 delete[]，leak 为真时照原样不释放
+static PyObject *recv_old(ikcpcb *kcp, int size, bool leak) {
+    char *buf = new char[size];
+    ikcp_recv(kcp, buf, size);
+    PyObject *obj = PyBytes_FromStringAndSize(buf, size);
+    if (!leak)
+        delete[] buf;
+    return obj;
+}
+
+// 现在 PyKcp::recvBytes 的做法：按最终大小建 bytes，分片直接合并进去
+static PyObject *recv_new(ikcpcb *kcp, int size, bool leak) {
+    (void)leak;
+    PyObject *obj = PyBytes_FromStringAndSize(NULL, size);
+    ikcp_recv(kcp, PyBytes_AS_STRING(obj), size);
+    return obj;
+}
+
+// 与 stress_client.py 相同的消息：pickle 过的 2000 项字典
+static std::string stress_payload() {
+    PyObject *globals = PyDict_New();
+    PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+    PyObject *ret = PyRun_String(
+        "import pickle\n"
+        "payload = pickle.dumps({x: str(x) for x in range(2000)})\n",
+        Py_file_input, globals, globals);
+    Py_XDECREF(ret);
+    PyObject *payload = PyDict_GetItemString(globals, "payload");
+    std::string data(PyBytes_AS_STRING(payload), PyBytes_GET_SIZE(payload));
+    Py_DECREF(globals);
+    return data;
+}
+
+static void bench(const char *name, PyObject *(*recv)(ikcpcb *, int, bool), bool leak, const std::string &payload, int count) {
+    ikcpcb *sender = ikcp_create(CONV, NULL);
+    ikcpcb *receiver = ikcp_create(CONV, NULL);
+    sender->user = receiver;
+    receiver->user = sender;
+    ikcp_setoutput(sender, peer_output);
+    ikcp_setoutput(receiver, peer_output);
+    // 关掉拥塞窗口，一次 flush 就把整条消息的分片都发出去
+    ikcp_nodelay(sender, 1, 10, 2, 1);
+    ikcp_nodelay(receiver, 1, 10, 2, 1);
+    ikcp_wndsize(sender, 128, 128);
+    ikcp_wndsize(receiver, 128, 128);
+    ikcp_update(sender, 0);
+    ikcp_update(receiver, 0);
+
+    long rss = max_rss_kb();
+    uint64_t spent = 0;
+    for (int i = 0; i < count; i++) {
+        ikcp_send(sender, payload.data(), payload.size());
+        ikcp_flush(sender);
+
+        // 只计时 recv_pkg 里被改动的那一段
+        uint64_t start = now_ns();
+        int size = ikcp_peeksize(receiver);
+        PyObject *obj = recv(receiver, size, leak);
+        spent += now_ns() - start;
+        if (PyBytes_GET_SIZE(obj) != (Py_ssize_t)payload.size()) {
+            printf("%s: got %zd bytes, want %zu\n", name, PyBytes_GET_SIZE(obj), payload.size());
+            exit(1);
+        }
+        Py_DECREF(obj);
+
+        // 回 ACK，发送窗口才会腾出来
+        ikcp_flush(receiver);
+    }
+
+    printf("%-12s pkg_len:%zu count:%d %.0fns/msg %.0fMB/s rss:+%ldKB\n",
+        name, payload.size(), count, (double)spent / count,
+        (double)payload.size() * count * 1000 / spent, max_rss_kb() - rss);
+    ikcp_release(sender);
+    ikcp_release(receiver);
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+
+    Py_Initialize();
+    std::string payload = stress_payload();
+    for (int round = 0; round < 2; round++) {
+        bench("new", recv_new, false, payload, count);
+        bench("old", recv_old, false, payload, count);
+    }
+    // 原来的 recv_pkg 每条消息漏掉一块和消息一样大的内存
+    bench("old leaking", recv_old, true, payload, count);
+    Py_Finalize();
+    return 0;
+}
\ No newline at end of file
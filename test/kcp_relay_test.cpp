@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "kcp_relay.h"
+
+#define TIMEOUT_SEC 3 // 超时时间（秒）
+#define DEFAULT_CONV 1
+
+using namespace std;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signal) {
+    running = 0;
+}
+
+void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s -l <tcp_port> -r <relay_ip:port> [-- <command>]\r\n", prog_name);
+    fprintf(stderr, "       %s -f <kcp_port> -t <target_ip:port> [-- <command>]\r\n", prog_name);
+    fprintf(stderr, "  -l: 入口，本地 TCP 连接经 KCP 转发到 -r 指定的出口\r\n");
+    fprintf(stderr, "  -f: 出口，接受 KCP 会话并连接到 -t 指定的 TCP 服务\r\n");
+    fprintf(stderr, "  command: 中继就绪后运行的程序，中继随它退出并返回它的退出码\r\n");
+    exit(EXIT_FAILURE);
+}
+
+static bool parse_addr(const char *arg, string &ip, uint16_t &port) {
+    const char *colon = strrchr(arg, ':');
+    if (colon == NULL)
+        return false;
+    int value = atoi(colon + 1);
+    if (value <= 0 || value > 65535)
+        return false;
+    ip.assign(arg, colon - arg);
+    port = value;
+    return true;
+}
+
+// 运行 tcp_client_test / tcp_server_test，中继被杀时子进程一起退出
+static pid_t run_command(char *argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    int listen_port = 0;
+    int forward_port = 0;
+    string ip;
+    uint16_t port = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:f:r:t:")) != -1) {
+        switch (c) {
+            case 'l':
+                listen_port = atoi(optarg);
+                break;
+            case 'f':
+                forward_port = atoi(optarg);
+                break;
+            case 'r':
+            case 't':
+                if (!parse_addr(optarg, ip, port)) {
+                    fprintf(stderr, "Invalid address %s.\r\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if ((listen_port > 0) == (forward_port > 0) || listen_port > 65535 || forward_port > 65535 || port == 0)
+        usage(argv[0]);
+
+    KcpRelay relay(TIMEOUT_SEC);
+    relay.set_conv(DEFAULT_CONV);
+
+    int ret = listen_port > 0 ? relay.listen_tcp("0.0.0.0", listen_port, ip, port)
+                              : relay.forward_tcp("0.0.0.0", forward_port, ip, port);
+    if (ret < 0) {
+        fprintf(stderr, "relay setup fail: %d\r\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    relay.start();
+    if (listen_port > 0)
+        printf("Relay tcp:%d -> kcp %s:%d\r\n", listen_port, ip.c_str(), port);
+    else
+        printf("Relay kcp:%d -> tcp %s:%d\r\n", forward_port, ip.c_str(), port);
+
+    int status = 0;
+    if (optind < argc) {
+        pid_t pid = run_command(&argv[optind]);
+        while (waitpid(pid, &status, 0) < 0 && running)
+            ;
+    } else {
+        while (running)
+            pause();
+    }
+
+    auto stats = relay.stats();
+    printf("tunnels %lu, to kcp %lu bytes, to tcp %lu bytes, reset %lu\r\n",
+           stats["tunnels_opened"], stats["bytes_to_kcp"], stats["bytes_to_tcp"], stats["tunnels_reset"]);
+    relay.stop();
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
\ No newline at end of file
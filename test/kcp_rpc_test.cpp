@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <atomic>
+
+#include "kcp_engine.h"
+
+#define CALLER_PORT 9311
+#define SERVER_PORT 9312
+#define HIGH_WATER 200
+#define METHOD_FILL 1
+#define METHOD_MISSING 9 // 服务端没有注册的方法
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+struct Result {
+    atomic<bool> done{false};
+    int status = -1;
+    string payload;
+};
+
+static RpcDone record(Result &result) {
+    return [&result](KcpEngine *, uint64_t, int status, const char *buf, size_t len) {
+        result.status = status;
+        result.payload.assign(buf, len);
+        result.done = true;
+    };
+}
+
+// 发送队列超过高水位时，应答（包括 NO_METHOD）仍然要发出去，
+// 否则调用方只能等到超时
+static void test_reply_over_watermark() {
+    KcpEngine caller("127.0.0.1", CALLER_PORT, 3);
+    KcpEngine server("127.0.0.1", SERVER_PORT, 3);
+    int filled = 0, fill_ret = 0, reply_ret = -1;
+
+    server.rpc_register(METHOD_FILL, [&](KcpEngine *engine, shared_ptr<KcpClient> client, uint64_t call_id, const char *buf, size_t len) {
+        // 先把会话塞到高水位以上，窗口外的段要好几个 RTT 才能发完
+        engine->client_watermark(client, HIGH_WATER, 0);
+        string filler(1000, 'x');
+        while ((fill_ret = engine->send_buffer(client, filler.data(), filler.size())) >= 0)
+            filled++;
+        reply_ret = engine->rpc_reply(client, call_id, "pong", 4);
+    });
+    server.start();
+    caller.start();
+
+    shared_ptr<KcpClient> client = caller.new_client("127.0.0.1", SERVER_PORT);
+    Result fill, missing;
+    // 两个调用一起发出，服务端按顺序处理，第二个的 NO_METHOD 应答也在会话塞满时发出
+    CHECK(caller.rpc_call(client, METHOD_FILL, "ping", 4, record(fill), false) > 0, "fill call");
+    CHECK(caller.rpc_call(client, METHOD_MISSING, "ping", 4, record(missing)) > 0, "missing method call");
+
+    for (int waited = 0; waited < 2000 && !(fill.done && missing.done); waited += 10)
+        usleep(10000);
+
+    CHECK(fill_ret == SEND_WOULD_BLOCK && filled >= HIGH_WATER, "session filled to the watermark: %d messages, last %d", filled, fill_ret);
+    CHECK(reply_ret >= 0, "rpc_reply over the watermark returned %d", reply_ret);
+    CHECK(fill.done && fill.status == RPC_OK && fill.payload == "pong", "reply over the watermark: done %d status %d", (int)fill.done, fill.status);
+    CHECK(missing.done && missing.status == RPC_NO_METHOD, "NO_METHOD reply over the watermark: done %d status %d", (int)missing.done, missing.status);
+
+    caller.stop();
+    server.stop();
+}
+
+int main() {
+    test_reply_over_watermark();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("rpc tests passed\n");
+    return 0;
+}
\ No newline at end of file
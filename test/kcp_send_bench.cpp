@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "kcp_engine.h"
+
+#define SERVER_PORT 18889
+#define PEERS 32
+#define PAYLOAD_LEN 60 // 与 send_bench.py 里 pickle 出来的负载差不多大
+
+using namespace std;
+
+static double now_sec() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 与 send_bench.py 相同的场景，不经过 Python：
+// 逐个 send_and_flush，对比 send_many 的做法，全部 send_buffer 后一次 flush_batch
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+
+    KcpEngine server("127.0.0.1", SERVER_PORT, 6);
+    server.set_create_cb([](KcpEngine *engine, shared_ptr<KcpClient> client) {
+        engine->client_wndsize(client, 4096, 4096);
+        return true;
+    }, true);
+    server.start();
+
+    vector<unique_ptr<KcpEngine>> peers;
+    for (int i = 0; i < PEERS; i++) {
+        peers.emplace_back(new KcpEngine("127.0.0.1", 0, 6));
+        peers.back()->start();
+        shared_ptr<KcpClient> client = peers.back()->new_client("127.0.0.1", SERVER_PORT);
+        peers.back()->client_wndsize(client, 4096, 4096);
+        peers.back()->send_and_flush(client, "hello", 5);
+    }
+
+    vector<shared_ptr<KcpClient>> clients;
+    char buf[256];
+    while (clients.size() < PEERS) {
+        for (auto &client : server.ready_clients()) {
+            while (server.recv(client, buf, sizeof(buf)) > 0)
+                clients.push_back(client);
+        }
+        usleep(1000);
+    }
+
+    string payload(PAYLOAD_LEN, 'p');
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (auto &client : clients)
+            server.send_and_flush(client, payload.data(), payload.size());
+    }
+    double loop_time = now_sec() - start;
+
+    // 等上一轮的数据确认完，两种方式从同样的状态开始
+    usleep(500000);
+    start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (auto &client : clients)
+            server.send_buffer(client, payload.data(), payload.size());
+        server.flush_batch(clients);
+    }
+    double many_time = now_sec() - start;
+
+    double msgs = (double)rounds * PEERS;
+    printf("send_and_flush loop: %d msg/s\n", (int)(msgs / loop_time));
+    printf("send_many:           %d msg/s\n", (int)(msgs / many_time));
+
+    for (auto &peer : peers)
+        peer->stop();
+    server.stop();
+    return 0;
+}
\ No newline at end of file
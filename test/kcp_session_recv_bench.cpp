@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+
+#include "kcp_engine.h"
+
+#define BASE_PORT 19000
+
+using namespace std;
+
+static uint64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void ping(KcpEngine &engine, shared_ptr<KcpClient> client) {
+    uint64_t sent = now_us();
+    engine.send_and_flush(client, (const char *)&sent, sizeof(sent));
+}
+
+// 与 session_recv_bench.py 相同的场景：一个引擎上 sessions 个会话，各自和一个回显服务乒乓，
+// callback 为 false 时每个会话一个线程阻塞在 wait_readable + recv 上，
+// 为 true 时由分发线程上的 recv 回调收包并发出下一个 ping
+static void bench(int sessions, bool callback, int rounds) {
+    vector<unique_ptr<KcpEngine>> servers;
+    for (int i = 0; i < sessions; i++) {
+        servers.emplace_back(new KcpEngine("127.0.0.1", BASE_PORT + i, 6));
+        servers.back()->set_recv_cb([](KcpEngine *engine, shared_ptr<KcpClient> client, const char *data, size_t len) {
+            engine->send_and_flush(client, data, len);
+        });
+        servers.back()->start();
+    }
+
+    KcpEngine engine("127.0.0.1", 0, 6);
+    vector<uint64_t> rtts;
+    mutex rtts_lock;
+    atomic<int> finished{0};
+    unordered_map<KcpClient *, int> counts;
+
+    if (callback) {
+        engine.set_recv_cb([&](KcpEngine *engine, shared_ptr<KcpClient> client, const char *data, size_t len) {
+            uint64_t sent;
+            memcpy(&sent, data, sizeof(sent));
+            rtts.push_back(now_us() - sent);
+            // 回调都在分发线程上，counts 不需要加锁
+            if (++counts[client.get()] < rounds)
+                ping(*engine, client);
+            else
+                finished++;
+        });
+    }
+    engine.start();
+
+    vector<shared_ptr<KcpClient>> clients;
+    for (int i = 0; i < sessions; i++)
+        clients.push_back(engine.new_client("127.0.0.1", BASE_PORT + i));
+
+    if (callback) {
+        for (auto &client : clients)
+            ping(engine, client);
+        for (int waited = 0; finished < sessions && waited < rounds * 1000; waited += 10)
+            usleep(10000);
+    } else {
+        vector<thread> threads;
+        for (auto &client : clients) {
+            threads.emplace_back([&, client] {
+                char buf[64];
+                vector<uint64_t> local;
+                for (int r = 0; r < rounds; r++) {
+                    ping(engine, client);
+                    if (!engine.wait_readable(client, chrono::steady_clock::now() + chrono::seconds(1)))
+                        continue;
+                    uint64_t sent;
+                    if (engine.recv(client, buf, sizeof(buf)) == sizeof(sent)) {
+                        memcpy(&sent, buf, sizeof(sent));
+                        local.push_back(now_us() - sent);
+                    }
+                }
+                lock_guard<mutex> guard(rtts_lock);
+                rtts.insert(rtts.end(), local.begin(), local.end());
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    engine.stop();
+    for (auto &server : servers)
+        server->stop();
+
+    sort(rtts.begin(), rtts.end());
+    if (rtts.empty()) {
+        printf("%-8s sessions:%d no replies\n", callback ? "callback" : "recv", sessions);
+        return;
+    }
+    printf("%-8s sessions:%-2d rounds:%d replies:%zu p50:%luus p99:%luus max:%luus\n",
+        callback ? "callback" : "recv", sessions, rounds, rtts.size(),
+        rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], rtts.back());
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    for (int sessions : {1, 4, 16}) {
+        bench(sessions, false, rounds);
+        bench(sessions, true, rounds);
+    }
+    return 0;
+}
\ No newline at end of file
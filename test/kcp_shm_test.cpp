@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+#include "kcp_engine.h"
+#include "kcp_shm.h"
+
+#define SERVER_PORT 9313
+#define SILENT_PEERS 8
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// 连上 shmListen 的抽象 socket 但不发 hello
+static int connect_silent(uint16_t port) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "pykcp.shm.%u", port);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (sockaddr *)&addr, offsetof(sockaddr_un, sun_path) + 1 + len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool hung_up(int fd) {
+    pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLIN));
+}
+
+// 几个只连不发 hello 的连接排在前面，正常的对端仍然要在超时前拿到共享内存通道，
+// 不发 hello 的连接过了 SHM_ACCEPT_TIMEOUT_MS 被关掉
+static void test_silent_peers() {
+    KcpEngine server("127.0.0.1", SERVER_PORT, 3);
+    KcpEngine client_engine("127.0.0.1", 0, 3);
+    atomic<int> replies{0};
+
+    server.set_recv_cb([](KcpEngine *engine, shared_ptr<KcpClient> client, const char *data, size_t len) {
+        engine->send_and_flush(client, data, len);
+    });
+    client_engine.set_recv_cb([&](KcpEngine *, shared_ptr<KcpClient>, const char *, size_t) {
+        replies++;
+    });
+    CHECK(server.set_shm(true) == 0, "server set_shm");
+    CHECK(client_engine.set_shm(true) == 0, "client set_shm");
+    server.start();
+    client_engine.start();
+
+    vector<int> silent;
+    for (int i = 0; i < SILENT_PEERS; i++)
+        silent.push_back(connect_silent(SERVER_PORT));
+    usleep(10000);
+
+    auto start = chrono::steady_clock::now();
+    shared_ptr<KcpClient> client = client_engine.new_client("127.0.0.1", SERVER_PORT);
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    client_engine.send_and_flush(client, "ping", 4);
+    for (int waited = 0; waited < 2000 && replies == 0; waited += 10)
+        usleep(10000);
+
+    auto stats = client_engine.sock_stats();
+    CHECK(elapsed < SHM_ACCEPT_TIMEOUT_MS, "new_client waited %ldms behind silent peers", (long)elapsed);
+    CHECK(replies > 0, "no reply");
+    CHECK(stats["shm_tx_packets"] > 0 && stats["tx_packets"] == 0,
+        "session fell back to UDP: shm_tx_packets %lu tx_packets %lu", stats["shm_tx_packets"], stats["tx_packets"]);
+
+    usleep((SHM_ACCEPT_TIMEOUT_MS + 200) * 1000);
+    int closed = 0;
+    for (int fd : silent) {
+        closed += fd >= 0 && hung_up(fd);
+        if (fd >= 0)
+            close(fd);
+    }
+    CHECK(closed == SILENT_PEERS, "%d of %d silent peers closed", closed, SILENT_PEERS);
+
+    client_engine.stop();
+    server.stop();
+}
+
+int main() {
+    test_silent_peers();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("shm tests passed\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <chrono>
+
+#include "kcp_engine.h"
+
+#define WRITE_LEN 64
+#define APPENDS 1000000
+#define PORT 19100
+
+using namespace std;
+
+static double now_sec() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int null_output(const char *buf, int len, ikcpcb *kcp, void *user) {
+    return len;
+}
+
+// 流模式下的小写入追加到最后一个分段里；mtu 越大每个分段追加的次数越多，
+// 如果每次追加都重新分配并拷贝分段，写入速度会随 mtu 下降
+static void bench_append(int mtu, int stream) {
+    char payload[WRITE_LEN];
+    memset(payload, 'x', sizeof(payload));
+    ikcpcb *kcp = ikcp_create(1, NULL);
+    ikcp_setoutput(kcp, null_output);
+    ikcp_setmtu(kcp, mtu);
+    kcp->stream = stream;
+
+    double start = now_sec();
+    for (int i = 0; i < APPENDS; i++)
+        ikcp_send(kcp, payload, sizeof(payload));
+    double elapsed = now_sec() - start;
+    printf("ikcp %-7s mtu:%d writes:%d %.0fwrites/s segments:%u\n",
+        stream ? "stream" : "message", mtu, APPENDS, APPENDS / elapsed, kcp->nsnd_que);
+    ikcp_release(kcp);
+}
+
+// 与 stream_bench.py 相同的场景，不经过 Python：64 字节的 stream_write 对比消息模式的 send_buffer
+static void bench_engine(bool stream, int count, uint16_t port) {
+    KcpEngine server("127.0.0.1", port, 6);
+    KcpEngine sender("127.0.0.1", 0, 6);
+    server.set_create_cb([stream](KcpEngine *engine, shared_ptr<KcpClient> client) {
+        engine->client_wndsize(client, 4096, 4096);
+        engine->client_stream(client, stream);
+        return true;
+    }, true);
+    server.start();
+    sender.start();
+    shared_ptr<KcpClient> client = sender.new_client("127.0.0.1", port);
+    sender.client_wndsize(client, 4096, 4096);
+    sender.client_stream(client, stream);
+
+    string payload(WRITE_LEN, 'x');
+    uint64_t total = (uint64_t)count * WRITE_LEN, received = 0;
+    double start = now_sec();
+    for (int i = 0; i < count; i++) {
+        if (stream)
+            sender.stream_write(client, payload.data(), payload.size());
+        else
+            sender.send_buffer(client, payload.data(), payload.size());
+    }
+    sender.flush(client);
+    double queued = now_sec();
+
+    static char buf[65536];
+    shared_ptr<KcpClient> peer;
+    while (received < total) {
+        if (!peer) {
+            server.wait_any();
+            auto ready = server.ready_clients();
+            if (!ready.empty())
+                peer = ready[0];
+            continue;
+        }
+        if (stream) {
+            ssize_t n = server.stream_read(peer, buf, sizeof(buf), 5);
+            if (n > 0)
+                received += n;
+            continue;
+        }
+        int n;
+        bool any = false;
+        while ((n = server.recv(peer, buf, sizeof(buf))) > 0) {
+            received += n;
+            any = true;
+        }
+        if (!any)
+            server.wait_any();
+    }
+    double end = now_sec();
+    printf("engine %-7s write_len:%d count:%d queue:%.0fwrites/s speed:%.1fMB/s\n",
+        stream ? "stream" : "message", WRITE_LEN, count, count / (queued - start),
+        received / (end - start) / 1024 / 1024);
+
+    sender.stop();
+    server.stop();
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    bench_append(1400, 0);
+    bench_append(1400, 1);
+    bench_append(9000, 1);
+    bench_engine(false, count, PORT);
+    bench_engine(true, count, PORT + 1);
+    return 0;
+}
\ No newline at end of file
@@ -24,10 +24,17 @@ VETH_SERVER="veth_$(uuidgen | cut -c -4)"
 VETH_CLIENT="veth_$(uuidgen | cut -c -4)"
 SERVER_IP="192.168.45.1/24"
 CLIENT_IP="192.168.45.2/24"
+# multipath 模式下的第二条链路
+VETH_SERVER2="veth_$(uuidgen | cut -c -4)"
+VETH_CLIENT2="veth_$(uuidgen | cut -c -4)"
+SERVER_IP2="192.168.46.1/24"
+CLIENT_IP2="192.168.46.2/24"
 
 # 定义丢包率和延时
 LOSS_RATE="10%"
 DELAY_TIME="20ms"
+LOSS_RATE2="30%"
+DELAY_TIME2="40ms"
 
 # 定义服务端和客户端程序路径
 CLIENT_PROGRAM=$1
@@ -43,8 +50,11 @@ fi
 cleanup() {
     echo "Cleaning up..."
     ip netns exec $CLIENT_NS tc qdisc del dev $VETH_CLIENT root 2>/dev/null || true
+    ip netns exec $CLIENT_NS tc qdisc del dev $VETH_CLIENT2 root 2>/dev/null || true
     ip link delete $VETH_SERVER 2>/dev/null || true
     ip link delete $VETH_CLIENT 2>/dev/null || true
+    ip link delete $VETH_SERVER2 2>/dev/null || true
+    ip link delete $VETH_CLIENT2 2>/dev/null || true
     ip netns delete $SERVER_NS 2>/dev/null || true
     ip netns delete $CLIENT_NS 2>/dev/null || true
 }
@@ -68,12 +78,28 @@ ip netns exec $CLIENT_NS ip addr add $CLIENT_IP dev $VETH_CLIENT || { echo "Fail
 # 启用网络接口
 ip netns exec $SERVER_NS ip link set $VETH_SERVER up || { echo "Failed to bring up $VETH_SERVER"; exit 1; }
 ip netns exec $CLIENT_NS ip link set $VETH_CLIENT up || { echo "Failed to bring up $VETH_CLIENT"; exit 1; }
+# 中继测试的 TCP 两端在各自命名空间内走回环
+ip netns exec $SERVER_NS ip link set lo up || { echo "Failed to bring up lo"; exit 1; }
+ip netns exec $CLIENT_NS ip link set lo up || { echo "Failed to bring up lo"; exit 1; }
 
 if [ "$5" == "delay" ]; then
     # 模拟丢包和延时（在客户端网络命名空间）
     ip netns exec $CLIENT_NS tc qdisc add dev $VETH_CLIENT root netem loss $LOSS_RATE delay $DELAY_TIME || { echo "Failed to set netem"; exit 1; }
 fi
 
+if [ "$5" == "multipath" ]; then
+    # 第二条链路，两条链路设置不同的丢包率和延时
+    ip link add $VETH_SERVER2 type veth peer name $VETH_CLIENT2 || { echo "Failed to create veth pair"; exit 1; }
+    ip link set $VETH_SERVER2 netns $SERVER_NS || { echo "Failed to move $VETH_SERVER2"; exit 1; }
+    ip link set $VETH_CLIENT2 netns $CLIENT_NS || { echo "Failed to move $VETH_CLIENT2"; exit 1; }
+    ip netns exec $SERVER_NS ip addr add $SERVER_IP2 dev $VETH_SERVER2 || { echo "Failed to set IP for server"; exit 1; }
+    ip netns exec $CLIENT_NS ip addr add $CLIENT_IP2 dev $VETH_CLIENT2 || { echo "Failed to set IP for client"; exit 1; }
+    ip netns exec $SERVER_NS ip link set $VETH_SERVER2 up || { echo "Failed to bring up $VETH_SERVER2"; exit 1; }
+    ip netns exec $CLIENT_NS ip link set $VETH_CLIENT2 up || { echo "Failed to bring up $VETH_CLIENT2"; exit 1; }
+    ip netns exec $CLIENT_NS tc qdisc add dev $VETH_CLIENT root netem loss $LOSS_RATE delay $DELAY_TIME || { echo "Failed to set netem"; exit 1; }
+    ip netns exec $CLIENT_NS tc qdisc add dev $VETH_CLIENT2 root netem loss $LOSS_RATE2 delay $DELAY_TIME2 || { echo "Failed to set netem"; exit 1; }
+fi
+
 # 运行服务端程序
 eval "ip netns exec $SERVER_NS $SERVER_PROGRAM $4 &"
 SERVER_PID=$!
@@ -0,0 +1,58 @@
+import sys
+import ikcp
+import time
+import utils
+import pickle
+import socket
+import threading
+
+DEPTH = 16
+COUNT = 500
+
+cond = threading.Condition()
+inflight = set()
+acked_total = 0
+
+def on_acked(udp_kcp, client, ids):
+	global acked_total
+	with cond:
+		for msg_id in ids:
+			inflight.discard(msg_id)
+		acked_total += len(ids)
+		cond.notify()
+
+def acked_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	udp_kcp.set_acked_cb(on_acked)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+	start = time.time()
+	for x in range(COUNT):
+		with cond:
+			while len(inflight) >= DEPTH:
+				if not cond.wait(5):
+					print(f"ack timeout, {len(inflight)} in flight")
+					sys.exit(1)
+		data = pickle.dumps({"seq" : x, "exit" : x == COUNT - 1})
+		msg_id = udp_kcp.send_and_flush(client, data, track=True)
+		if msg_id <= 0:
+			print(f"send failed {msg_id}")
+			sys.exit(1)
+		with cond:
+			inflight.add(msg_id)
+
+	with cond:
+		while inflight:
+			if not cond.wait(5):
+				print(f"ack timeout, {len(inflight)} in flight")
+				sys.exit(1)
+	ip_str = utils.int_to_ip_str(socket.ntohl(client.nip))
+	print(f"{ip_str} acked {acked_total} messages in {time.time() - start:.3f}s")
+	if acked_total != COUNT or udp_kcp.acked(client):
+		sys.exit(1)
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: acked_client.py <ip>")
+		sys.exit(1)
+	acked_test_client(sys.argv[1])
\ No newline at end of file
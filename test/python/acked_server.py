@@ -0,0 +1,24 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def acked_test_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	expect = 0
+	while True:
+		ret = udp_kcp.recv_pkg()
+		for client, data in ret:
+			obj = pickle.loads(data)
+			if obj["seq"] != expect:
+				print(f"out of order {obj['seq']} != {expect}")
+				sys.exit(1)
+			expect += 1
+			if obj["exit"]:
+				print(f"received {expect} messages")
+				# stay up so the update loop sends the last acks
+				time.sleep(1)
+				return
+
+if __name__ == '__main__':
+	acked_test_server()
\ No newline at end of file
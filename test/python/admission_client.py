@@ -0,0 +1,39 @@
+import sys
+import ikcp
+import time
+import pickle
+
+REFUSED_PORT = 18901
+ADMITTED_PORT = 18902
+
+def admission_test_client(ip):
+	# admission_server.py refuses odd ports inline, nothing may come back
+	refused = ikcp.PyKcp("0.0.0.0", REFUSED_PORT)
+	refused_client = refused.new_client(ip, 8888)
+	# stays well inside the second a refused peer is remembered, its retransmits keep coming
+	for x in range(3):
+		refused.send_and_flush(refused_client, pickle.dumps({"exit" : False}))
+		time.sleep(0.05)
+	if refused.recv_from(refused_client, 0, 0.3):
+		print("refused peer got a reply")
+		sys.exit(1)
+
+	admitted = ikcp.PyKcp("0.0.0.0", ADMITTED_PORT)
+	client = admitted.new_client(ip, 8888)
+	admitted.send_and_flush(client, pickle.dumps({"exit" : True}))
+	replies = admitted.recv_from(client, 1, 5)
+	if not replies:
+		print("admitted peer got no reply")
+		sys.exit(1)
+	# the refused peer is asked once, its retries within the second are dropped without a callback
+	creates = pickle.loads(replies[0])["creates"]
+	if creates != 2:
+		print(f"create callback ran {creates} times, want 2")
+		sys.exit(1)
+	print("admission ok")
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: admission_client.py <ip>")
+		sys.exit(1)
+	admission_test_client(sys.argv[1])
\ No newline at end of file
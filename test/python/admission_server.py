@@ -0,0 +1,27 @@
+import ikcp
+import pickle
+import socket
+
+creates = 0
+
+def on_client_create(udp_kcp, client):
+	global creates
+	creates = creates + 1
+	# peers on odd ports are refused
+	if socket.ntohs(client.nport) % 2:
+		return False
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	return True
+
+def admission_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	udp_kcp.set_create_cb(on_client_create, admission=True)
+	exit = False
+	while not exit:
+		for client, data in udp_kcp.recv_pkg():
+			obj = pickle.loads(data)
+			udp_kcp.send_and_flush(client, pickle.dumps({"creates" : creates}))
+			exit = obj["exit"]
+
+if __name__ == '__main__':
+	admission_server()
\ No newline at end of file
@@ -0,0 +1,53 @@
+import sys
+import ikcp
+import time
+import pickle
+import threading
+
+COUNT = 20000
+HIGH = 256
+LOW = 64
+
+writable = threading.Event()
+
+def on_writable(udp_kcp, client):
+	writable.set()
+
+def backpressure_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	udp_kcp.set_writable_cb(on_writable)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_wndsize(client, 128, 128)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+	udp_kcp.client_watermark(client, HIGH, LOW)
+
+	blocked = 0
+	max_waitsnd = 0
+	start = time.time()
+	for x in range(COUNT):
+		data = pickle.dumps({"seq" : x, "exit" : x == COUNT - 1})
+		while True:
+			writable.clear()
+			ret = udp_kcp.send_and_flush(client, data)
+			if ret != ikcp.SEND_WOULD_BLOCK:
+				break
+			blocked += 1
+			if not writable.wait(5):
+				print("no writable event")
+				sys.exit(1)
+		if ret < 0:
+			print(f"send failed {ret}")
+			sys.exit(1)
+		max_waitsnd = max(max_waitsnd, udp_kcp.file_status(client)["unacked"])
+
+	print(f"sent {COUNT} in {time.time() - start:.3f}s, blocked {blocked} times, max waitsnd {max_waitsnd}")
+	if blocked == 0 or max_waitsnd > HIGH:
+		sys.exit(1)
+	while udp_kcp.file_status(client)["unacked"] > 0:
+		time.sleep(0.05)
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: backpressure_client.py <ip>")
+		sys.exit(1)
+	backpressure_test_client(sys.argv[1])
\ No newline at end of file
@@ -0,0 +1,22 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def backpressure_test_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	expect = 0
+	while True:
+		for client, data in udp_kcp.recv_pkg():
+			obj = pickle.loads(data)
+			if obj["seq"] != expect:
+				print(f"out of order {obj['seq']} != {expect}")
+				sys.exit(1)
+			expect += 1
+			if obj["exit"]:
+				print(f"received {expect} messages")
+				time.sleep(1)
+				return
+
+if __name__ == '__main__':
+	backpressure_test_server()
\ No newline at end of file
@@ -0,0 +1,47 @@
+import sys
+import ikcp
+import pickle
+
+def payload(index, exit):
+	return pickle.dumps({"index" : index, "exit" : exit})
+
+def buffer_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	client = udp_kcp.new_client(ip, 8888)
+
+	# every form has to reach echo_server.py as the same bytes
+	forms = [
+		("bytearray", lambda data: bytearray(data)),
+		("memoryview", lambda data: memoryview(data)),
+		("memoryview slice", lambda data: memoryview(b"xx" + data + b"xx")[2:-2]),
+	]
+	try:
+		import numpy
+		forms.append(("numpy", lambda data: numpy.frombuffer(data, dtype=numpy.uint8)))
+	except ImportError:
+		print("numpy not installed, skipping numpy arrays")
+
+	# only contiguous buffers are accepted
+	for name, data in [("str", "send ok."), ("strided memoryview", memoryview(payload(0, False))[::2])]:
+		ret = udp_kcp.send_pkg(client, data)
+		if ret != -1:
+			print(f"send_pkg({name}) returned {ret}")
+			sys.exit(1)
+
+	for index, (name, form) in enumerate(forms):
+		data = payload(index, index == len(forms) - 1)
+		if udp_kcp.send_and_flush(client, form(data)) < 0:
+			print(f"send_and_flush({name}) failed")
+			sys.exit(1)
+		replies = udp_kcp.recv_from(client, 1, 5)
+		echoed = replies[0] if replies else None
+		if echoed != data:
+			print(f"{name}: echoed {echoed!r}, want {data!r}")
+			sys.exit(1)
+		print(f"{name} ok")
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: buffer_client.py <ip>")
+		sys.exit(1)
+	buffer_test_client(sys.argv[1])
\ No newline at end of file
@@ -0,0 +1,39 @@
+import sys
+import ikcp
+import time
+import pickle
+
+KEYS = 16
+ROUNDS = 2000
+
+def conflate_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+
+	replaced = 0
+	for r in range(ROUNDS):
+		for key in range(1, KEYS + 1):
+			ret = udp_kcp.send_keyed(client, key, pickle.dumps({"key" : key, "round" : r}))
+			if ret < 0:
+				print(f"send_keyed failed {ret}")
+				sys.exit(1)
+			replaced += ret
+		if r % 100 == 0:
+			udp_kcp.flush(client)
+	udp_kcp.send_and_flush(client, pickle.dumps({"key" : 0, "round" : ROUNDS}))
+	print(f"sent {KEYS * ROUNDS} updates, {replaced} replaced before sending")
+
+	result = None
+	while result is None:
+		for _, data in udp_kcp.recv_pkg():
+			result = data.decode("utf-8")
+	print(result)
+	if not result.startswith("ok"):
+		sys.exit(1)
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: conflate_client.py <ip>")
+		sys.exit(1)
+	conflate_test_client(sys.argv[1])
\ No newline at end of file
@@ -0,0 +1,30 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def conflate_test_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	latest = {}
+	received = 0
+	while True:
+		for client, data in udp_kcp.recv_pkg():
+			obj = pickle.loads(data)
+			if obj["key"] == 0:
+				# every key must end on the last round
+				final = obj["round"] - 1
+				stale = [key for key, r in latest.items() if r != final]
+				result = "ok" if latest and not stale else f"stale keys {stale}"
+				udp_kcp.send_and_flush(client, f"{result} received {received}".encode("utf-8"))
+				time.sleep(1)
+				return
+			# replacement keeps the order per key
+			if obj["round"] <= latest.get(obj["key"], -1):
+				udp_kcp.send_and_flush(client, b"out of order")
+				time.sleep(1)
+				return
+			latest[obj["key"]] = obj["round"]
+			received += 1
+
+if __name__ == '__main__':
+	conflate_test_server()
\ No newline at end of file
@@ -0,0 +1,30 @@
+import sys
+import ikcp
+import ikcp.aio
+import json
+import time
+import utils
+import pickle
+import socket
+import asyncio
+
+async def ping_test_client_aio(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	aio_kcp = ikcp.aio.AioKcp(udp_kcp)
+	client = udp_kcp.new_client(ip, 8888)
+	for x in range(10):
+		aio_kcp.send(client, pickle.dumps({"time" : time.time_ns() / 1000, "exit" : x == 9}))
+		await aio_kcp.drain(client)
+		client, data = await aio_kcp.recv()
+		ip = utils.int_to_ip_str(socket.ntohl(client.nip))
+		port = socket.ntohs(client.nport)
+		obj = pickle.loads(data)
+		print(f"PING {ip}:{port} {(time.time_ns() / 1000 - obj['time'])}us")
+		await asyncio.sleep(0.2)
+	aio_kcp.close()
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: echo_aio_client.py <ip>")
+		sys.exit(1)
+	asyncio.run(ping_test_client_aio(sys.argv[1]))
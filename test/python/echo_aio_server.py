@@ -0,0 +1,25 @@
+import sys
+import ikcp
+import ikcp.aio
+import json
+import time
+import utils
+import pickle
+import socket
+import asyncio
+
+async def echo_server_aio():
+	done = asyncio.Event()
+
+	async def on_recv(aio_kcp, client, data):
+		aio_kcp.send(client, data)
+		if pickle.loads(data)["exit"]:
+			done.set()
+
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	aio_kcp = ikcp.aio.AioKcp(udp_kcp, on_recv)
+	await done.wait()
+	aio_kcp.close()
+
+if __name__ == '__main__':
+	asyncio.run(echo_server_aio())
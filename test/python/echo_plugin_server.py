@@ -0,0 +1,14 @@
+import os
+import sys
+import ikcp
+import time
+
+def echo_plugin_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	udp_kcp.set_plugin(ikcp.load_plugin(os.environ["KCP_ECHO_PLUGIN"]))
+	# the plugin answers on the receive thread, Python only keeps the engine alive
+	while True:
+		time.sleep(1)
+
+if __name__ == '__main__':
+	echo_plugin_server()
\ No newline at end of file
@@ -0,0 +1,64 @@
+import os
+import sys
+import ikcp
+import time
+import hashlib
+import tempfile
+
+MIB = 1024 * 1024
+
+def vm_hwm():
+	with open("/proc/self/status") as f:
+		for line in f:
+			if line.startswith("VmHWM:"):
+				return line.split()[1] + " kB"
+	return "unknown"
+
+def file_test_client(ip, mib):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+
+	length = mib * MIB
+	out = tempfile.TemporaryFile()
+	udp_kcp.recv_file(client, out.fileno(), length)
+	start = time.time()
+	udp_kcp.send_and_flush(client, f"GET {mib}".encode("utf-8"))
+
+	deadline = start + 30 + mib
+	while True:
+		status = udp_kcp.file_status(client)
+		if status["error"]:
+			print(f"recv_file error {status['error']}")
+			sys.exit(1)
+		if status["received"] == length:
+			break
+		if time.time() > deadline:
+			print(f"timeout, received {status['received']} of {length}")
+			sys.exit(1)
+		time.sleep(0.01)
+	elapsed = time.time() - start
+
+	expect = None
+	while expect is None:
+		for _, data in udp_kcp.recv_pkg():
+			expect = data.decode("utf-8")
+
+	digest = hashlib.sha256()
+	out.seek(0)
+	while True:
+		block = out.read(MIB)
+		if not block:
+			break
+		digest.update(block)
+	if digest.hexdigest() != expect:
+		print("checksum mismatch")
+		sys.exit(1)
+	print(f"received {mib} MiB in {elapsed:.3f}s, {mib / elapsed:.1f} MiB/s, VmHWM {vm_hwm()}")
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: file_client.py <ip> [MiB]")
+		sys.exit(1)
+	file_test_client(sys.argv[1], int(sys.argv[2]) if len(sys.argv) > 2 else 16)
\ No newline at end of file
@@ -0,0 +1,61 @@
+import os
+import sys
+import ikcp
+import time
+import hashlib
+import tempfile
+
+MIB = 1024 * 1024
+
+def vm_hwm():
+	with open("/proc/self/status") as f:
+		for line in f:
+			if line.startswith("VmHWM:"):
+				return line.split()[1] + " kB"
+	return "unknown"
+
+def on_client_create(udp_kcp, client):
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+	return True
+
+def make_file(mib):
+	# the content is hashed while it is written, not read back
+	digest = hashlib.sha256()
+	f = tempfile.TemporaryFile()
+	block = bytearray(os.urandom(MIB))
+	for x in range(mib):
+		block[:8] = x.to_bytes(8, "little")
+		digest.update(block)
+		f.write(block)
+	f.flush()
+	return f, digest.hexdigest()
+
+def file_test_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	udp_kcp.set_create_cb(on_client_create, admission=True)
+	while True:
+		ret = udp_kcp.recv_pkg()
+		for client, data in ret:
+			cmd, mib = data.decode("utf-8").split()
+			if cmd != "GET":
+				continue
+			f, digest = make_file(int(mib))
+			start = time.time()
+			if udp_kcp.send_file(client, f.fileno()) != 0:
+				print("send_file failed")
+				sys.exit(1)
+			while True:
+				status = udp_kcp.file_status(client)
+				if status["error"]:
+					print(f"send_file error {status['error']}")
+					sys.exit(1)
+				if status["sent"] == status["send_total"]:
+					break
+				time.sleep(0.01)
+			f.close()
+			udp_kcp.send_and_flush(client, digest.encode("utf-8"))
+			print(f"queued {mib} MiB in {time.time() - start:.3f}s, VmHWM {vm_hwm()}")
+
+if __name__ == '__main__':
+	file_test_server()
\ No newline at end of file
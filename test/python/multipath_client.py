@@ -0,0 +1,44 @@
+import sys
+import ikcp
+import json
+import time
+import utils
+import pickle
+import socket
+import ctypes
+import asyncio
+import platform
+import threading
+
+MODES = {
+	"duplicate" : ikcp.MULTIPATH_DUPLICATE,
+	"retrans" : ikcp.MULTIPATH_RETRANS,
+	"fastest" : ikcp.MULTIPATH_FASTEST,
+}
+
+def ping_test_multipath(ip, ip2, mode):
+	udp_kcp = ikcp.PyKcp("192.168.45.2", 9001)
+	path = udp_kcp.add_path("192.168.46.2", 9002)
+	udp_kcp.set_multipath_mode(MODES[mode])
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_add_path(client, path, ip2, 8888)
+	all_time = 0
+	for x in range(50):
+		udp_kcp.send_and_flush(client, pickle.dumps({"time" : time.time_ns() / 1000, "exit" : x == 49}))
+		ret = udp_kcp.recv_pkg()
+		for client, data in ret:
+			obj = pickle.loads(data)
+			all_time = all_time + (time.time_ns() / 1000 - obj['time'])
+		time.sleep(0.02)
+
+	print(f"PING multipath mode:{mode} avg:{int(all_time / 50)}us")
+	for path, nip, nport, srtt, tx_packets in udp_kcp.multipath_stats(client):
+		ip = utils.int_to_ip_str(socket.ntohl(nip))
+		port = socket.ntohs(nport)
+		print(f"path:{path} {ip}:{port} srtt:{srtt}ms tx_packets:{tx_packets}")
+
+if __name__ == '__main__':
+	if len(sys.argv) < 4:
+		print("Usage: multipath_client.py <ip> <ip2> <duplicate|retrans|fastest>")
+		sys.exit(1)
+	ping_test_multipath(sys.argv[1], sys.argv[2], sys.argv[3])
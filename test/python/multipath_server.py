@@ -0,0 +1,38 @@
+import sys
+import ikcp
+import json
+import time
+import utils
+import pickle
+import socket
+import ctypes
+import asyncio
+import platform
+import threading
+
+MODES = {
+	"duplicate" : ikcp.MULTIPATH_DUPLICATE,
+	"retrans" : ikcp.MULTIPATH_RETRANS,
+	"fastest" : ikcp.MULTIPATH_FASTEST,
+}
+
+def echo_server_multipath(mode):
+	udp_kcp = ikcp.PyKcp("192.168.45.1", 8888)
+	path = udp_kcp.add_path("192.168.46.1", 8888)
+	udp_kcp.set_multipath_mode(MODES[mode])
+	# the client binds fixed ports, so its second address is known up front
+	peer = udp_kcp.new_client("192.168.45.2", 9001)
+	udp_kcp.client_add_path(peer, path, "192.168.46.2", 9002)
+	exit = False
+	while not exit:
+		ret = udp_kcp.recv_pkg()
+		for client, data in ret:
+			udp_kcp.send_and_flush(client, data)
+			obj = pickle.loads(data)
+			exit = obj["exit"]
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: multipath_server.py <duplicate|retrans|fastest>")
+		sys.exit(1)
+	echo_server_multipath(sys.argv[1])
@@ -0,0 +1,62 @@
+import os
+import sys
+import ikcp
+import time
+import multiprocessing
+
+DEPTH = 32
+PAYLOAD = b"x" * 64
+
+def on_client_create(udp_kcp, client):
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+	return True
+
+def echo_server(port, native, ready):
+	udp_kcp = ikcp.PyKcp("127.0.0.1", port)
+	udp_kcp.set_create_cb(on_client_create, admission=True)
+	if native:
+		udp_kcp.set_plugin(ikcp.load_plugin(os.environ["KCP_ECHO_PLUGIN"]))
+	ready.put(True)
+	while True:
+		if native:
+			time.sleep(1)
+			continue
+		# same loop as echo_server.py
+		for client, data in udp_kcp.recv_pkg():
+			udp_kcp.send_and_flush(client, data)
+
+def bench(native, count, port):
+	ctx = multiprocessing.get_context("spawn")
+	ready = ctx.Queue()
+	server = ctx.Process(target=echo_server, args=(port, native, ready), daemon=True)
+	server.start()
+	ready.get(timeout=10)
+
+	udp_kcp = ikcp.PyKcp("127.0.0.1", 0)
+	client = udp_kcp.new_client("127.0.0.1", port)
+	on_client_create(udp_kcp, client)
+
+	time_start = time.time_ns()
+	for x in range(DEPTH):
+		udp_kcp.send_pkg(client, PAYLOAD)
+	udp_kcp.flush(client)
+	sent = DEPTH
+	received = 0
+	while received < count:
+		for data in udp_kcp.recv_from(client, 0, 5):
+			received += 1
+			if sent < count:
+				udp_kcp.send_pkg(client, data)
+				sent += 1
+		udp_kcp.flush(client)
+	now = time.time_ns()
+	server.kill()
+
+	mode = "plugin" if native else "python"
+	print(f"echo {mode} depth:{DEPTH} count:{count} {int(count * 1000000000 / (now - time_start))}msg/s")
+
+if __name__ == '__main__':
+	count = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+	bench(False, count, 19300)
+	bench(True, count, 19301)
\ No newline at end of file
@@ -0,0 +1,38 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def on_client_create(udp_kcp, client):
+	udp_kcp.client_wndsize(client, 4096, 4096)
+	return True
+
+def recv_bench(count):
+	# same payload as stress_client.py
+	send_data = {}
+	for x in range(2000):
+		send_data[x] = str(x)
+	send_bytes = pickle.dumps(send_data)
+
+	server = ikcp.PyKcp("127.0.0.1", 18888)
+	server.set_create_cb(on_client_create, admission=True)
+	sender = ikcp.PyKcp("127.0.0.1", 0)
+	client = sender.new_client("127.0.0.1", 18888)
+	sender.client_wndsize(client, 4096, 4096)
+
+	time_start = time.time_ns()
+	for x in range(count):
+		sender.send_pkg(client, send_bytes)
+	sender.flush(client)
+
+	recv_count = 0
+	recv_len = 0
+	while recv_count < count:
+		for client, data in server.recv_pkg():
+			recv_count = recv_count + 1
+			recv_len = recv_len + len(data)
+	now = time.time_ns()
+	print(f"recv_pkg pkg_len:{len(send_bytes)} count:{count} speed:{int(recv_len * 1000000000 / (now - time_start) / 1024 / 1024)}MB/s")
+
+if __name__ == '__main__':
+	recv_bench(int(sys.argv[1]) if len(sys.argv) > 1 else 2000)
@@ -0,0 +1,96 @@
+import os
+import sys
+import errno
+import ikcp
+import time
+import multiprocessing
+
+PORT = 19200
+WORKERS = 3
+PEERS = 12
+SKIP = 77
+
+def worker(index, pin_path, ready):
+	udp_kcp = ikcp.PyKcp("127.0.0.1", PORT, reuseport=True)
+	ret = udp_kcp.join_reuseport(index, WORKERS, pin_path)
+	ready.put((index, ret))
+	if ret < 0:
+		return
+	count = {}
+	while True:
+		for client, data in udp_kcp.recv_pkg():
+			key = (client.nip, client.nport)
+			count[key] = count.get(key, 0) + 1
+			udp_kcp.send_and_flush(client, f"{index} {count[key]}".encode("utf-8"))
+
+def start_worker(ctx, index, pin_path):
+	ready = ctx.Queue()
+	proc = ctx.Process(target=worker, args=(index, pin_path, ready), daemon=True)
+	proc.start()
+	index, ret = ready.get(timeout=10)
+	if ret < 0:
+		print(f"join_reuseport failed: {os.strerror(-ret)}")
+		sys.exit(SKIP)
+	return proc
+
+def ping(peers):
+	replies = []
+	for udp_kcp, client in peers:
+		udp_kcp.send_and_flush(client, b"ping")
+		data = client.recv(5)
+		if data is None:
+			print("no reply")
+			sys.exit(1)
+		owner, count = data.decode("utf-8").split()
+		replies.append((int(owner), int(count)))
+	return replies
+
+def reuseport_test():
+	if not os.path.isdir("/sys/fs/bpf"):
+		print("bpffs not mounted")
+		sys.exit(SKIP)
+	pin_path = f"/sys/fs/bpf/pykcp_test_{os.getpid()}"
+	ctx = multiprocessing.get_context("spawn")
+	procs = [start_worker(ctx, i, pin_path) for i in range(WORKERS)]
+
+	try:
+		peers = []
+		for x in range(PEERS):
+			udp_kcp = ikcp.PyKcp("127.0.0.1", 0)
+			peers.append((udp_kcp, udp_kcp.new_client("127.0.0.1", PORT)))
+
+		first = ping(peers)
+		second = ping(peers)
+		for (owner, count), (owner2, count2) in zip(first, second):
+			if owner2 != owner or count2 != count + 1:
+				print(f"affinity lost {owner} -> {owner2}")
+				sys.exit(1)
+		print(f"owners {[owner for owner, _ in first]}")
+
+		# restart worker 0, sessions of the others must stay where they are
+		procs[0].kill()
+		procs[0].join()
+		procs[0] = start_worker(ctx, 0, pin_path)
+		# sessions owned by the killed worker are gone with it
+		kept = [(peer, reply) for peer, reply in zip(peers, second) if reply[0] != 0]
+		third = ping([peer for peer, _ in kept])
+		for (_, (owner, count)), (owner3, count3) in zip(kept, third):
+			if owner3 != owner or count3 != count + 1:
+				print(f"session of worker {owner} lost after restart")
+				sys.exit(1)
+		print(f"{len(kept)} sessions kept across a worker restart")
+
+		# a worker started with another group size must not join the pinned map
+		udp_kcp = ikcp.PyKcp("127.0.0.1", PORT, reuseport=True)
+		ret = udp_kcp.join_reuseport(0, WORKERS + 1, pin_path)
+		if ret != -errno.EINVAL:
+			print(f"join_reuseport with {WORKERS + 1} workers returned {ret}")
+			sys.exit(1)
+	finally:
+		for proc in procs:
+			proc.kill()
+		if os.path.exists(pin_path):
+			os.unlink(pin_path)
+
+if __name__ == '__main__':
+	reuseport_test()
\ No newline at end of file
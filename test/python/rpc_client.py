@@ -0,0 +1,46 @@
+import sys
+import ikcp
+import time
+import concurrent.futures
+
+METHOD_ECHO = 1
+METHOD_BATCH = 2
+METHOD_EXIT = 3
+COUNT = 512
+
+def rpc_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+
+	start = time.time()
+	calls = []
+	for x in range(COUNT):
+		payload = f"call {x}".encode("utf-8")
+		method = METHOD_ECHO if x % 2 else METHOD_BATCH
+		calls.append((method, payload, udp_kcp.call(client, payload, method, flush=False)))
+	udp_kcp.flush(client)
+
+	for method, payload, future in calls:
+		reply = future.result(timeout=10)
+		expect = payload if method == METHOD_ECHO else payload[::-1]
+		if reply != expect:
+			print(f"bad reply {reply} != {expect}")
+			sys.exit(1)
+	print(f"{COUNT} pipelined calls in {time.time() - start:.3f}s")
+
+	try:
+		udp_kcp.call(client, b"", 99).result(timeout=10)
+		print("unknown method did not fail")
+		sys.exit(1)
+	except RuntimeError as e:
+		print(f"unknown method: {e}")
+
+	print(udp_kcp.call(client, b"", METHOD_EXIT).result(timeout=10).decode("utf-8"))
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: rpc_client.py <ip>")
+		sys.exit(1)
+	rpc_test_client(sys.argv[1])
\ No newline at end of file
@@ -0,0 +1,41 @@
+import sys
+import ikcp
+import time
+import threading
+
+METHOD_ECHO = 1
+METHOD_BATCH = 2
+METHOD_EXIT = 3
+BATCH = 8
+
+done = threading.Event()
+deferred = []
+
+def on_echo(udp_kcp, client, call_id, data):
+	return data
+
+def on_batch(udp_kcp, client, call_id, data):
+	# answer a full batch at once, newest call first
+	deferred.append((client, call_id, data))
+	if len(deferred) == BATCH:
+		while deferred:
+			client, call_id, data = deferred.pop()
+			udp_kcp.rpc_reply(client, call_id, data[::-1], flush=False)
+		udp_kcp.flush(client)
+	return None
+
+def on_exit(udp_kcp, client, call_id, data):
+	done.set()
+	return b"bye"
+
+def rpc_test_server():
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 8888)
+	udp_kcp.rpc_register(METHOD_ECHO, on_echo)
+	udp_kcp.rpc_register(METHOD_BATCH, on_batch)
+	udp_kcp.rpc_register(METHOD_EXIT, on_exit)
+	done.wait()
+	# stay up so the last reply gets acknowledged
+	time.sleep(1)
+
+if __name__ == '__main__':
+	rpc_test_server()
\ No newline at end of file
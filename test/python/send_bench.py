@@ -0,0 +1,45 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def on_client_create(udp_kcp, client):
+	udp_kcp.client_wndsize(client, 4096, 4096)
+	return True
+
+def send_bench(peers_num, rounds):
+	server = ikcp.PyKcp("127.0.0.1", 18889)
+	server.set_create_cb(on_client_create, admission=True)
+
+	peers = []
+	for x in range(peers_num):
+		peer = ikcp.PyKcp("127.0.0.1", 0)
+		client = peer.new_client("127.0.0.1", 18889)
+		peer.client_wndsize(client, 4096, 4096)
+		peer.send_and_flush(client, b"hello")
+		peers.append(peer)
+
+	clients = []
+	while len(clients) < peers_num:
+		for client, data in server.recv_pkg():
+			clients.append(client)
+
+	payload = pickle.dumps({"time" : time.time_ns() / 1000, "exit" : False})
+
+	time_start = time.time_ns()
+	for x in range(rounds):
+		for client in clients:
+			server.send_and_flush(client, payload)
+	loop_time = time.time_ns() - time_start
+
+	time_start = time.time_ns()
+	for x in range(rounds):
+		server.send_many([(client, payload) for client in clients])
+	many_time = time.time_ns() - time_start
+
+	msgs = rounds * peers_num
+	print(f"send_and_flush loop: {int(msgs * 1000000000 / loop_time)} msg/s")
+	print(f"send_many:           {int(msgs * 1000000000 / many_time)} msg/s")
+
+if __name__ == '__main__':
+	send_bench(32, int(sys.argv[1]) if len(sys.argv) > 1 else 200)
@@ -0,0 +1,46 @@
+import sys
+import ikcp
+import time
+import pickle
+import threading
+
+def server_recv_cb(udp_kcp, client, data):
+	udp_kcp.send_and_flush(client, data)
+
+def ping_thread(udp_kcp, client, rounds, results, index):
+	all_time = 0
+	for x in range(rounds):
+		udp_kcp.send_and_flush(client, pickle.dumps({"time" : time.time_ns() / 1000}))
+		data = client.recv(timeout=1.0)
+		if data is None:
+			print(f"session {index} timeout")
+			continue
+		all_time = all_time + (time.time_ns() / 1000 - pickle.loads(data)['time'])
+	results[index] = all_time / rounds
+
+def session_recv_bench(clients_num, rounds):
+	servers = []
+	for x in range(clients_num):
+		server = ikcp.PyKcp("127.0.0.1", 19000 + x)
+		server.set_recv_cb(server_recv_cb)
+		servers.append(server)
+
+	# one engine, one session per server, one thread per session
+	udp_kcp = ikcp.PyKcp("127.0.0.1", 0)
+	results = [0] * clients_num
+	threads = []
+	for x in range(clients_num):
+		client = udp_kcp.new_client("127.0.0.1", 19000 + x)
+		thread = threading.Thread(target=ping_thread, args=(udp_kcp, client, rounds, results, x))
+		threads.append(thread)
+	for thread in threads:
+		thread.start()
+	for thread in threads:
+		thread.join()
+
+	print(f"client.recv sessions:{clients_num} rounds:{rounds} avg:{int(sum(results) / clients_num)}us max:{int(max(results))}us")
+
+if __name__ == '__main__':
+	rounds = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+	for clients_num in [1, 4, 16]:
+		session_recv_bench(clients_num, rounds)
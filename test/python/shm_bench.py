@@ -0,0 +1,70 @@
+import os
+import sys
+import ikcp
+import time
+import multiprocessing
+
+DEPTH = 32
+PAYLOAD = b"x" * 1024
+
+def on_client_create(udp_kcp, client):
+	udp_kcp.client_wndsize(client, 1024, 1024)
+	udp_kcp.client_nodelay(client, 1, 10, 2, 1)
+	return True
+
+def echo_server(port, shm, ready):
+	udp_kcp = ikcp.PyKcp("127.0.0.1", port)
+	udp_kcp.set_create_cb(on_client_create, admission=True)
+	if shm:
+		udp_kcp.set_shm(True)
+	# native echo, so the transport rather than the interpreter is measured
+	udp_kcp.set_plugin(ikcp.load_plugin(os.environ["KCP_ECHO_PLUGIN"]))
+	ready.put(True)
+	while True:
+		time.sleep(1)
+
+def bench(shm, count, port):
+	ctx = multiprocessing.get_context("spawn")
+	ready = ctx.Queue()
+	server = ctx.Process(target=echo_server, args=(port, shm, ready), daemon=True)
+	server.start()
+	ready.get(timeout=10)
+
+	udp_kcp = ikcp.PyKcp("127.0.0.1", 0)
+	if shm:
+		udp_kcp.set_shm(True)
+	client = udp_kcp.new_client("127.0.0.1", port)
+	on_client_create(udp_kcp, client)
+
+	rounds = count // 10
+	time_start = time.time_ns()
+	for x in range(rounds):
+		udp_kcp.send_and_flush(client, PAYLOAD[:64])
+		udp_kcp.recv_from(client, 1, 5)
+	rtt = (time.time_ns() - time_start) / rounds / 1000
+
+	time_start = time.time_ns()
+	for x in range(DEPTH):
+		udp_kcp.send_pkg(client, PAYLOAD)
+	udp_kcp.flush(client)
+	sent = DEPTH
+	received = 0
+	while received < count:
+		for data in udp_kcp.recv_from(client, 0, 5):
+			received += 1
+			if sent < count:
+				udp_kcp.send_pkg(client, data)
+				sent += 1
+		udp_kcp.flush(client)
+	now = time.time_ns()
+	server.kill()
+
+	stats = udp_kcp.sock_stats()
+	mode = "shm" if shm else "udp"
+	speed = count * len(PAYLOAD) * 1000000000 / (now - time_start) / 1024 / 1024
+	print(f"echo {mode} rtt:{rtt:.1f}us depth:{DEPTH} count:{count} {int(count * 1000000000 / (now - time_start))}msg/s {int(speed)}MB/s shm_tx_packets:{stats['shm_tx_packets']}")
+
+if __name__ == '__main__':
+	count = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+	bench(False, count, 19310)
+	bench(True, count, 19311)
\ No newline at end of file
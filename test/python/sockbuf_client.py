@@ -0,0 +1,51 @@
+import sys
+import ikcp
+import time
+import pickle
+
+def sockbuf_test_client(ip):
+	udp_kcp = ikcp.PyKcp("0.0.0.0", 0)
+	client = udp_kcp.new_client(ip, 8888)
+	udp_kcp.client_wndsize(client, 40960, 40960)
+
+	stats = udp_kcp.sock_stats()
+	start_rcvbuf = stats['rcvbuf']
+	if udp_kcp.set_sockbuf(256 * 1024, 256 * 1024) < 0:
+		print("set_sockbuf failed")
+		sys.exit(1)
+	stats = udp_kcp.sock_stats()
+	print(f"rcvbuf:{start_rcvbuf} -> {stats['rcvbuf']} sndbuf:{stats['sndbuf']}")
+	if stats['rcvbuf'] <= 0 or stats['sndbuf'] <= 0:
+		print("sock_stats reports no buffer size")
+		sys.exit(1)
+
+	# same bursts as the batch mode of stress_client.py, the receive buffer grows on drops
+	udp_kcp.set_sockbuf_auto(True, 8 * 1024 * 1024)
+	send_data = {}
+	for x in range(2000):
+		send_data[x] = str(x)
+
+	received = 0
+	time_start = time.time_ns()
+	for x in range(10):
+		send_data[1000] = str(x)
+		send_bytes = pickle.dumps(send_data)
+		for i in range(10):
+			udp_kcp.send_and_flush(client, send_bytes)
+		for i in range(10):
+			received = received + len(udp_kcp.recv_pkg())
+	now = time.time_ns()
+
+	before = stats
+	stats = udp_kcp.sock_stats()
+	print(f"received:{received} {int((now - time_start) / 1000000)}ms")
+	print(f"kernel_drops:{stats['kernel_drops']} retransmits:{stats['retransmits']} rcvbuf:{stats['rcvbuf']} sndbuf:{stats['sndbuf']}")
+	if stats['kernel_drops'] > 0 and stats['rcvbuf'] <= before['rcvbuf']:
+		print("kernel dropped datagrams but the receive buffer did not grow")
+		sys.exit(1)
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print("Usage: sockbuf_client.py <ip>")
+		sys.exit(1)
+	sockbuf_test_client(sys.argv[1])
\ No newline at end of file
@@ -0,0 +1,52 @@
+import sys
+import ikcp
+import time
+
+WRITE_LEN = 64
+
+def bench(stream, count, port):
+	def on_client_create(udp_kcp, client):
+		udp_kcp.client_wndsize(client, 4096, 4096)
+		udp_kcp.client_stream(client, stream)
+		return True
+
+	server = ikcp.PyKcp("127.0.0.1", port)
+	server.set_create_cb(on_client_create, admission=True)
+	sender = ikcp.PyKcp("127.0.0.1", 0)
+	client = sender.new_client("127.0.0.1", port)
+	sender.client_wndsize(client, 4096, 4096)
+	sender.client_stream(client, stream)
+
+	payload = b"x" * WRITE_LEN
+	total = count * WRITE_LEN
+	time_start = time.time_ns()
+	for x in range(count):
+		if stream:
+			sender.write(client, payload)
+		else:
+			sender.send_pkg(client, payload)
+	sender.flush(client)
+	queued = time.time_ns()
+
+	recv_len = 0
+	peer = None
+	while recv_len < total:
+		if stream:
+			if peer is None:
+				for peer, data in server.recv_pkg():
+					recv_len += len(data)
+				continue
+			recv_len += len(server.read(peer, 65536, 5))
+		else:
+			for peer, data in server.recv_pkg():
+				recv_len += len(data)
+	now = time.time_ns()
+	mode = "stream" if stream else "message"
+	print(f"{mode} write_len:{WRITE_LEN} count:{count} "
+		f"queue:{int(count * 1000000000 / (queued - time_start))}writes/s "
+		f"speed:{recv_len * 1000000000 / (now - time_start) / 1024 / 1024:.1f}MB/s")
+
+if __name__ == '__main__':
+	count = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+	bench(False, count, 19100)
+	bench(True, count, 19101)
\ No newline at end of file